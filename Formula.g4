@@ -1,3 +1,5 @@
+// Грамматика формул. Генератор по ней не запускается: её повторяет
+// рукописный разборщик ASTImpl::Parser в FormulaAST.cpp.
 grammar Formula;
 
 main
@@ -9,10 +11,18 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | expr (LT | LE | GT | GE | EQ | NE) expr  # Comparison
+        | IF '(' expr ',' expr ',' expr ')'  # If
+        | MATCH '(' expr ',' range ')'  # Match
+        | VLOOKUP '(' expr ',' range ',' NUMBER ')'  # VLookup
         | CELL  # Cell
         | NUMBER  # Literal
         ;
 
+range
+        : CELL ':' CELL
+        ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -26,5 +36,14 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
+EQ: '=' ;
+NE: '<>' ;
+IF: 'IF' ;
+MATCH: 'MATCH' ;
+VLOOKUP: 'VLOOKUP' ;
 CELL: [A-Z]+[0-9]+ ;
-WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
+WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
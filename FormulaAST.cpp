@@ -1,18 +1,20 @@
 #include "FormulaAST.h"
 
-#include "FormulaBaseListener.h"
-#include "FormulaLexer.h"
-#include "FormulaParser.h"
-
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <iterator>
 #include <memory>
 #include <optional>
-#include <sstream>
+#include <istream>
+#include <ostream>
+#include <string_view>
 
 namespace ASTImpl {
 
     enum ExprPrecedence {
+        EP_CMP,
         EP_ADD,
         EP_SUB,
         EP_MUL,
@@ -58,383 +60,876 @@ namespace ASTImpl {
     //     (currently in the table we're always putting in the parentheses)
     // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
     // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+    // (A < B) < C - always okay (comparisons are left-associative)
+    // A < (B < C) - never okay
+    // A + (B < C), -(A < B) - never okay (comparisons have the lowest grammatic precedence)
     constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-        /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_CMP */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+        /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+        /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
-    class Expr {
-    public:
-        virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const std::function<double(Position)>& cells) const = 0; ///!!!!!!!!!!!!
+    namespace {
+        using Node = FormulaProgram::Op;
+        using NodeType = FormulaProgram::OpCode;
 
         // higher is tighter
-        virtual ExprPrecedence GetPrecedence() const = 0;
+        ExprPrecedence GetPrecedence(const Node& node) {
+            if (node.IsComparison()) {
+                return EP_CMP;
+            }
+            switch (node.code) {
+            case NodeType::Add:
+                return EP_ADD;
+            case NodeType::Subtract:
+                return EP_SUB;
+            case NodeType::Multiply:
+                return EP_MUL;
+            case NodeType::Divide:
+                return EP_DIV;
+            case NodeType::UnaryPlus:
+            case NodeType::UnaryMinus:
+                return EP_UNARY;
+            default:
+                return EP_ATOM;
+            }
+        }
+
+        const char* GetOperationSign(const Node& node) {
+            switch (node.code) {
+            case NodeType::Add:
+            case NodeType::UnaryPlus:
+                return "+";
+            case NodeType::Subtract:
+            case NodeType::UnaryMinus:
+                return "-";
+            case NodeType::Multiply:
+                return "*";
+            case NodeType::Divide:
+                return "/";
+            case NodeType::Less:
+                return "<";
+            case NodeType::LessEqual:
+                return "<=";
+            case NodeType::Greater:
+                return ">";
+            case NodeType::GreaterEqual:
+                return ">=";
+            case NodeType::Equal:
+                return "=";
+            case NodeType::NotEqual:
+                return "<>";
+            default:
+                // have to do this because VC++ has a buggy warning
+                assert(false);
+                return "?";
+            }
+        }
+
+        void PrintCell(std::ostream& out, Position cell) {
+            if (!cell.IsValid()) {
+                out << FormulaError::Category::Ref;
+            }
+            else {
+                out << cell.ToString();
+            }
+        }
+
+        // ссылка на удалённую ячейку хранится как число-ошибка
+        void PrintNumber(std::ostream& out, double number) {
+            if (FormulaValue::IsError(number)) {
+                out << FormulaError(FormulaValue::GetErrorCategory(number));
+            }
+            else {
+                out << number;
+            }
+        }
+
+        void PrintRange(std::ostream& out, const FormulaProgram::Range& range) {
+            if (!range.first.IsValid()) {
+                out << FormulaError::Category::Ref;
+                return;
+            }
+            PrintCell(out, range.first);
+            out << ':';
+            PrintCell(out, range.last);
+        }
+
+        const char* GetFunctionName(const Node& node) {
+            return node.code == NodeType::Match ? "MATCH" : "VLOOKUP";
+        }
+
+        // Корень ветви "то": узел перед Jump, на который указывает JumpIfFalse
+        // сразу за условием
+        std::size_t GetThenRoot(const FormulaProgram& program, const Node& node) {
+            return program.ops[node.lhs + 1].lhs - 1;
+        }
+
+        // Узлы обходятся рекурсивно по индексам: глубина рекурсии ограничена
+        // вложенностью формулы, а не числом ячеек таблицы.
+        void Print(const FormulaProgram& program, std::size_t index, std::ostream& out) {
+            const Node& node = program.ops[index];
+            if (node.IsBinary()) {
+                out << '(' << GetOperationSign(node) << ' ';
+                Print(program, node.lhs, out);
+                out << ' ';
+                Print(program, index - 1, out);
+                out << ')';
+            }
+            else if (node.code == NodeType::If) {
+                out << "(IF ";
+                Print(program, node.lhs, out);
+                out << ' ';
+                Print(program, GetThenRoot(program, node), out);
+                out << ' ';
+                Print(program, index - 1, out);
+                out << ')';
+            }
+            else if (node.IsLookup()) {
+                out << '(' << GetFunctionName(node) << ' ';
+                Print(program, index - 1, out);
+                out << ' ';
+                PrintRange(out, program.ranges[node.lookup.range]);
+                if (node.code == NodeType::VLookup) {
+                    out << ' ' << node.lookup.column + 1;
+                }
+                out << ')';
+            }
+            else if (node.IsUnary()) {
+                out << '(' << GetOperationSign(node) << ' ';
+                Print(program, index - 1, out);
+                out << ')';
+            }
+            else if (node.code == NodeType::Cell) {
+                PrintCell(out, node.cell);
+            }
+            else {
+                PrintNumber(out, node.number);
+            }
+        }
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-            bool right_child = false) const {
-            auto precedence = GetPrecedence();
+        void PrintFormula(const FormulaProgram& program, std::size_t index, std::ostream& out,
+            ExprPrecedence parent_precedence, bool right_child = false) {
+            const Node& node = program.ops[index];
+            auto precedence = GetPrecedence(node);
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
             bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
             if (parens_needed) {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            if (node.IsBinary()) {
+                PrintFormula(program, node.lhs, out, precedence);
+                out << GetOperationSign(node);
+                PrintFormula(program, index - 1, out, precedence, /* right_child = */ true);
+            }
+            else if (node.IsUnary()) {
+                out << GetOperationSign(node);
+                PrintFormula(program, index - 1, out, precedence);
+            }
+            else if (node.code == NodeType::If) {
+                out << "IF(";
+                PrintFormula(program, node.lhs, out, EP_ATOM);
+                out << ',';
+                PrintFormula(program, GetThenRoot(program, node), out, EP_ATOM);
+                out << ',';
+                PrintFormula(program, index - 1, out, EP_ATOM);
+                out << ')';
+            }
+            else if (node.IsLookup()) {
+                out << GetFunctionName(node) << '(';
+                PrintFormula(program, index - 1, out, EP_ATOM);
+                out << ',';
+                PrintRange(out, program.ranges[node.lookup.range]);
+                if (node.code == NodeType::VLookup) {
+                    out << ',' << node.lookup.column + 1;
+                }
+                out << ')';
+            }
+            else if (node.code == NodeType::Cell) {
+                PrintCell(out, node.cell);
+            }
+            else {
+                PrintNumber(out, node.number);
+            }
 
             if (parens_needed) {
                 out << ')';
             }
         }
-    };
 
-    namespace {
-        class BinaryOpExpr final : public Expr {
+        // Строит программу из узлов, которые разборщик передаёт в постфиксном
+        // порядке: операнды раньше операции
+        class ProgramBuilder {
         public:
-            enum Type : char {
-                Add = '+',
-                Subtract = '-',
-                Multiply = '*',
-                Divide = '/',
-            };
+            FormulaProgram MoveProgram() {
+                assert(args_.size() == 1);
+                args_.clear();
 
-        public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
-                : type_(type)
-                , lhs_(std::move(lhs))
-                , rhs_(std::move(rhs)) {
+                return std::move(program_);
             }
 
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
-                out << ' ';
-                rhs_->Print(out);
-                out << ')';
-            }
+            void AddLiteral(std::string_view text) {
+                double value = 0;
+                auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+                if (error != std::errc{} || end != text.data() + text.size()) {
+                    throw ParsingError("Invalid number: " + std::string(text));
+                }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
-                out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                args_.push_back(AddNode(Node::MakeNumber(value)));
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                switch (type_) {
-                case Add:
-                    return EP_ADD;
-                case Subtract:
-                    return EP_SUB;
-                case Multiply:
-                    return EP_MUL;
-                case Divide:
-                    return EP_DIV;
-                default:
-                    // have to do this because VC++ has a buggy warning
-                    assert(false);
-                    return static_cast<ExprPrecedence>(INT_MAX);
-                }
+            void AddCell(std::string_view text) {
+                args_.push_back(AddNode(Node::MakeCell(ParsePosition(text))));
             }
 
+            void AddUnaryOp(NodeType type) {
+                assert(args_.size() >= 1);
 
-            double Evaluate(const std::function<double(Position)>& cells) const override { 
-                switch (type_) {
-                case Add: return lhs_->Evaluate(cells) + rhs_->Evaluate(cells); break;
-                case Subtract: return lhs_->Evaluate(cells) - rhs_->Evaluate(cells); break;
-                case Multiply: return lhs_->Evaluate(cells) * rhs_->Evaluate(cells); break;
-                case Divide:
-
-                    if (rhs_->Evaluate(cells) == 0) {
-                        throw FormulaError(FormulaError::Category::Div0);
-                    }
+                args_.back() = AddNode(Node::MakeOperation(type));
+            }
 
-                    return lhs_->Evaluate(cells) / rhs_->Evaluate(cells);
-                    break;
+            // арифметика и сравнения
+            void AddBinaryOp(NodeType type) {
+                assert(args_.size() >= 2);
 
-                }
-                throw FormulaError(FormulaError::Category::Unknown);
+                args_.pop_back();
+                auto lhs = args_.back();
+                args_.back() = AddNode(Node::MakeOperation(type, lhs));
             }
 
+            // Ветви к этому моменту уже построены подряд за условием, переходы
+            // вставляются между ними
+            void AddIf() {
+                assert(args_.size() >= 3);
 
-        private:
-            Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
-        };
-
-        class UnaryOpExpr final : public Expr {
-        public:
-            enum Type : char {
-                UnaryPlus = '+',
-                UnaryMinus = '-',
-            };
+                args_.pop_back();
+                std::uint32_t then_root = args_.back();
+                args_.pop_back();
+                std::uint32_t condition_root = args_.back();
 
-        public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
-                : type_(type)
-                , operand_(std::move(operand)) {
-            }
+                InsertNode(then_root + 1, Node::MakeOperation(NodeType::Jump));
+                InsertNode(condition_root + 1, Node::MakeOperation(NodeType::JumpIfFalse));
+                std::uint32_t jump = then_root + 2;
+                std::uint32_t if_node = AddNode(Node::MakeOperation(NodeType::If, condition_root));
+                program_.ops[condition_root + 1].lhs = jump;
+                program_.ops[jump].lhs = if_node;
 
-            void Print(std::ostream& out) const override {
-                out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
-                out << ')';
+                args_.back() = if_node;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
-            }
+            void AddMatch(std::string_view first, std::string_view last) {
+                assert(args_.size() >= 1);
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_UNARY;
+                FormulaProgram::Range range = ParseRange(first, last);
+                if (range.first.col != range.last.col) {
+                    throw FormulaException("MATCH range must be a single column");
+                }
+                args_.back() = AddNode(Node::MakeLookup(NodeType::Match, AddRange(range)));
             }
 
-  
-            double Evaluate(const std::function<double(Position)>& cells) const override {
-                auto result = operand_->Evaluate(cells);
+            void AddVLookup(std::string_view first, std::string_view last, std::string_view column_text) {
+                assert(args_.size() >= 1);
 
-                switch (type_) {
-                case UnaryPlus: return +result;  break;
-                case UnaryMinus: return -result;  break;
+                FormulaProgram::Range range = ParseRange(first, last);
+                double column = 0;
+                auto [end, error] = std::from_chars(column_text.data(), column_text.data() + column_text.size(), column);
+                if (error != std::errc{} || end != column_text.data() + column_text.size() || column < 1
+                    || column > range.last.col - range.first.col + 1 || column != std::floor(column)) {
+                    throw FormulaException("Invalid VLOOKUP column: " + std::string(column_text));
                 }
-                throw FormulaError(FormulaError::Category::Unknown);
-            }
 
+                args_.back() = AddNode(Node::MakeLookup(NodeType::VLookup, AddRange(range),
+                    static_cast<std::uint32_t>(column) - 1));
+            }
 
         private:
-            Type type_;
-            std::unique_ptr<Expr> operand_;
-        };
-
-        class CellExpr final : public Expr {
-        public:
-            explicit CellExpr(const Position* cell)
-                : cell_(cell) {
+            std::uint32_t AddNode(Node node) {
+                program_.ops.push_back(node);
+                return static_cast<std::uint32_t>(program_.ops.size() - 1);
             }
 
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                }
-                else {
-                    out << cell_->ToString();
+            // Вставляет узел в середину программы. Узлы ссылаются только на
+            // предшествующие, поэтому исправляются ссылки в узлах после вставки.
+            void InsertNode(std::uint32_t index, Node node) {
+                auto& ops = program_.ops;
+                ops.insert(ops.begin() + index, node);
+                for (std::size_t i = index + 1; i < ops.size(); ++i) {
+                    Node& op = ops[i];
+                    bool has_index = op.IsBinary() || op.code == NodeType::JumpIfFalse
+                        || op.code == NodeType::Jump || op.code == NodeType::If;
+                    if (has_index && op.lhs >= index) {
+                        ++op.lhs;
+                    }
                 }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            static Position ParsePosition(std::string_view text) {
+                Position pos = Position::FromString(text);
+                if (!pos.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(text));
+                }
+                return pos;
             }
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
+            // углы диапазона упорядочиваются, так что B5:A1 - то же, что A1:B5
+            static FormulaProgram::Range ParseRange(std::string_view first, std::string_view last) {
+                const Position corners[2] = { ParsePosition(first), ParsePosition(last) };
+                return {
+                    { std::min(corners[0].row, corners[1].row), std::min(corners[0].col, corners[1].col) },
+                    { std::max(corners[0].row, corners[1].row), std::max(corners[0].col, corners[1].col) },
+                };
             }
 
-
-            double Evaluate(const std::function<double(Position)>& cells) const override {
-                return cells(*cell_);
+            std::uint32_t AddRange(const FormulaProgram::Range& range) {
+                program_.ranges.push_back(range);
+                return static_cast<std::uint32_t>(program_.ranges.size() - 1);
             }
 
-
-        private:
-            const Position* cell_;
+            // индексы корней уже разобранных подвыражений
+            std::vector<std::uint32_t> args_;
+            FormulaProgram program_;
         };
 
-        class NumberExpr final : public Expr {
+        // Разбор рекурсивным спуском по грамматике Formula.g4. Уровни
+        // приоритета идут от сравнений к унарным операциям, бинарные операции
+        // левоассоциативны. Разборщик не разделяет состояния с другими, так что
+        // формулы разбираются из любого числа потоков одновременно.
+        class Parser {
         public:
-            explicit NumberExpr(double value)
-                : value_(value) {
+            explicit Parser(std::string_view text)
+                : text_(text) {
+                Next();
             }
 
-            void Print(std::ostream& out) const override {
-                out << value_;
+            FormulaProgram Parse() {
+                ParseExpr();
+                if (token_.type != TokenType::End) {
+                    Fail();
+                }
+                return builder_.MoveProgram();
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                out << value_;
-            }
+        private:
+            enum class TokenType {
+                End,
+                Number,
+                Cell,
+                If,
+                Match,
+                VLookup,
+                LeftParen,
+                RightParen,
+                Comma,
+                Colon,
+                Add,
+                Sub,
+                Mul,
+                Div,
+                Less,
+                LessEqual,
+                Greater,
+                GreaterEqual,
+                Equal,
+                NotEqual,
+            };
 
-            ExprPrecedence GetPrecedence() const override {
-                return EP_ATOM;
-            }
+            struct Token {
+                TokenType type = TokenType::End;
+                std::string_view text;
+            };
 
-    
-            double Evaluate(const std::function<double(Position)>& cells) const override { 
-                return value_;
+            static bool IsDigit(char c) {
+                return c >= '0' && c <= '9';
             }
 
-
-        private:
-            double value_;
-        };
-
-        class ParseASTListener final : public FormulaBaseListener {
-        public:
-            std::unique_ptr<Expr> MoveRoot() {
-                assert(args_.size() == 1);
-                auto root = std::move(args_.front());
-                args_.clear();
-
-                return root;
+            static bool IsLetter(char c) {
+                return c >= 'A' && c <= 'Z';
             }
 
-            std::forward_list<Position> MoveCells() {
-                return std::move(cells_);
+            bool IsDigitAt(std::size_t pos) const {
+                return pos < text_.size() && IsDigit(text_[pos]);
             }
 
-        public:
-            void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
-                assert(args_.size() >= 1);
+            std::size_t SkipDigits(std::size_t pos) const {
+                while (IsDigitAt(pos)) {
+                    ++pos;
+                }
+                return pos;
+            }
 
-                auto operand = std::move(args_.back());
+            // Читает следующую лексему в token_. Лексемы те же, что у Formula.g4:
+            // знак числа - отдельная лексема, а CELL длиннее ключевого слова,
+            // так что IF1 - это ячейка.
+            void Next() {
+                while (pos_ < text_.size()
+                    && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+                    ++pos_;
+                }
+                const std::size_t begin = pos_;
+                if (begin == text_.size()) {
+                    token_ = { TokenType::End, {} };
+                    return;
+                }
 
-                UnaryOpExpr::Type type;
-                if (ctx->SUB()) {
-                    type = UnaryOpExpr::UnaryMinus;
+                const char c = text_[begin];
+                TokenType type;
+                if (IsDigit(c) || c == '.') {
+                    pos_ = SkipDigits(begin);
+                    if (pos_ < text_.size() && text_[pos_] == '.' && IsDigitAt(pos_ + 1)) {
+                        pos_ = SkipDigits(pos_ + 1);
+                    }
+                    else if (pos_ == begin) {
+                        FailLexing(c);
+                    }
+                    if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+                        std::size_t digits = pos_ + 1;
+                        if (digits < text_.size() && (text_[digits] == '+' || text_[digits] == '-')) {
+                            ++digits;
+                        }
+                        if (IsDigitAt(digits)) {
+                            pos_ = SkipDigits(digits);
+                        }
+                    }
+                    type = TokenType::Number;
+                }
+                else if (IsLetter(c)) {
+                    while (pos_ < text_.size() && IsLetter(text_[pos_])) {
+                        ++pos_;
+                    }
+                    const std::string_view word = text_.substr(begin, pos_ - begin);
+                    if (IsDigitAt(pos_)) {
+                        pos_ = SkipDigits(pos_);
+                        type = TokenType::Cell;
+                    }
+                    else if (word == "IF") {
+                        type = TokenType::If;
+                    }
+                    else if (word == "MATCH") {
+                        type = TokenType::Match;
+                    }
+                    else if (word == "VLOOKUP") {
+                        type = TokenType::VLookup;
+                    }
+                    else {
+                        FailLexing(c);
+                    }
                 }
                 else {
-                    assert(ctx->ADD() != nullptr);
-                    type = UnaryOpExpr::UnaryPlus;
+                    ++pos_;
+                    const char next = pos_ < text_.size() ? text_[pos_] : '\0';
+                    switch (c) {
+                    case '(': type = TokenType::LeftParen; break;
+                    case ')': type = TokenType::RightParen; break;
+                    case ',': type = TokenType::Comma; break;
+                    case ':': type = TokenType::Colon; break;
+                    case '+': type = TokenType::Add; break;
+                    case '-': type = TokenType::Sub; break;
+                    case '*': type = TokenType::Mul; break;
+                    case '/': type = TokenType::Div; break;
+                    case '=': type = TokenType::Equal; break;
+                    case '<':
+                        if (next == '=' || next == '>') {
+                            ++pos_;
+                            type = next == '=' ? TokenType::LessEqual : TokenType::NotEqual;
+                        }
+                        else {
+                            type = TokenType::Less;
+                        }
+                        break;
+                    case '>':
+                        if (next == '=') {
+                            ++pos_;
+                            type = TokenType::GreaterEqual;
+                        }
+                        else {
+                            type = TokenType::Greater;
+                        }
+                        break;
+                    default:
+                        FailLexing(c);
+                    }
                 }
-
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-                args_.back() = std::move(node);
+                token_ = { type, text_.substr(begin, pos_ - begin) };
             }
 
-            void exitLiteral(FormulaParser::LiteralContext* ctx) override {
-                double value = 0;
-                auto valueStr = ctx->NUMBER()->getSymbol()->getText();
-                std::istringstream in(valueStr);
-                in >> value;
-                if (!in) {
-                    throw ParsingError("Invalid number: " + valueStr);
-                }
+            [[noreturn]] static void FailLexing(char c) {
+                throw ParsingError(std::string("Error when lexing: unexpected character '") + c + "'");
+            }
 
-                auto node = std::make_unique<NumberExpr>(value);
-                args_.push_back(std::move(node));
+            [[noreturn]] void Fail() const {
+                throw ParsingError("Error when parsing: "
+                    + (token_.type == TokenType::End ? std::string("<EOF>") : std::string(token_.text)));
             }
 
-            void exitCell(FormulaParser::CellContext* ctx) override {
-                auto value_str = ctx->CELL()->getSymbol()->getText();
-                auto value = Position::FromString(value_str);
-                if (!value.IsValid()) {
-                    throw FormulaException("Invalid position: " + value_str);
+            std::string_view Expect(TokenType type) {
+                if (token_.type != type) {
+                    Fail();
                 }
-
-                cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
-                args_.push_back(std::move(node));
+                const std::string_view text = token_.text;
+                Next();
+                return text;
             }
 
-            void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
-                assert(args_.size() >= 2);
+            // expr: сравнения, самый низкий приоритет
+            void ParseExpr() {
+                ParseSum();
+                for (;;) {
+                    NodeType type;
+                    switch (token_.type) {
+                    case TokenType::Less: type = NodeType::Less; break;
+                    case TokenType::LessEqual: type = NodeType::LessEqual; break;
+                    case TokenType::Greater: type = NodeType::Greater; break;
+                    case TokenType::GreaterEqual: type = NodeType::GreaterEqual; break;
+                    case TokenType::Equal: type = NodeType::Equal; break;
+                    case TokenType::NotEqual: type = NodeType::NotEqual; break;
+                    default: return;
+                    }
+                    Next();
+                    ParseSum();
+                    builder_.AddBinaryOp(type);
+                }
+            }
 
-                auto rhs = std::move(args_.back());
-                args_.pop_back();
+            void ParseSum() {
+                ParseProduct();
+                while (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+                    const NodeType type = token_.type == TokenType::Add ? NodeType::Add : NodeType::Subtract;
+                    Next();
+                    ParseProduct();
+                    builder_.AddBinaryOp(type);
+                }
+            }
 
-                auto lhs = std::move(args_.back());
+            void ParseProduct() {
+                ParseUnary();
+                while (token_.type == TokenType::Mul || token_.type == TokenType::Div) {
+                    const NodeType type = token_.type == TokenType::Mul ? NodeType::Multiply : NodeType::Divide;
+                    Next();
+                    ParseUnary();
+                    builder_.AddBinaryOp(type);
+                }
+            }
 
-                BinaryOpExpr::Type type;
-                if (ctx->ADD()) {
-                    type = BinaryOpExpr::Add;
+            // унарный знак связывает сильнее умножения: -A1*2 - это (-A1)*2
+            void ParseUnary() {
+                if (token_.type == TokenType::Add || token_.type == TokenType::Sub) {
+                    const NodeType type = token_.type == TokenType::Add ? NodeType::UnaryPlus : NodeType::UnaryMinus;
+                    Next();
+                    ParseUnary();
+                    builder_.AddUnaryOp(type);
+                    return;
                 }
-                else if (ctx->SUB()) {
-                    type = BinaryOpExpr::Subtract;
+                ParsePrimary();
+            }
+
+            void ParsePrimary() {
+                switch (token_.type) {
+                case TokenType::LeftParen:
+                    Next();
+                    ParseExpr();
+                    Expect(TokenType::RightParen);
+                    return;
+                case TokenType::If:
+                    Next();
+                    Expect(TokenType::LeftParen);
+                    ParseExpr();
+                    Expect(TokenType::Comma);
+                    ParseExpr();
+                    Expect(TokenType::Comma);
+                    ParseExpr();
+                    Expect(TokenType::RightParen);
+                    builder_.AddIf();
+                    return;
+                case TokenType::Match: {
+                    Next();
+                    Expect(TokenType::LeftParen);
+                    ParseExpr();
+                    Expect(TokenType::Comma);
+                    const std::string_view first = Expect(TokenType::Cell);
+                    Expect(TokenType::Colon);
+                    const std::string_view last = Expect(TokenType::Cell);
+                    Expect(TokenType::RightParen);
+                    builder_.AddMatch(first, last);
+                    return;
                 }
-                else if (ctx->MUL()) {
-                    type = BinaryOpExpr::Multiply;
+                case TokenType::VLookup: {
+                    Next();
+                    Expect(TokenType::LeftParen);
+                    ParseExpr();
+                    Expect(TokenType::Comma);
+                    const std::string_view first = Expect(TokenType::Cell);
+                    Expect(TokenType::Colon);
+                    const std::string_view last = Expect(TokenType::Cell);
+                    Expect(TokenType::Comma);
+                    const std::string_view column = Expect(TokenType::Number);
+                    Expect(TokenType::RightParen);
+                    builder_.AddVLookup(first, last, column);
+                    return;
                 }
-                else {
-                    assert(ctx->DIV() != nullptr);
-                    type = BinaryOpExpr::Divide;
+                case TokenType::Cell:
+                    builder_.AddCell(token_.text);
+                    Next();
+                    return;
+                case TokenType::Number:
+                    builder_.AddLiteral(token_.text);
+                    Next();
+                    return;
+                default:
+                    Fail();
                 }
-
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-                args_.back() = std::move(node);
-            }
-
-            void visitErrorNode(antlr4::tree::ErrorNode* node) override {
-                throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
             }
 
-        private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            std::string_view text_;
+            std::size_t pos_ = 0;
+            Token token_;
+            ProgramBuilder builder_;
         };
-
-        class BailErrorListener : public antlr4::BaseErrorListener {
-        public:
-            void syntaxError(antlr4::Recognizer* /* recognizer */, antlr4::Token* /* offendingSymbol */,
-                size_t /* line */, size_t /* charPositionInLine */, const std::string& msg,
-                std::exception_ptr /* e */
-            ) override {
-                throw ParsingError("Error when lexing: " + msg);
-            }
-        };
-
     }  // namespace
 }  // namespace ASTImpl
 
 FormulaAST ParseFormulaAST(std::istream& in) {
-    using namespace antlr4;
-
-    ANTLRInputStream input(in);
-
-    FormulaLexer lexer(&input);
-    ASTImpl::BailErrorListener error_listener;
-    lexer.removeErrorListeners();
-    lexer.addErrorListener(&error_listener);
-
-    CommonTokenStream tokens(&lexer);
-
-    FormulaParser parser(&tokens);
-    auto error_handler = std::make_shared<BailErrorStrategy>();
-    parser.setErrorHandler(error_handler);
-    parser.removeErrorListeners();
-
-    tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
-    tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
-
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(text);
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return FormulaAST(ASTImpl::Parser(in_str).Parse());
 }
 
+
 void FormulaAST::PrintCells(std::ostream& out) const {
-    for (auto cell : cells_) {
+    for (auto cell : GetCells()) {
         out << cell.ToString() << ' ';
     }
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    ASTImpl::Print(program_, program_.ops.size() - 1, out);
 }
 
 void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+    ASTImpl::PrintFormula(program_, program_.ops.size() - 1, out, ASTImpl::EP_ATOM);
+}
+
+std::vector<Position> FormulaAST::GetCells() const {
+    std::vector<Position> cells;
+    for (const auto& node : program_.ops) {
+        if (node.code == FormulaProgram::OpCode::Cell) {
+            cells.push_back(node.cell);
+        }
+    }
+    std::sort(cells.begin(), cells.end());
+    cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+    return cells;
+}
+
+// Узлы идут в постфиксном порядке, поэтому формула вычисляется одним проходом
+// со стеком значений. Стек небольших формул размещается на стеке вызовов.
+double FormulaAST::Execute(const CellValue& cells, const MatchRow& match_row) const {
+    constexpr std::size_t INLINE_DEPTH = 32;
+    double inline_stack[INLINE_DEPTH] = {};
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (program_.max_depth > INLINE_DEPTH) {
+        heap_stack.resize(program_.max_depth);
+        stack = heap_stack.data();
+    }
+
+    const auto& ops = program_.ops;
+    std::size_t depth = 0;
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        const auto& node = ops[i];
+        switch (node.code) {
+        case FormulaProgram::OpCode::Number:
+            stack[depth++] = node.number;
+            break;
+        case FormulaProgram::OpCode::Cell:
+            stack[depth++] = cells(node.cell);
+            break;
+        case FormulaProgram::OpCode::UnaryPlus:
+            stack[depth - 1] = +stack[depth - 1];
+            break;
+        case FormulaProgram::OpCode::UnaryMinus:
+            stack[depth - 1] = -stack[depth - 1];
+            break;
+        case FormulaProgram::OpCode::Match:
+        case FormulaProgram::OpCode::VLookup:
+            stack[depth - 1] = ExecuteLookup(node, stack[depth - 1], cells, match_row);
+            break;
+        case FormulaProgram::OpCode::JumpIfFalse:
+            if (std::isnan(stack[depth - 1])) {
+                // ошибка в условии становится значением всего IF
+                i = ops[node.lhs].lhs - 1;
+            }
+            else if (stack[--depth] == 0) {
+                i = node.lhs;
+            }
+            break;
+        case FormulaProgram::OpCode::Jump:
+            i = node.lhs - 1;
+            break;
+        case FormulaProgram::OpCode::If:
+            break;
+        default:
+            stack[depth - 2] = FormulaProgram::Apply(node.code, stack[depth - 2], stack[depth - 1]);
+            --depth;
+        }
+    }
+    return stack[0];
+}
+
+// Ошибка в ключе передаётся дальше, ненайденный ключ даёт #N/A, удалённый
+// диапазон - #REF!
+double FormulaAST::ExecuteLookup(const FormulaProgram::Op& node, double key, const CellValue& cells,
+    const MatchRow& match_row) const {
+    if (std::isnan(key)) {
+        return key;
+    }
+
+    const FormulaProgram::Range& range = program_.ranges[node.lookup.range];
+    if (!range.first.IsValid()) {
+        return FormulaValue::MakeError(FormulaError::Category::Ref);
+    }
+    std::optional<int> row = match_row(key, range.first.col, range.first.row, range.last.row);
+    if (!row) {
+        return FormulaValue::MakeError(FormulaError::Category::NA);
+    }
+    if (node.code == FormulaProgram::OpCode::Match) {
+        return *row - range.first.row + 1;
+    }
+    return cells({ *row, range.first.col + static_cast<int>(node.lookup.column) });
+}
+
+bool FormulaProgram::IsRowShiftOf(const FormulaProgram& base, int row_shift) const {
+    if (ops.size() != base.ops.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < ops.size(); ++i) {
+        const Op& op = ops[i];
+        const Op& base_op = base.ops[i];
+        if (op.code != base_op.code || op.lhs != base_op.lhs) {
+            return false;
+        }
+        if (op.code == OpCode::Number && op.number != base_op.number) {
+            return false;
+        }
+        if (op.code == OpCode::Cell
+            && !(op.cell == Position{ base_op.cell.row + row_shift, base_op.cell.col })) {
+            return false;
+        }
+        if (op.IsLookup()
+            && (op.lookup.range != base_op.lookup.range || op.lookup.column != base_op.lookup.column)) {
+            return false;
+        }
+    }
+
+    if (ranges.size() != base.ranges.size()) {
+        return false;
+    }
+    for (std::size_t i = 0; i < ranges.size(); ++i) {
+        const Range& range = ranges[i];
+        const Range& base_range = base.ranges[i];
+        if (!(range.first == Position{ base_range.first.row + row_shift, base_range.first.col })
+            || !(range.last == Position{ base_range.last.row + row_shift, base_range.last.col })) {
+            return false;
+        }
+    }
+    return true;
 }
 
+bool FormulaProgram::ShiftReferences(const PositionShift& shift) {
+    const bool rows = shift.axis == PositionShift::Axis::Rows;
+    bool changed = false;
+    for (Op& op : ops) {
+        if (op.code == OpCode::Cell) {
+            Position moved = shift.Apply(op.cell);
+            if (moved.IsValid()) {
+                op.cell = moved;
+            }
+            else {
+                op = Op::MakeNumber(FormulaValue::MakeError(FormulaError::Category::Ref));
+                changed = true;
+            }
+            continue;
+        }
+        if (!op.IsLookup() || !ranges[op.lookup.range].first.IsValid()) {
+            continue;
+        }
 
+        // Диапазон сжимается или растягивается вместе со строками, поэтому
+        // MATCH может дать другой номер строки. Столбец результата VLOOKUP
+        // следует за своим столбцом.
+        Range& range = ranges[op.lookup.range];
+        Range moved = range;
+        bool alive = rows ? shift.Apply(moved.first.row, moved.last.row)
+            : shift.Apply(moved.first.col, moved.last.col);
+        if (alive && !rows && op.code == OpCode::VLookup) {
+            Position result = shift.Apply({ range.first.row, range.first.col + static_cast<int>(op.lookup.column) });
+            alive = result.IsValid() && result.col <= moved.last.col;
+            if (alive) {
+                op.lookup.column = static_cast<std::uint32_t>(result.col - moved.first.col);
+            }
+        }
 
-double FormulaAST::Execute(const std::function<double(Position)>& cells) const {
-    return root_expr_->Evaluate(cells);
+        if (!alive) {
+            range = { Position::NONE, Position::NONE };
+            changed = true;
+            continue;
+        }
+        if (moved.last.row - moved.first.row != range.last.row - range.first.row
+            || !shift.Apply(range.first).IsValid()) {
+            changed = true;
+        }
+        range = moved;
+    }
+    return changed;
 }
 
+void FormulaProgram::Offset(int row_shift, int col_shift) {
+    for (Op& op : ops) {
+        if (op.code != OpCode::Cell) {
+            continue;
+        }
+        op.cell = { op.cell.row + row_shift, op.cell.col + col_shift };
+        if (!op.cell.IsValid()) {
+            op = Op::MakeNumber(FormulaValue::MakeError(FormulaError::Category::Ref));
+        }
+    }
+    for (Range& range : ranges) {
+        if (!range.first.IsValid()) {
+            continue;
+        }
+        range.first = { range.first.row + row_shift, range.first.col + col_shift };
+        range.last = { range.last.row + row_shift, range.last.col + col_shift };
+        if (!range.first.IsValid() || !range.last.IsValid()) {
+            range = { Position::NONE, Position::NONE };
+        }
+    }
+}
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::FormulaAST(FormulaProgram program)
+    : program_(std::move(program)) {
+    std::size_t depth = 0;
+    for (const auto& node : program_.ops) {
+        // после Jump вычисляется ветвь "иначе", значения ветви "то" на стеке нет
+        if (node.IsBinary() || node.code == FormulaProgram::OpCode::JumpIfFalse
+            || node.code == FormulaProgram::OpCode::Jump) {
+            --depth;
+        }
+        else if (node.code == FormulaProgram::OpCode::If) {
+            program_.has_branches = true;
+        }
+        else if (!node.IsUnary() && !node.IsLookup()) {
+            program_.max_depth = std::max(program_.max_depth, ++depth);
+        }
+    }
+    program_.ops.shrink_to_fit();
+    program_.ranges.shrink_to_fit();
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+FormulaAST::~FormulaAST() = default;
@@ -1,15 +1,13 @@
 #pragma once
 
-#include "FormulaLexer.h"
 #include "common.h"
+#include "formula_program.h"
 
-#include <forward_list>
 #include <functional>
+#include <iosfwd>
+#include <optional>
 #include <stdexcept>
-
-namespace ASTImpl {
-    class Expr;
-}
+#include <vector>
 
 class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
@@ -17,28 +15,40 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
+    explicit FormulaAST(FormulaProgram program);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(const std::function<double(Position)>& cells) const;
+    // Значение ячейки как операнда формулы
+    using CellValue = std::function<double(Position)>;
+    // Первая строка диапазона [first_row, last_row] столбца col, значение в
+    // которой равно key, если такая есть
+    using MatchRow = std::function<std::optional<int>(double key, int col, int first_row, int last_row)>;
+
+    double Execute(const CellValue& cells, const MatchRow& match_row) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
 
-    std::forward_list<Position>& GetCells() {
-        return cells_;
+    // Узлы формулы в постфиксном порядке, они же программа для вычисления
+    const FormulaProgram& GetProgram() const {
+        return program_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // См. FormulaProgram::ShiftReferences()
+    bool ShiftReferences(const PositionShift& shift) {
+        return program_.ShiftReferences(shift);
     }
 
+    // Ячейки формулы по возрастанию и без повторов
+    std::vector<Position> GetCells() const;
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
-    std::forward_list<Position> cells_;
+    double ExecuteLookup(const FormulaProgram::Op& node, double key, const CellValue& cells,
+        const MatchRow& match_row) const;
+
+    FormulaProgram program_;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
@@ -0,0 +1,835 @@
+// Микробенчмарки таблицы. Каждый замер повторяется несколько раз на заново
+// построенных данных, подготовка в замер не входит. Результаты выводятся в
+// stdout в формате JSON, ход работы - в stderr.
+//
+// Параметры:
+//   --max-cells N     наибольший размер таблицы (по умолчанию 10000000)
+//   --repetitions N   число повторов каждого замера (по умолчанию 5)
+//   --filter TEXT     только замеры, в имени которых есть TEXT
+//
+// Кроме замеров на ряде размеров есть сценарии фиксированного размера:
+// глубокие цепочки, поиск, IF, вставка строк, журналы, подкачка и т.п.
+// Сценарии крупнее --max-cells пропускаются; их дополнительные показатели
+// выводятся в поле "counters".
+
+#include "FormulaAST.h"
+#include "common.h"
+#include "formula_jit.h"
+#include "sheet.h"
+#include "workbook_generator.h"
+#include "write_ahead_log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr std::uint32_t SEED = 20240601;
+    const std::vector<std::size_t> SIZES = { 1'000, 10'000, 100'000, 1'000'000, 10'000'000 };
+
+    struct Options {
+        std::size_t max_cells = 10'000'000;
+        int repetitions = 5;
+        std::string filter;
+    };
+
+    // Дополнительные показатели замера: число срезов, байты журнала и т.п.
+    using Counters = std::vector<std::pair<std::string, std::uint64_t>>;
+
+    struct Result {
+        std::string name;
+        std::size_t cells = 0;
+        std::vector<std::int64_t> samples_ns;
+        Counters counters{};
+    };
+
+    // Поток, который отбрасывает вывод: печать замеряется без затрат на память
+    class NullBuffer : public std::streambuf {
+    protected:
+        int_type overflow(int_type ch) override {
+            return ch;
+        }
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+    };
+
+    // Ячейки раскладываются по столбцам высотой не больше MAX_ROWS: i-я
+    // ячейка лежит в строке i % rows столбца i / rows
+    class Layout {
+    public:
+        explicit Layout(std::size_t cells, int group = 1)
+            : rows_(static_cast<int>(std::min<std::size_t>(cells / group, Position::MAX_ROWS)))
+            , group_(group) {
+        }
+
+        Position At(std::size_t index, int member = 0) const {
+            return { static_cast<int>(index % rows_), static_cast<int>(index / rows_) * group_ + member };
+        }
+
+    private:
+        int rows_;
+        int group_;
+    };
+
+    std::string Ref(Position pos) {
+        return pos.ToString();
+    }
+
+    // Цепочка: каждая ячейка ссылается на предыдущую
+    void BuildChain(Sheet& sheet, std::size_t cells) {
+        const Layout layout(cells);
+        sheet.SetCell(layout.At(0), "1");
+        for (std::size_t i = 1; i < cells; ++i) {
+            sheet.SetCell(layout.At(i), "=" + Ref(layout.At(i - 1)) + "+1");
+        }
+    }
+
+    // Ромбы: в каждом слое две ячейки, и обе ссылаются на обе ячейки
+    // предыдущего слоя
+    void BuildDiamonds(Sheet& sheet, std::size_t cells) {
+        const Layout layout(cells, 2);
+        sheet.SetCell(layout.At(0, 0), "1");
+        sheet.SetCell(layout.At(0, 1), "2");
+        for (std::size_t i = 1; i < cells / 2; ++i) {
+            const std::string lhs = Ref(layout.At(i - 1, 0));
+            const std::string rhs = Ref(layout.At(i - 1, 1));
+            sheet.SetCell(layout.At(i, 0), "=(" + lhs + "+" + rhs + ")/2");
+            sheet.SetCell(layout.At(i, 1), "=" + lhs + "-" + rhs);
+        }
+    }
+
+    // Случайные числа берутся из генератора напрямую, как в
+    // workbook_generator.cpp: распределения std:: на разных стандартных
+    // библиотеках дают разные последовательности
+    class Random {
+    public:
+        explicit Random(std::uint32_t seed)
+            : engine_(seed) {
+        }
+
+        // равномерно на [min, max]
+        int Between(int min, int max) {
+            return min + static_cast<int>(engine_() % static_cast<std::uint32_t>(max - min + 1));
+        }
+
+    private:
+        std::mt19937 engine_;
+    };
+
+    // Независимые формулы над столбцом чисел, со случайными константами
+    void BuildFormulas(Sheet& sheet, std::size_t cells) {
+        const Layout layout(cells, 2);
+        Random random(SEED);
+        for (std::size_t i = 0; i < cells / 2; ++i) {
+            sheet.SetCell(layout.At(i, 0), std::to_string(random.Between(1, 999)));
+            sheet.SetCell(layout.At(i, 1),
+                "=" + Ref(layout.At(i, 0)) + "*" + std::to_string(random.Between(1, 999)) + "+1");
+        }
+    }
+
+    // Порядок вычисления операндов + не задан, поэтому каждое случайное
+    // значение берётся отдельной инструкцией
+    std::vector<std::string> MakeFormulaTexts(std::size_t count) {
+        Random random(SEED);
+        auto cell = [&random] {
+            const int row = random.Between(0, Position::MAX_ROWS - 1);
+            const int col = random.Between(0, 255);
+            return Ref({ row, col });
+        };
+        auto constant = [&random] {
+            return std::to_string(random.Between(1, 999));
+        };
+        std::vector<std::string> texts;
+        texts.reserve(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            std::string text;
+            switch (i % 4) {
+            case 0:
+                text = cell();
+                text += "+" + cell();
+                break;
+            case 1:
+                text = "(" + cell();
+                text += "-" + constant();
+                text += ")*" + cell();
+                break;
+            case 2:
+                text = "-" + cell();
+                text += "/(" + cell();
+                text += "+" + cell() + ")";
+                break;
+            default:
+                text = constant();
+                text += "*" + cell();
+                text += "+" + cell();
+                text += "*" + cell();
+            }
+            texts.push_back(std::move(text));
+        }
+        return texts;
+    }
+
+    // Таблица генератора примерно из cells ячеек: половина формул со
+    // смещёнными распределениями ссылок и немного ошибок
+    WorkbookShape MakeWorkbookShape(std::size_t cells) {
+        WorkbookShape shape;
+        shape.seed = SEED;
+        shape.rows = static_cast<int>(std::clamp<std::size_t>(cells / 64, 1, Position::MAX_ROWS));
+        shape.cols = static_cast<int>(cells / shape.rows);
+        shape.density = 1.0;
+        shape.formula_ratio = 0.5;
+        shape.text_ratio = 0.0;
+        shape.error_ratio = 0.01;
+        shape.fan_in = { 1, 4, 2.0 };
+        shape.fan_out.skew = 2.0;
+        return shape;
+    }
+
+    void EvaluateAll(const Sheet& sheet, std::size_t cells, int group = 1) {
+        const Layout layout(cells, group);
+        for (std::size_t i = 0; i < cells / group; ++i) {
+            for (int member = 0; member < group; ++member) {
+                sheet.GetCell(layout.At(i, member))->GetValue();
+            }
+        }
+    }
+
+    // Замер: prepare строит данные и не входит во время, run замеряется
+    struct Case {
+        std::string name;
+        std::function<void(std::size_t)> prepare;
+        std::function<void(std::size_t)> run;
+        // наибольший размер, на котором замер имеет смысл
+        std::size_t max_cells = SIZES.back();
+        // у сценария один размер вместо ряда SIZES
+        std::size_t fixed_cells = 0;
+        // вызывается после последнего повтора: показатели и уборка файлов
+        std::function<Counters()> finish{};
+    };
+
+    Case Scenario(std::string name, std::size_t cells, std::function<void(std::size_t)> prepare,
+        std::function<void(std::size_t)> run, std::function<Counters()> finish = {}) {
+        return { std::move(name), std::move(prepare), std::move(run), cells, cells, std::move(finish) };
+    }
+
+    std::vector<Case> MakeCases() {
+        // состояние, общее для prepare и run текущего замера
+        static std::unique_ptr<Sheet> sheet;
+        static std::vector<std::string> texts;
+        static Position head;
+        static Position tail;
+        static NullBuffer null_buffer;
+        static std::ostream null_output(&null_buffer);
+
+        auto fresh = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+        };
+        auto with_chain = [](std::size_t cells) {
+            sheet = std::make_unique<Sheet>();
+            BuildChain(*sheet, cells);
+            head = Layout(cells).At(0);
+            tail = Layout(cells).At(cells - 1);
+        };
+        auto with_warm_chain = [with_chain](std::size_t cells) {
+            with_chain(cells);
+            EvaluateAll(*sheet, cells);
+        };
+        auto with_warm_diamonds = [](std::size_t cells) {
+            sheet = std::make_unique<Sheet>();
+            BuildDiamonds(*sheet, cells);
+            head = Layout(cells, 2).At(0);
+            EvaluateAll(*sheet, cells / 2 * 2, 2);
+        };
+        auto with_formulas = [](std::size_t cells) {
+            sheet = std::make_unique<Sheet>();
+            BuildFormulas(*sheet, cells);
+        };
+        auto with_warm_formulas = [with_formulas](std::size_t cells) {
+            with_formulas(cells);
+            EvaluateAll(*sheet, cells / 2 * 2, 2);
+        };
+
+        return {
+            { "SetCell/text", fresh, [](std::size_t cells) {
+                const Layout layout(cells);
+                for (std::size_t i = 0; i < cells; ++i) {
+                    sheet->SetCell(layout.At(i), "text " + std::to_string(i % 1000));
+                }
+            } },
+            { "SetCell/formula", fresh, [](std::size_t cells) {
+                BuildFormulas(*sheet, cells);
+            } },
+            { "ParseFormulaAST", [](std::size_t cells) {
+                texts = MakeFormulaTexts(cells);
+            }, [](std::size_t) {
+                for (const auto& text : texts) {
+                    ParseFormulaAST(text);
+                }
+            } },
+            { "GetValue/cold", with_formulas, [](std::size_t cells) {
+                EvaluateAll(*sheet, cells / 2 * 2, 2);
+            } },
+            { "GetValue/warm", with_warm_formulas, [](std::size_t cells) {
+                EvaluateAll(*sheet, cells / 2 * 2, 2);
+            } },
+            { "GetValue/cold chain", with_chain, [](std::size_t) {
+                sheet->GetConcreteCell(tail)->GetValue();
+            } },
+            { "InvalidateCacheStartingWith/chain", with_warm_chain, [](std::size_t) {
+                sheet->InvalidateCacheStartingWith(head);
+            } },
+            { "InvalidateCacheStartingWith/diamond", with_warm_diamonds, [](std::size_t) {
+                sheet->InvalidateCacheStartingWith(head);
+            } },
+            { "CellHasCurcularDependency/chain", with_chain, [](std::size_t) {
+                // формула в начале цепочки, ссылающаяся на её конец, проходит
+                // цепочку целиком
+                const std::vector<Position> incoming = { tail };
+                if (!sheet->CellHasCurcularDependency(incoming, {}, head)) {
+                    std::abort();
+                }
+            } },
+            { "Workbook/build", fresh, [](std::size_t cells) {
+                WorkbookGenerator(MakeWorkbookShape(cells)).Fill(*sheet);
+            } },
+            { "Workbook/GetValue cold", [](std::size_t cells) {
+                sheet = std::make_unique<Sheet>();
+                WorkbookGenerator(MakeWorkbookShape(cells)).Fill(*sheet);
+            }, [](std::size_t cells) {
+                const WorkbookShape shape = MakeWorkbookShape(cells);
+                for (int row = 0; row < shape.rows; ++row) {
+                    for (int col = 0; col < shape.cols; ++col) {
+                        sheet->GetCell({ row, col })->GetValue();
+                    }
+                }
+            } },
+            { "GetPrintableSize", with_formulas, [](std::size_t) {
+                sheet->GetPrintableSize();
+            } },
+            { "PrintValues", with_warm_formulas, [](std::size_t) {
+                sheet->PrintValues(null_output);
+            } },
+            { "PrintTexts", with_formulas, [](std::size_t) {
+                sheet->PrintTexts(null_output);
+            } },
+        };
+    }
+
+    std::optional<int> NoLookups(double, int, int, int) {
+        return std::nullopt;
+    }
+
+    const std::vector<double> HOT_VALUES = { 1.5, 2.5, 7, 3, 0.5 };
+
+    // Сценарии фиксированного размера. Размер - число ячеек или вычислений,
+    // на которое делится время в ns_per_cell.
+    std::vector<Case> MakeScenarios() {
+        constexpr int ROWS = Position::MAX_ROWS;
+        // состояние, общее для prepare и run текущего сценария
+        static std::unique_ptr<Sheet> sheet;
+        static std::unique_ptr<WriteAheadLog> log;
+        static std::unique_ptr<FormulaAST> ast;
+        static std::unique_ptr<JitFormula> jit;
+        static std::vector<double> inputs;
+        static std::vector<std::pair<Position, std::string>> cells;
+        static std::size_t slices = 0;
+        static std::chrono::nanoseconds longest{};
+        static NullBuffer null_buffer;
+        static std::ostream null_output(&null_buffer);
+
+        const Position last{ ROWS - 1, 0 };
+
+        auto fresh = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+        };
+        auto with_chain = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            BuildChain(*sheet, ROWS);
+        };
+        auto with_warm_chain = [with_chain, last](std::size_t cells) {
+            with_chain(cells);
+            sheet->GetCell(last)->GetValue();
+        };
+
+        // столбец ошибок и 19 столбцов, зависящих от него
+        auto build_errors = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            sheet->SetCell({ 0, 0 }, "=1/0");
+            for (int row = 1; row < 1000; ++row) {
+                sheet->SetCell({ row, 0 }, "=" + Ref({ row - 1, 0 }) + "*2");
+            }
+            for (int row = 0; row < 1000; ++row) {
+                for (int col = 1; col < 20; ++col) {
+                    sheet->SetCell({ row, col }, "=" + Ref({ row, col - 1 }) + "+" + Ref({ row, 0 }) + "/3");
+                }
+            }
+        };
+
+        auto build_fill_down = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            for (int row = 0; row < ROWS; ++row) {
+                const std::string index = std::to_string(row + 1);
+                sheet->SetCell({ row, 0 }, std::to_string(row));
+                sheet->SetCell({ row, 1 }, std::to_string(row % 13 + 1));
+                sheet->SetCell({ row, 2 }, "=A" + index + "*B" + index + "+1");
+            }
+        };
+
+        auto prepare_hot_formula = [](std::size_t) {
+            ast = std::make_unique<FormulaAST>(ParseFormulaAST("(A1+B1)*(C1-D1)/(E1+1)-A1*2+B1/3-(C1+D1)*E1"));
+            // значения A1, B1, ... в порядке чтения формулой
+            inputs.clear();
+            for (const auto& op : ast->GetProgram().ops) {
+                if (op.code == FormulaProgram::OpCode::Cell) {
+                    inputs.push_back(HOT_VALUES[op.cell.col]);
+                }
+            }
+            jit = JitFormula::Compile(ast->GetProgram());
+        };
+
+        auto prepare_bulk_cells = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            cells.clear();
+            for (int row = 0; row < ROWS; ++row) {
+                const std::string index = std::to_string(row + 1);
+                cells.emplace_back(Position{ row, 0 }, std::to_string(row));
+                cells.emplace_back(Position{ row, 1 }, "=A" + index + "*2+1");
+                cells.emplace_back(Position{ row, 2 }, "=(A" + index + "-B" + index + ")/3");
+                cells.emplace_back(Position{ row, 3 }, "=B" + index + "*C" + index + "-A" + index + "/7");
+            }
+        };
+
+        auto build_lookup = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            for (int row = 0; row < ROWS; ++row) {
+                const std::string index = std::to_string(row + 1);
+                sheet->SetCell({ row, 0 }, std::to_string(row * 3));
+                sheet->SetCell({ row, 1 }, std::to_string(row % 97));
+                sheet->SetCell({ row, 2 }, std::to_string((ROWS - row) * 3));
+                sheet->SetCell({ row, 3 }, "=VLOOKUP(C" + index + ",A1:B16384,2)");
+            }
+        };
+        auto evaluate_column = [](int col) {
+            for (int row = 0; row < ROWS; ++row) {
+                sheet->GetCell({ row, col })->GetValue();
+            }
+        };
+
+        // цепочка в A и столбец IF в B, выбирающий C1 вместо цепочки
+        auto build_conditional = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            sheet->SetCell({ 0, 0 }, "1");
+            sheet->SetCell({ 0, 2 }, "1");
+            for (int row = 1; row < ROWS; ++row) {
+                sheet->SetCell({ row, 0 }, "=A" + std::to_string(row) + "+1");
+            }
+            for (int row = 0; row < ROWS; ++row) {
+                sheet->SetCell({ row, 1 }, "=IF(C1>0,C1,A" + std::to_string(row + 1) + ")");
+            }
+        };
+
+        auto build_shifted = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            for (int row = 0; row < ROWS / 2; ++row) {
+                const std::string index = std::to_string(row + 1);
+                sheet->SetCell({ row, 0 }, std::to_string(row));
+                sheet->SetCell({ row, 1 }, "=A" + index + "*2");
+                sheet->SetCell({ row, 2 }, row > 0 ? "=C" + std::to_string(row) + "+B" + index : "0");
+            }
+            sheet->GetCell({ ROWS / 2 - 1, 2 })->GetValue();
+        };
+
+        auto with_numbers = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            for (int row = 0; row < ROWS; ++row) {
+                sheet->SetCell({ row, 0 }, std::to_string(row));
+            }
+        };
+
+        // 32768 правок: числа в A и формулы в B
+        auto edit = [] {
+            for (int row = 0; row < ROWS; ++row) {
+                sheet->SetCell({ row, 0 }, std::to_string(row));
+                sheet->SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+            }
+        };
+        auto with_journal = [](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            sheet->SetJournalBudget(64 << 20);
+        };
+        auto journal_counters = [] {
+            return Counters{ { "journal_bytes", static_cast<std::uint64_t>(sheet->GetJournal().GetMemoryUsage()) } };
+        };
+
+        std::vector<Case> cases = {
+            Scenario("DeepChain/build", ROWS, fresh, [](std::size_t) {
+                BuildChain(*sheet, ROWS);
+            }),
+            Scenario("DeepChain/GetValue cold", ROWS, with_chain, [last](std::size_t) {
+                sheet->GetCell(last)->GetValue();
+            }),
+            Scenario("DeepChain/GetValue warm", ROWS, with_warm_chain, [last](std::size_t) {
+                sheet->GetCell(last)->GetValue();
+            }),
+            Scenario("DeepChain/edit head", ROWS, with_warm_chain, [last](std::size_t) {
+                sheet->SetCell({ 0, 0 }, "2");
+                sheet->GetCell(last)->GetValue();
+            }),
+            Scenario("IncrementalRecalc/edit head in 200 us slices", ROWS, [with_warm_chain](std::size_t cells) {
+                with_warm_chain(cells);
+                sheet->SetIncrementalRecalc(true);
+            }, [last](std::size_t) {
+                using Clock = std::chrono::steady_clock;
+                slices = 0;
+                longest = {};
+                sheet->SetCell({ 0, 0 }, "2");
+                Sheet::RecalcProgress progress;
+                do {
+                    const Clock::time_point start = Clock::now();
+                    progress = sheet->RecalcFor(std::chrono::microseconds(200));
+                    longest = std::max<std::chrono::nanoseconds>(longest, Clock::now() - start);
+                    ++slices;
+                } while (!progress.IsComplete());
+                if (std::get<double>(sheet->GetCell(last)->GetValue()) != ROWS + 1) {
+                    std::abort();
+                }
+            }, [] {
+                return Counters{ { "slices", static_cast<std::uint64_t>(slices) },
+                    { "longest_slice_ns", static_cast<std::uint64_t>(longest.count()) } };
+            }),
+            Scenario("ErrorSaturated/PrintValues cold", 20000, build_errors, [](std::size_t) {
+                sheet->PrintValues(null_output);
+            }),
+            Scenario("ErrorSaturated/edit head", 20000, [build_errors](std::size_t cells) {
+                build_errors(cells);
+                sheet->PrintValues(null_output);
+            }, [](std::size_t) {
+                sheet->SetCell({ 0, 0 }, "=2/0");
+                sheet->PrintValues(null_output);
+            }),
+            Scenario("FillDown/GetValue per cell", ROWS, build_fill_down, [evaluate_column](std::size_t) {
+                evaluate_column(2);
+            }),
+            Scenario("FillDown/EvaluateBatched", ROWS, build_fill_down, [](std::size_t) {
+                sheet->EvaluateBatched();
+            }),
+            Scenario("HotFormula/tree walker", 1'000'000, prepare_hot_formula, [](std::size_t count) {
+                double sum = 0;
+                for (std::size_t i = 0; i < count; ++i) {
+                    sum += ast->Execute([](Position pos) { return HOT_VALUES[pos.col]; }, NoLookups);
+                }
+                if (sum == 0) {
+                    std::abort();
+                }
+            }),
+        };
+        if (JitFormula::Compile(ParseFormulaAST("A1+1").GetProgram())) {
+            cases.push_back(Scenario("HotFormula/JIT", 1'000'000, prepare_hot_formula, [](std::size_t count) {
+                double sum = 0;
+                for (std::size_t i = 0; i < count; ++i) {
+                    sum += (*jit)(inputs.data());
+                }
+                if (sum == 0) {
+                    std::abort();
+                }
+            }));
+        }
+        for (unsigned threads : { 1u, 2u, 4u, 8u }) {
+            cases.push_back(Scenario("BulkLoad/SetCells " + std::to_string(threads) + " threads", 4 * ROWS,
+                prepare_bulk_cells, [threads](std::size_t) {
+                    sheet->SetCells(cells, threads);
+                }));
+        }
+        for (Case scenario : {
+            Scenario("Lookup/build", ROWS, fresh, [build_lookup](std::size_t cells) {
+                build_lookup(cells);
+            }),
+            Scenario("Lookup/VLOOKUP cold", ROWS, build_lookup, [evaluate_column](std::size_t) {
+                evaluate_column(3);
+            }),
+            Scenario("Lookup/edit key", ROWS, [build_lookup, evaluate_column](std::size_t cells) {
+                build_lookup(cells);
+                evaluate_column(3);
+            }, [evaluate_column](std::size_t) {
+                sheet->SetCell({ 5, 0 }, "1");
+                evaluate_column(3);
+            }),
+            Scenario("Conditional/IF with untaken chain cold", ROWS, build_conditional, [evaluate_column](std::size_t) {
+                evaluate_column(1);
+            }),
+            Scenario("Conditional/edit untaken chain", ROWS, [build_conditional, evaluate_column](std::size_t cells) {
+                build_conditional(cells);
+                evaluate_column(1);
+            }, [evaluate_column](std::size_t) {
+                sheet->SetCell({ 0, 0 }, "2");
+                evaluate_column(1);
+            }),
+            Scenario("Conditional/switch branch", ROWS, [build_conditional, evaluate_column](std::size_t cells) {
+                build_conditional(cells);
+                evaluate_column(1);
+            }, [evaluate_column](std::size_t) {
+                sheet->SetCell({ 0, 2 }, "0");
+                evaluate_column(1);
+            }),
+            Scenario("InsertRows/10 in the middle", ROWS / 2 * 3, build_shifted, [](std::size_t) {
+                for (int i = 0; i < 10; ++i) {
+                    sheet->InsertRows(ROWS / 4);
+                }
+            }),
+            Scenario("DeleteRows/10 in the middle", ROWS / 2 * 3, build_shifted, [](std::size_t) {
+                for (int i = 0; i < 10; ++i) {
+                    sheet->DeleteRows(ROWS / 4);
+                }
+            }),
+            Scenario("FillRange/SetCell", ROWS, with_numbers, [](std::size_t) {
+                for (int row = 0; row < ROWS; ++row) {
+                    const std::string index = std::to_string(row + 1);
+                    sheet->SetCell({ row, 1 }, "=A" + index + "*2+A" + index + "/3");
+                }
+            }),
+            Scenario("FillRange/FillRange", ROWS, with_numbers, [](std::size_t) {
+                sheet->SetCell({ 0, 1 }, "=A1*2+A1/3");
+                sheet->FillRange({ 0, 1 }, { Position{ 1, 1 }, Position{ ROWS - 1, 1 } });
+            }),
+            Scenario("Journal/edits without journal", 2 * ROWS, fresh, [edit](std::size_t) {
+                edit();
+            }),
+            Scenario("Journal/edits with journal", 2 * ROWS, with_journal, [edit](std::size_t) {
+                edit();
+            }, journal_counters),
+            Scenario("Journal/undo", 2 * ROWS, [with_journal, edit](std::size_t cells) {
+                with_journal(cells);
+                edit();
+            }, [](std::size_t) {
+                while (sheet->Undo()) {
+                }
+            }),
+            Scenario("Journal/redo", 2 * ROWS, [with_journal, edit](std::size_t cells) {
+                with_journal(cells);
+                edit();
+                while (sheet->Undo()) {
+                }
+            }, [](std::size_t) {
+                while (sheet->Redo()) {
+                }
+            }, journal_counters),
+        }) {
+            cases.push_back(std::move(scenario));
+        }
+
+        // журнал и подкачка пишут файлы через POSIX, см. platform.h
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+        const std::string wal_path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.wal").string();
+        auto with_log = [wal_path](std::size_t) {
+            sheet.reset();
+            log.reset();
+            std::filesystem::remove(wal_path);
+            sheet = std::make_unique<Sheet>();
+            log = std::make_unique<WriteAheadLog>(wal_path);
+            sheet->SetWriteAheadLog(log.get());
+        };
+        auto log_counters = [wal_path] {
+            Counters counters{ { "records", static_cast<std::uint64_t>(log->GetRecordCount()) },
+                { "batches", static_cast<std::uint64_t>(log->GetBatchCount()) } };
+            sheet.reset();
+            log.reset();
+            std::filesystem::remove(wal_path);
+            return counters;
+        };
+
+        for (Case scenario : {
+            Scenario("WAL/edits with log", 2 * ROWS, with_log, [edit](std::size_t) {
+                edit();
+            }, log_counters),
+            Scenario("WAL/sync", 2 * ROWS, [with_log, edit](std::size_t cells) {
+                with_log(cells);
+                edit();
+            }, [](std::size_t) {
+                log->Sync();
+            }, log_counters),
+            Scenario("WAL/recover", 2 * ROWS, [with_log, edit](std::size_t cells) {
+                with_log(cells);
+                edit();
+                sheet->SetWriteAheadLog(nullptr);
+                log.reset();
+                sheet = std::make_unique<Sheet>();
+            }, [wal_path](std::size_t) {
+                RecoverSheet(*sheet, wal_path + ".snapshot", wal_path);
+            }, [wal_path] {
+                sheet.reset();
+                std::filesystem::remove(wal_path);
+                return Counters{};
+            }),
+        }) {
+            cases.push_back(std::move(scenario));
+        }
+
+        // 64 столбца чисел, с подкачкой и без
+        const std::string spill_path = (std::filesystem::temp_directory_path() / "spreadsheet_bench.spill").string();
+        constexpr int PAGED_COLS = 64;
+        auto fill_numbers = [] {
+            for (int col = 0; col < PAGED_COLS; ++col) {
+                for (int row = 0; row < ROWS; ++row) {
+                    sheet->SetCell({ row, col }, std::to_string(row + col));
+                }
+            }
+        };
+        auto scan_numbers = [] {
+            double sum = 0.0;
+            for (int col = 0; col < PAGED_COLS; ++col) {
+                for (int row = 0; row < ROWS; ++row) {
+                    sum += *sheet->FindNumber({ row, col });
+                }
+            }
+            const double expected = (static_cast<double>(ROWS - 1) + PAGED_COLS - 1) / 2 * ROWS * PAGED_COLS;
+            if (sum != expected) {
+                std::abort();
+            }
+        };
+        auto with_paging = [spill_path](std::size_t) {
+            sheet = std::make_unique<Sheet>();
+            sheet->SetNumberPaging(spill_path, 1 << 20);
+        };
+        auto paging_counters = [] {
+            const NumberColumns::PagingStats stats = sheet->GetNumberPagingStats();
+            return Counters{ { "numbers_bytes", static_cast<std::uint64_t>(sheet->GetMemoryUsage().numbers) },
+                { "faults", static_cast<std::uint64_t>(stats.faults) }, { "writes", static_cast<std::uint64_t>(stats.writes) } };
+        };
+
+        for (Case scenario : {
+            Scenario("Paging/fill with 1 MiB budget", PAGED_COLS * ROWS, with_paging, [fill_numbers](std::size_t) {
+                fill_numbers();
+            }, paging_counters),
+            Scenario("Paging/scan resident", PAGED_COLS * ROWS, [fill_numbers](std::size_t) {
+                sheet = std::make_unique<Sheet>();
+                fill_numbers();
+            }, [scan_numbers](std::size_t) {
+                scan_numbers();
+            }, [] {
+                return Counters{ { "numbers_bytes", static_cast<std::uint64_t>(sheet->GetMemoryUsage().numbers) } };
+            }),
+            Scenario("Paging/scan with 1 MiB budget", PAGED_COLS * ROWS, [with_paging, fill_numbers](std::size_t cells) {
+                with_paging(cells);
+                fill_numbers();
+            }, [scan_numbers](std::size_t) {
+                scan_numbers();
+            }, paging_counters),
+        }) {
+            cases.push_back(std::move(scenario));
+        }
+#endif
+        return cases;
+    }
+
+    void PrintJson(std::ostream& output, const std::vector<Result>& results, const Options& options) {
+        output << "{\n  \"seed\": " << SEED << ",\n  \"repetitions\": " << options.repetitions
+               << ",\n  \"benchmarks\": [";
+        bool first = true;
+        for (const auto& result : results) {
+            std::vector<std::int64_t> sorted = result.samples_ns;
+            std::sort(sorted.begin(), sorted.end());
+            const std::int64_t median = sorted[sorted.size() / 2];
+
+            output << (first ? "\n" : ",\n");
+            first = false;
+            output << "    { \"name\": \"" << result.name << "\", \"cells\": " << result.cells
+                   << ", \"min_ns\": " << sorted.front() << ", \"median_ns\": " << median
+                   << ", \"max_ns\": " << sorted.back()
+                   << ", \"ns_per_cell\": " << static_cast<double>(median) / result.cells << ", \"samples_ns\": [";
+            for (std::size_t i = 0; i < result.samples_ns.size(); ++i) {
+                output << (i > 0 ? ", " : "") << result.samples_ns[i];
+            }
+            output << "]";
+            if (!result.counters.empty()) {
+                output << ", \"counters\": {";
+                for (std::size_t i = 0; i < result.counters.size(); ++i) {
+                    output << (i > 0 ? ", " : " ") << "\"" << result.counters[i].first << "\": "
+                           << result.counters[i].second;
+                }
+                output << " }";
+            }
+            output << " }";
+        }
+        output << "\n  ]\n}\n";
+    }
+
+    Options ParseOptions(int argc, char** argv) {
+        Options options;
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (i + 1 >= argc) {
+                std::cerr << "Missing value for " << arg << std::endl;
+                std::exit(2);
+            }
+            const std::string value = argv[++i];
+            if (arg == "--max-cells") {
+                options.max_cells = std::stoull(value);
+            }
+            else if (arg == "--repetitions") {
+                options.repetitions = std::max(1, std::stoi(value));
+            }
+            else if (arg == "--filter") {
+                options.filter = value;
+            }
+            else {
+                std::cerr << "Unknown option " << arg << std::endl;
+                std::exit(2);
+            }
+        }
+        return options;
+    }
+}  // namespace
+
+int main(int argc, char** argv) {
+    const Options options = ParseOptions(argc, argv);
+
+    std::vector<Case> cases = MakeCases();
+    for (Case& scenario : MakeScenarios()) {
+        cases.push_back(std::move(scenario));
+    }
+
+    std::vector<Result> results;
+    for (const auto& bench : cases) {
+        if (bench.name.find(options.filter) == std::string::npos) {
+            continue;
+        }
+        const std::vector<std::size_t> sizes = bench.fixed_cells ? std::vector{ bench.fixed_cells } : SIZES;
+        for (std::size_t cells : sizes) {
+            if (cells > options.max_cells || cells > bench.max_cells) {
+                break;
+            }
+            Result result{ bench.name, cells, {} };
+            for (int repetition = 0; repetition < options.repetitions; ++repetition) {
+                bench.prepare(cells);
+                const auto start = Clock::now();
+                bench.run(cells);
+                const auto duration = Clock::now() - start;
+                result.samples_ns.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+            }
+            if (bench.finish) {
+                result.counters = bench.finish();
+            }
+            std::cerr << bench.name << ", " << cells << " cells: "
+                      << result.samples_ns.back() / 1000 << " us" << std::endl;
+            results.push_back(std::move(result));
+        }
+    }
+
+    PrintJson(std::cout, results, options);
+    return 0;
+}
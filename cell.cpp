@@ -7,128 +7,224 @@
 #include <optional>
 #include <stack>
 #include <algorithm>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 
+namespace {
+    // Ячейки без значения, прочитанные формулой, которую вычисляет
+    // Cell::TryEvaluate() этого потока; nullptr вне вычисления
+    thread_local std::vector<const Cell*>* unevaluated_reads = nullptr;
+}
+
 class Cell::Impl {
 public:
-    using Value = std::variant<std::string, double, FormulaError>;
-
-    explicit Impl(std::string text) 
-        : value_(text) 
-    {}
-
     virtual ~Impl() = default;
 
     virtual std::string GetText() const = 0;
 
-    virtual Value GetValue(SheetInterface& sheet) const = 0;
+    virtual PositionSpan GetReferencedCells() const = 0;
+
+    virtual std::size_t GetMemoryUsage() const = 0;
+    virtual ContentMemory GetMemory() const = 0;
 
-    virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual bool IsEmpty() const {
+        return false;
+    }
 
-protected:
-    std::string value_;
+    virtual const FormulaInterface* GetFormula() const {
+        return nullptr;
+    }
+    FormulaInterface* GetFormula() {
+        return const_cast<FormulaInterface*>(std::as_const(*this).GetFormula());
+    }
 };
 
-class Cell::EmptyImpl : public Impl {
+// Содержимое без формулы, значение которого известно без вычислений.
+// Формулы вычисляются через GetFormula() и этого метода не имеют.
+class Cell::ValueImpl : public Impl {
 public:
-    explicit EmptyImpl()
-        : Impl("")
-    {}
+    virtual ValueView GetValue() const = 0;
+};
 
+class Cell::EmptyImpl : public ValueImpl {
+public:
     std::string GetText() const override {
-        return value_;
+        return {};
     }
 
-    Value GetValue(SheetInterface&) const override {
-        return value_;
+    ValueView GetValue() const override {
+        return std::string_view{};
     }
 
 
-    std::vector<Position> GetReferencedCells() const {
+    PositionSpan GetReferencedCells() const override {
         return {};
     }
 
+    std::size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    ContentMemory GetMemory() const override {
+        return { sizeof(*this), 0 };
+    }
+
+    bool IsEmpty() const override {
+        return true;
+    }
 };
 
-class Cell::TextImpl : public Impl {
+class Cell::TextImpl : public ValueImpl {
 public:
-    explicit TextImpl(std::string& text)
-        : Cell::Impl(std::move(text)) {}
+    explicit TextImpl(StringPool& pool, std::string_view text)
+        : pool_(pool)
+        , text_(pool.Intern(text)) {}
+
+    ~TextImpl() {
+        pool_.Release(text_);
+    }
 
     std::string GetText() const override {
-        return value_;
+        return std::string(pool_.Get(text_));
     }
 
 
-    Value GetValue(SheetInterface&) const override {
-        if (value_[0] == ESCAPE_SIGN) {
-            return value_.substr(1);
+    ValueView GetValue() const override {
+        std::string_view text = pool_.Get(text_);
+        if (text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
         }
-        return value_;
+        return text;
     }
 
-    std::vector<Position> GetReferencedCells() const {
+    PositionSpan GetReferencedCells() const override {
         return {};
     }
 
+    std::size_t GetMemoryUsage() const override {
+        return sizeof(*this) + pool_.Get(text_).size();
+    }
+
+    ContentMemory GetMemory() const override {
+        return { sizeof(*this), 0 };
+    }
 
+private:
+    StringPool& pool_;
+    StringPool::Handle text_;
 };
 
 class Cell::FormulaImpl : public Impl {
 public:
-    explicit FormulaImpl(SheetInterface& sheet, std::string text)
-        : Impl(text)
-        , formula_(ParseFormula(text)) 
+    explicit FormulaImpl(std::string text)
+        : formula_(ParseFormula(std::move(text))) 
+    {}
+
+    explicit FormulaImpl(std::unique_ptr<FormulaInterface> formula)
+        : formula_(std::move(formula))
     {}
 
     std::string GetText() const override {
         return FORMULA_SIGN + formula_->GetExpression();
     }
 
-    Value GetValue(SheetInterface& sheet) const override {
-        const auto& value = formula_->Evaluate(sheet);
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
-        }
-        if (std::holds_alternative<FormulaError>(value)) {
-            return std::get<FormulaError>(value);
-        }
-        return "";
+    PositionSpan GetReferencedCells() const override {
+        return formula_->GetReferencedCellsView();
+    }
+
+    std::size_t GetMemoryUsage() const override {
+        return sizeof(*this) + formula_->GetMemoryUsage();
     }
 
-    std::vector<Position> GetReferencedCells() const {
-        return formula_->GetReferencedCells();
+    ContentMemory GetMemory() const override {
+        return { sizeof(*this), formula_->GetMemoryUsage() };
+    }
+
+    const FormulaInterface* GetFormula() const override {
+        return formula_.get();
     }
 private:
     std::unique_ptr<FormulaInterface> formula_;
 };
 
 
-Cell::Cell(Sheet& sheet) 
+Cell::Cell(Sheet& sheet, Position pos)
     : sheet_(sheet)
+    , pos_(pos)
     , impl_(std::make_unique<EmptyImpl>())
 {}
 
 Cell::~Cell() {}
 
-void Cell::Set(std::string text) {
+Cell::Content::Content(std::unique_ptr<Impl> impl)
+    : impl_(std::move(impl))
+{}
+
+Cell::Content::Content(Content&&) noexcept = default;
+Cell::Content& Cell::Content::operator=(Content&&) noexcept = default;
+Cell::Content::~Content() = default;
+
+PositionSpan Cell::Content::GetReferencedCells() const {
+    return impl_->GetReferencedCells();
+}
+
+const std::vector<FormulaProgram::Range>& Cell::Content::GetReferencedRanges() const {
+    static const std::vector<FormulaProgram::Range> no_ranges;
+    const FormulaInterface* formula = impl_->GetFormula();
+    return formula ? formula->GetReferencedRanges() : no_ranges;
+}
+
+bool Cell::Content::IsFormula() const {
+    return impl_->GetFormula() != nullptr;
+}
+
+bool Cell::Content::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
+std::size_t Cell::Content::GetMemoryUsage() const {
+    return impl_->GetMemoryUsage();
+}
+
+Cell::ContentMemory Cell::Content::GetMemory() const {
+    return impl_->GetMemory();
+}
+
+Cell::Content Cell::Parse(std::string text, StringPool& pool) {
     if (text.empty()) {
-         impl_ = std::make_unique<EmptyImpl>();
+        return Content(std::make_unique<EmptyImpl>());
     }
-    else if (text.size() > 1 && text[0] == FORMULA_SIGN) {
+    else if (IsFormulaText(text)) {
         try {
-            impl_ = std::make_unique<FormulaImpl>(sheet_, text.substr(1));
+            return Content(std::make_unique<FormulaImpl>(text.substr(1)));
         }
         catch (...) {
             throw FormulaException("Formula sytnaxis error");
         }
-      
-    }
-    else {    
-        impl_ = std::make_unique<TextImpl>(text);
     }
+    return Content(std::make_unique<TextImpl>(pool, text));
+}
 
+Cell::Content Cell::CopyFormula(int row_shift, int col_shift) const {
+    const FormulaInterface* formula = impl_->GetFormula();
+    assert(formula != nullptr);
+    return Content(std::make_unique<FormulaImpl>(formula->Copy(row_shift, col_shift)));
+}
+
+bool Cell::IsFormulaText(std::string_view text) {
+    return text.size() > 1 && text[0] == FORMULA_SIGN;
+}
+
+void Cell::Set(std::string text) {
+    Set(Parse(std::move(text), sheet_.GetStringPool()));
+}
+
+Cell::Content Cell::Set(Content content) {
+    std::swap(impl_, content.impl_);
+    cached_value_.reset();
+    return content;
 }
 
 void Cell::Clear() {
@@ -139,12 +235,136 @@ void Cell::InvalidateCache() {
     cached_value_.reset();
 }
 
+// значение текстовой или пустой ячейки известно всегда
+bool Cell::HasCachedValue() const {
+    return cached_value_.has_value() || !impl_->GetFormula();
+}
+
+bool Cell::HasObserved(Position pos) const {
+    const FormulaInterface* formula = impl_->GetFormula();
+    if (!formula || !formula->GetProgram().has_branches) {
+        return true;
+    }
+    PositionSpan observed = formula->GetObservedCellsView();
+    return std::binary_search(observed.begin(), observed.end(), pos);
+}
+
+bool Cell::ShiftReferences(const PositionShift& shift) {
+    FormulaInterface* formula = impl_->GetFormula();
+    return formula && formula->ShiftReferences(shift);
+}
+
+void Cell::SetCachedValue(FormulaInterface::Value value) {
+    cached_value_ = value;
+}
+
+const FormulaInterface* Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+Cell::ContentMemory Cell::GetContentMemory() const {
+    return impl_->GetMemory();
+}
+
 Cell::Value Cell::GetValue() const {
+    return std::visit([](const auto& value) -> Value {
+            if constexpr (std::is_same_v<std::decay_t<decltype(value)>, std::string_view>) {
+                return std::string(value);
+            }
+            else {
+                return value;
+            }
+        }, GetValueView());
+}
+
+// Текст не кэшируется отдельно: представление указывает прямо в пул строк.
+// Кэшируются только значения формул.
+Cell::ValueView Cell::GetValueView() const {
+    if (!impl_->GetFormula()) {
+        return static_cast<const ValueImpl&>(*impl_).GetValue();
+    }
+
     if (!cached_value_) {
-        cached_value_ = impl_->GetValue(sheet_);
+        if (unevaluated_reads) {
+            // ячейку читает формула, вычисляемая в TryEvaluate(): вместо
+            // вложенного вычисления чтение откладывается
+            unevaluated_reads->push_back(this);
+            return 0.0;
+        }
+        sheet_.GetStatsCounters().Add(StatsCounters::CacheMisses, 1);
+        EvaluateWithDependencies();
     }
+    else {
+        sheet_.GetStatsCounters().Add(StatsCounters::CacheHits, 1);
+    }
+    if (std::holds_alternative<double>(*cached_value_)) {
+        return std::get<double>(*cached_value_);
+    }
+    return std::get<FormulaError>(*cached_value_);
+}
+
+// Вычисляет ячейку вместе со всеми ещё не вычисленными ячейками, от которых
+// она зависит. Зависимости обходятся в глубину с явным стеком, так что
+// цепочка любой длины не растит стек вызовов.
+void Cell::EvaluateWithDependencies() const {
+    std::vector<const Cell*> unevaluated{ this };
 
-    return *cached_value_;
+    while (!unevaluated.empty()) {
+        if (unevaluated.back()->TryEvaluate(unevaluated)) {
+            unevaluated.pop_back();
+        }
+    }
+}
+
+// Ссылки вне ветвей IF известны заранее и проверяются до вычисления. Ячейки
+// выбранной ветви и диапазонов поиска выясняются только при вычислении:
+// GetValueView() ячейки без значения записывает её в unevaluated_reads и
+// возвращает заглушку, а результат такого вычисления отбрасывается.
+// Невыбранная ветвь остаётся невычисленной.
+bool Cell::TryEvaluate(std::vector<const Cell*>& unevaluated) const {
+    if (HasCachedValue()) {
+        return true;
+    }
+
+    const std::size_t size = unevaluated.size();
+    const FormulaInterface* formula = impl_->GetFormula();
+    for (Position position : formula->GetUnconditionalCellsView()) {
+        const Cell* dependency = sheet_.GetConcreteCell(position);
+        if (dependency && !dependency->HasCachedValue()) {
+            unevaluated.push_back(dependency);
+        }
+    }
+    if (unevaluated.size() != size) {
+        return false;
+    }
+
+    // при компиляции в машинный код память формулы растёт
+    const std::size_t memory = formula->GetMemoryUsage();
+    FormulaInterface::Value value;
+    {
+        TraceScope trace(sheet_.GetTracer(), "evaluate", pos_);
+        std::vector<const Cell*>* outer = std::exchange(unevaluated_reads, &unevaluated);
+        try {
+            value = formula->Evaluate(sheet_);
+        } catch (...) {
+            unevaluated_reads = outer;
+            throw;
+        }
+        unevaluated_reads = outer;
+    }
+    if (const std::size_t grown = formula->GetMemoryUsage(); grown != memory) {
+        sheet_.ResizeFormulaMemory(memory, grown);
+    }
+    if (unevaluated.size() != size) {
+        return false;
+    }
+
+    cached_value_ = value;
+    sheet_.GetStatsCounters().Add(StatsCounters::Evaluations, 1);
+    if (!formula->GetReferencedRanges().empty()) {
+        sheet_.MarkRangesEvaluated(formula->GetReferencedRanges());
+    }
+    return true;
 }
 
 std::string Cell::GetText() const {
@@ -152,9 +372,20 @@ std::string Cell::GetText() const {
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
+    PositionSpan cells = impl_->GetReferencedCells();
+    return { cells.begin(), cells.end() };
+}
+
+PositionSpan Cell::GetReferencedCellsView() const {
     return impl_->GetReferencedCells();
 }
 
+const std::vector<FormulaProgram::Range>& Cell::GetReferencedRanges() const {
+    static const std::vector<FormulaProgram::Range> no_ranges;
+    const FormulaInterface* formula = impl_->GetFormula();
+    return formula ? formula->GetReferencedRanges() : no_ranges;
+}
+
 
 
 
@@ -2,39 +2,129 @@
 
 #include "common.h"
 #include "formula.h"
+#include "string_pool.h"
 
 #include <functional>
 #include <unordered_set>
 #include <optional>
+#include <vector>
 
 class Sheet;
 
 class Cell : public CellInterface {
+private:
+    class Impl;
+
 public:
-    Cell(Sheet& sheet);
+    // Память содержимого по частям: объект содержимого и формула с программой
+    // и списками ссылок. Текст ячейки учитывается в пуле строк.
+    struct ContentMemory {
+        std::size_t content = 0;
+        std::size_t formula = 0;
+    };
+
+    // Разобранное содержимое ячейки, которое ещё не установлено в неё. Позволяет
+    // проверить новую формулу до того, как ячейка изменится.
+    class Content {
+    public:
+        Content(Content&&) noexcept;
+        Content& operator=(Content&&) noexcept;
+        ~Content();
+
+        PositionSpan GetReferencedCells() const;
+        const std::vector<FormulaProgram::Range>& GetReferencedRanges() const;
+        bool IsFormula() const;
+        bool IsEmpty() const;
+        // Память, которую занимает содержимое вне ячейки
+        std::size_t GetMemoryUsage() const;
+        ContentMemory GetMemory() const;
+
+    private:
+        friend class Cell;
+        explicit Content(std::unique_ptr<Impl> impl);
+
+        std::unique_ptr<Impl> impl_;
+    };
+
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
+    // Разбирает текст ячейки, текст без формулы помещается в pool. Бросает
+    // FormulaException, если формула синтаксически некорректна.
+    // Формулы разбираются без обращения к pool, поэтому их можно разбирать
+    // одновременно из разных потоков.
+    static Content Parse(std::string text, StringPool& pool);
+    // Будет ли текст разобран как формула
+    static bool IsFormulaText(std::string_view text);
+
+    // Копия формулы ячейки со ссылками, сдвинутыми на row_shift строк и
+    // col_shift столбцов. Ячейка должна содержать формулу.
+    Content CopyFormula(int row_shift, int col_shift) const;
+
     void Set(std::string text);
+    // Устанавливает новое содержимое и возвращает прежнее
+    Content Set(Content content);
 
     void Clear();
 
     Value GetValue() const override;
+    ValueView GetValueView() const override;
 
     std::string GetText() const override;
 
     std::vector<Position> GetReferencedCells() const override;
+    PositionSpan GetReferencedCellsView() const override;
+    // Столбцы, просматриваемые функциями поиска формулы
+    const std::vector<FormulaProgram::Range>& GetReferencedRanges() const;
 
     void InvalidateCache();
 
+    bool HasCachedValue() const;
+
+    // Читала ли формула ячейку pos при последнем вычислении. Для формулы без
+    // IF совпадает с наличием pos среди ссылок.
+    bool HasObserved(Position pos) const;
+
+    // Переносит ссылки формулы при вставке или удалении строк либо столбцов,
+    // см. FormulaInterface::ShiftReferences(). Кэш не сбрасывается.
+    bool ShiftReferences(const PositionShift& shift);
+
+    // Вычисляет формулу, если у всех ячеек, которые она читает, уже есть
+    // значение, и возвращает true. Иначе кэш не заполняется, ячейки без
+    // значения добавляются в unevaluated и возвращается false. Ячейка без
+    // формулы или с кэшем сразу возвращает true.
+    bool TryEvaluate(std::vector<const Cell*>& unevaluated) const;
+
+    // Записывает значение формулы, вычисленное в обход GetValue(), например пакетно
+    void SetCachedValue(FormulaInterface::Value value);
+
+    // Возвращает формулу ячейки или nullptr, если ячейка не содержит формулы
+    const FormulaInterface* GetFormula() const;
+
+    ContentMemory GetContentMemory() const;
+    // Место под кэш значения внутри ячейки
+    static constexpr std::size_t CACHED_VALUE_SIZE = sizeof(std::optional<FormulaInterface::Value>);
+
+    // Позиция ячейки в таблице; таблица обновляет её при сдвиге строк и
+    // столбцов
+    Position GetPosition() const {
+        return pos_;
+    }
+    void SetPosition(Position pos) {
+        pos_ = pos;
+    }
+
 private:
+    void EvaluateWithDependencies() const;
    
-    class Impl;
+    class ValueImpl;
     class EmptyImpl;
     class TextImpl;
     class FormulaImpl;
 
     Sheet& sheet_;
+    Position pos_;
     std::unique_ptr<Impl> impl_;
 
-    mutable std::optional<Value> cached_value_;
-};
\ No newline at end of file
+    mutable std::optional<FormulaInterface::Value> cached_value_;
+};
\ No newline at end of file
@@ -0,0 +1,244 @@
+#include "column_evaluator.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SPREADSHEET_AVX2_KERNELS
+#include <immintrin.h>
+#endif
+
+namespace {
+    // протяжки короче этого вычисляются по ячейкам
+    constexpr int MIN_RUN_ROWS = 8;
+    // строки обрабатываются блоками, чтобы стек программы помещался в кэш
+    constexpr std::size_t CHUNK_ROWS = 256;
+
+    using OpCode = FormulaProgram::OpCode;
+
+    void ApplyBinaryScalar(OpCode code, double* lhs, const double* rhs, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            lhs[i] = FormulaProgram::Apply(code, lhs[i], rhs[i]);
+        }
+    }
+
+    void NegateScalar(double* values, std::size_t count) {
+        for (std::size_t i = 0; i < count; ++i) {
+            values[i] = -values[i];
+        }
+    }
+
+#ifdef SPREADSHEET_AVX2_KERNELS
+    bool HasAvx2() {
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        return has_avx2;
+    }
+
+    __attribute__((target("avx2")))
+    inline __m256d SelectErrors(__m256d result, __m256d lhs, __m256d rhs) {
+        result = _mm256_blendv_pd(result, rhs, _mm256_cmp_pd(rhs, rhs, _CMP_UNORD_Q));
+        return _mm256_blendv_pd(result, lhs, _mm256_cmp_pd(lhs, lhs, _CMP_UNORD_Q));
+    }
+
+    __attribute__((target("avx2")))
+    void ApplyBinaryAvx2(OpCode code, double* lhs, const double* rhs, std::size_t count) {
+        std::size_t i = 0;
+        switch (code) {
+        case OpCode::Add:
+            for (; i + 4 <= count; i += 4) {
+                __m256d l = _mm256_loadu_pd(lhs + i);
+                __m256d r = _mm256_loadu_pd(rhs + i);
+                _mm256_storeu_pd(lhs + i, SelectErrors(_mm256_add_pd(l, r), l, r));
+            }
+            break;
+        case OpCode::Subtract:
+            for (; i + 4 <= count; i += 4) {
+                __m256d l = _mm256_loadu_pd(lhs + i);
+                __m256d r = _mm256_loadu_pd(rhs + i);
+                _mm256_storeu_pd(lhs + i, SelectErrors(_mm256_sub_pd(l, r), l, r));
+            }
+            break;
+        case OpCode::Multiply:
+            for (; i + 4 <= count; i += 4) {
+                __m256d l = _mm256_loadu_pd(lhs + i);
+                __m256d r = _mm256_loadu_pd(rhs + i);
+                _mm256_storeu_pd(lhs + i, SelectErrors(_mm256_mul_pd(l, r), l, r));
+            }
+            break;
+        case OpCode::Divide: {
+            const __m256d zero = _mm256_setzero_pd();
+            const __m256d div0 = _mm256_set1_pd(FormulaValue::MakeError(FormulaError::Category::Div0));
+            for (; i + 4 <= count; i += 4) {
+                __m256d l = _mm256_loadu_pd(lhs + i);
+                __m256d r = _mm256_loadu_pd(rhs + i);
+                __m256d result = _mm256_blendv_pd(_mm256_div_pd(l, r), div0, _mm256_cmp_pd(r, zero, _CMP_EQ_OQ));
+                _mm256_storeu_pd(lhs + i, SelectErrors(result, l, r));
+            }
+            break;
+        }
+        default:
+            break;
+        }
+        ApplyBinaryScalar(code, lhs + i, rhs + i, count - i);
+    }
+
+    __attribute__((target("avx2")))
+    void NegateAvx2(double* values, std::size_t count) {
+        const __m256d sign = _mm256_set1_pd(-0.0);
+        std::size_t i = 0;
+        for (; i + 4 <= count; i += 4) {
+            _mm256_storeu_pd(values + i, _mm256_xor_pd(_mm256_loadu_pd(values + i), sign));
+        }
+        NegateScalar(values + i, count - i);
+    }
+#endif
+
+    void ApplyBinaryColumn(OpCode code, double* lhs, const double* rhs, std::size_t count) {
+#ifdef SPREADSHEET_AVX2_KERNELS
+        if (HasAvx2()) {
+            ApplyBinaryAvx2(code, lhs, rhs, count);
+            return;
+        }
+#endif
+        ApplyBinaryScalar(code, lhs, rhs, count);
+    }
+
+    void NegateColumn(double* values, std::size_t count) {
+#ifdef SPREADSHEET_AVX2_KERNELS
+        if (HasAvx2()) {
+            NegateAvx2(values, count);
+            return;
+        }
+#endif
+        NegateScalar(values, count);
+    }
+
+    // Проверяет, ссылается ли протяжка строк [first_row, last_row) сама на себя
+    bool DependsOnRun(const FormulaProgram& program, int col, int first_row, int last_row) {
+        for (const auto& op : program.ops) {
+            if (op.code == OpCode::Cell && op.cell.col == col
+                && std::abs(op.cell.row - first_row) < last_row - first_row) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    FormulaInterface::Value ToFormulaValue(double value) {
+        if (FormulaValue::IsError(value)) {
+            return FormulaError(FormulaValue::GetErrorCategory(value));
+        }
+        return value;
+    }
+}  // namespace
+
+void EvaluateProgramBatch(const FormulaProgram& program, const std::vector<const double*>& inputs,
+    double* results, std::size_t count) {
+    std::vector<double> stack(program.max_depth * CHUNK_ROWS);
+    auto slot = [&stack](std::size_t depth) {
+        return stack.data() + depth * CHUNK_ROWS;
+    };
+
+    for (std::size_t begin = 0; begin < count; begin += CHUNK_ROWS) {
+        const std::size_t rows = std::min(CHUNK_ROWS, count - begin);
+        std::size_t depth = 0;
+        std::size_t input = 0;
+
+        for (const auto& op : program.ops) {
+            switch (op.code) {
+            case OpCode::Number:
+                std::fill(slot(depth), slot(depth) + rows, op.number);
+                ++depth;
+                break;
+            case OpCode::Cell:
+                std::copy(inputs[input] + begin, inputs[input] + begin + rows, slot(depth));
+                ++input;
+                ++depth;
+                break;
+            case OpCode::UnaryPlus:
+                break;
+            case OpCode::UnaryMinus:
+                NegateColumn(slot(depth - 1), rows);
+                break;
+            default:
+                ApplyBinaryColumn(op.code, slot(depth - 2), slot(depth - 1), rows);
+                --depth;
+            }
+        }
+        std::copy(slot(0), slot(0) + rows, results + begin);
+    }
+}
+
+ColumnEvaluator::ColumnEvaluator(Sheet& sheet)
+    : sheet_(sheet) {
+}
+
+void ColumnEvaluator::EvaluateColumn(int col, int rows) {
+    for (int row = 0; row < rows;) {
+        const Cell* cell = sheet_.GetConcreteCell({ row, col });
+        const FormulaInterface* formula = cell ? cell->GetFormula() : nullptr;
+        if (!formula || cell->HasCachedValue()) {
+            ++row;
+            continue;
+        }
+
+        const FormulaProgram& program = formula->GetProgram();
+        int end = row + 1;
+        for (; end < rows; ++end) {
+            const Cell* next = sheet_.GetConcreteCell({ end, col });
+            const FormulaInterface* next_formula = next ? next->GetFormula() : nullptr;
+            if (!next_formula || next->HasCachedValue()
+                || !next_formula->GetProgram().IsRowShiftOf(program, end - row)) {
+                break;
+            }
+        }
+
+        // сравнения, IF и функции поиска вычисляются только по одной ячейке
+        if (end - row >= MIN_RUN_ROWS && program.IsArithmetic() && !DependsOnRun(program, col, row, end)) {
+            EvaluateRun(program, col, row, end);
+        }
+        else {
+            for (int current = row; current < end; ++current) {
+                sheet_.GetConcreteCell({ current, col })->GetValue();
+            }
+        }
+        row = end;
+    }
+}
+
+void ColumnEvaluator::EvaluateRun(const FormulaProgram& program, int col, int first_row, int last_row) {
+    const std::size_t count = last_row - first_row;
+
+    std::size_t input_count = 0;
+    for (const auto& op : program.ops) {
+        if (op.code == OpCode::Cell) {
+            ++input_count;
+        }
+    }
+
+    // входные значения собираются в столбцы; невычисленные ячейки
+    // вычисляются здесь же обычным способом
+    inputs_.resize(input_count * count);
+    input_columns_.clear();
+    for (const auto& op : program.ops) {
+        if (op.code != OpCode::Cell) {
+            continue;
+        }
+        double* column = inputs_.data() + input_columns_.size() * count;
+        for (std::size_t i = 0; i < count; ++i) {
+            column[i] = GetFormulaOperand(sheet_, &sheet_, { op.cell.row + static_cast<int>(i), op.cell.col });
+        }
+        input_columns_.push_back(column);
+    }
+
+    results_.resize(count);
+    TraceScope trace(sheet_.GetTracer(), "evaluate batch", { first_row, col });
+    EvaluateProgramBatch(program, input_columns_, results_.data(), count);
+    sheet_.GetStatsCounters().Add(StatsCounters::Evaluations, count);
+
+    for (std::size_t i = 0; i < count; ++i) {
+        sheet_.GetConcreteCell({ first_row + static_cast<int>(i), col })->SetCachedValue(ToFormulaValue(results_[i]));
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "formula_program.h"
+
+#include <cstddef>
+#include <vector>
+
+class Sheet;
+
+// Пакетное вычисление формул, протянутых вниз по столбцу. Подряд идущие строки
+// с одинаковой относительной формулой (C1=A1*B1+1, C2=A2*B2+1, ...) вычисляются
+// одной программой над столбцами входных значений: по 4 строки за инструкцию,
+// если процессор поддерживает AVX2, иначе обычным циклом. Результаты побитово
+// совпадают с вычислением каждой ячейки через Formula::Evaluate.
+class ColumnEvaluator {
+public:
+    explicit ColumnEvaluator(Sheet& sheet);
+
+    // Вычисляет все ещё не вычисленные формулы столбца col в строках [0, rows)
+    void EvaluateColumn(int col, int rows);
+
+private:
+    void EvaluateRun(const FormulaProgram& program, int col, int first_row, int last_row);
+
+    Sheet& sheet_;
+    std::vector<double> inputs_;
+    std::vector<const double*> input_columns_;
+    std::vector<double> results_;
+};
+
+// Вычисляет программу для count строк. inputs содержит по столбцу из count
+// значений для каждой операции OpCode::Cell в порядке их следования в программе.
+void EvaluateProgramBatch(const FormulaProgram& program, const std::vector<const double*>& inputs,
+    double* results, std::size_t count);
@@ -0,0 +1,187 @@
+#include "command_log.h"
+
+#include <charconv>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <streambuf>
+#include <thread>
+
+using namespace std::literals;
+
+namespace {
+    constexpr std::string_view NAMES[Command::TYPE_COUNT] = { "SET"sv, "CLEAR"sv, "GET"sv, "PRINT_VALUES"sv,
+        "PRINT_TEXTS"sv };
+
+    // Отделяет поле до табуляции; остаток строки остаётся в line
+    std::string_view TakeField(std::string_view& line) {
+        const std::size_t tab = line.find('\t');
+        std::string_view field = line.substr(0, tab);
+        line.remove_prefix(tab == std::string_view::npos ? line.size() : tab + 1);
+        return field;
+    }
+
+    Position ParsePosition(std::string_view field) {
+        const Position pos = Position::FromString(field);
+        if (!pos.IsValid()) {
+            throw std::invalid_argument("invalid cell " + std::string(field));
+        }
+        return pos;
+    }
+
+    // Вывод печати отбрасывается: замеряется таблица, а не поток
+    class NullBuffer : public std::streambuf {
+    protected:
+        int_type overflow(int_type ch) override {
+            return ch;
+        }
+        std::streamsize xsputn(const char*, std::streamsize count) override {
+            return count;
+        }
+    };
+}  // namespace
+
+std::string_view Command::GetName(Type type) {
+    return NAMES[static_cast<std::size_t>(type)];
+}
+
+std::optional<Command> ParseCommand(std::string_view line) {
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+    if (line.empty() || line.front() == '#') {
+        return std::nullopt;
+    }
+
+    Command command;
+    std::string_view name = TakeField(line);
+    if (name.empty()) {
+        throw std::invalid_argument("missing command name");
+    }
+    if (name.front() >= '0' && name.front() <= '9') {
+        std::int64_t micros = 0;
+        auto [end, error] = std::from_chars(name.data(), name.data() + name.size(), micros);
+        if (error != std::errc{} || end != name.data() + name.size()) {
+            throw std::invalid_argument("invalid time " + std::string(name));
+        }
+        command.time = std::chrono::microseconds(micros);
+        name = TakeField(line);
+    }
+
+    std::size_t type = 0;
+    while (type < Command::TYPE_COUNT && NAMES[type] != name) {
+        ++type;
+    }
+    if (type == Command::TYPE_COUNT) {
+        throw std::invalid_argument("unknown command " + std::string(name));
+    }
+    command.type = static_cast<Command::Type>(type);
+
+    switch (command.type) {
+    case Command::Type::Set:
+        command.pos = ParsePosition(TakeField(line));
+        command.text = std::string(line);
+        break;
+    case Command::Type::Clear:
+    case Command::Type::Get:
+        command.pos = ParsePosition(TakeField(line));
+        break;
+    case Command::Type::PrintValues:
+    case Command::Type::PrintTexts:
+        break;
+    }
+    return command;
+}
+
+void WriteCommand(std::ostream& output, const Command& command) {
+    if (command.time) {
+        output << command.time->count() << '\t';
+    }
+    output << Command::GetName(command.type);
+    if (command.pos.IsValid()) {
+        output << '\t' << command.pos.ToString();
+    }
+    if (command.type == Command::Type::Set) {
+        output << '\t' << command.text;
+    }
+    output << '\n';
+}
+
+void ExecuteCommand(SheetInterface& sheet, const Command& command, std::ostream& output) {
+    switch (command.type) {
+    case Command::Type::Set:
+        sheet.SetCell(command.pos, command.text);
+        break;
+    case Command::Type::Clear:
+        sheet.ClearCell(command.pos);
+        break;
+    case Command::Type::Get:
+        if (const CellInterface* cell = sheet.GetCell(command.pos)) {
+            cell->GetValueView();
+        }
+        break;
+    case Command::Type::PrintValues:
+        sheet.PrintValues(output);
+        break;
+    case Command::Type::PrintTexts:
+        sheet.PrintTexts(output);
+        break;
+    }
+}
+
+std::uint64_t ReplayReport::GetCommandCount() const {
+    std::uint64_t count = 0;
+    for (const auto& operation : operations) {
+        count += operation.latency.GetCount();
+    }
+    return count;
+}
+
+double ReplayReport::GetThroughput() const {
+    const double seconds = std::chrono::duration<double>(elapsed).count();
+    return seconds > 0 ? GetCommandCount() / seconds : 0.0;
+}
+
+ReplayReport ReplayCommands(SheetInterface& sheet, std::istream& input, const ReplayOptions& options) {
+    using Clock = std::chrono::steady_clock;
+
+    NullBuffer null_buffer;
+    std::ostream null_output(&null_buffer);
+    ReplayReport report;
+    std::string line;
+    std::size_t line_number = 0;
+    const Clock::time_point start = Clock::now();
+
+    while (std::getline(input, line)) {
+        ++line_number;
+        std::optional<Command> command;
+        try {
+            command = ParseCommand(line);
+        }
+        catch (const std::invalid_argument& error) {
+            throw std::invalid_argument("line " + std::to_string(line_number) + ": " + error.what());
+        }
+        if (!command) {
+            continue;
+        }
+
+        Clock::time_point issued = Clock::now();
+        if (options.original_timing && command->time) {
+            const Clock::time_point scheduled = start + *command->time;
+            std::this_thread::sleep_until(scheduled);
+            issued = scheduled;
+        }
+
+        auto& operation = report.operations[static_cast<std::size_t>(command->type)];
+        try {
+            ExecuteCommand(sheet, *command, null_output);
+        }
+        catch (const std::exception&) {
+            ++operation.errors;
+        }
+        operation.latency.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - issued).count());
+    }
+
+    report.elapsed = Clock::now() - start;
+    return report;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+#include "latency_histogram.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <optional>
+#include <string>
+#include <string_view>
+
+// Журнал команд таблицы, по команде в строке, поля разделены табуляцией:
+//   [<время>\t]SET\t<ячейка>\t<текст>
+//   [<время>\t]CLEAR\t<ячейка>
+//   [<время>\t]GET\t<ячейка>
+//   [<время>\t]PRINT_VALUES
+//   [<время>\t]PRINT_TEXTS
+// Время - микросекунды от начала записи; без него команды воспроизводятся
+// только с наибольшей скоростью. Текст занимает остаток строки и не содержит
+// переводов строк. Журналы WorkbookGenerator::WriteCommandLog() - частный
+// случай этого формата.
+struct Command {
+    enum class Type {
+        Set,
+        Clear,
+        Get,
+        PrintValues,
+        PrintTexts,
+    };
+    static constexpr std::size_t TYPE_COUNT = 5;
+
+    Type type = Type::Get;
+    Position pos = Position::NONE;
+    std::string text;
+    std::optional<std::chrono::microseconds> time;
+
+    // Имя команды в журнале: SET, CLEAR, ...
+    static std::string_view GetName(Type type);
+};
+
+// Разбирает строку журнала. Бросает std::invalid_argument, если строка не
+// является командой; пустые строки и строки с # в начале дают nullopt.
+std::optional<Command> ParseCommand(std::string_view line);
+// Записывает команду строкой журнала, включая перевод строки
+void WriteCommand(std::ostream& output, const Command& command);
+
+// Выполняет команду над таблицей. Значение GET вычисляется, но никуда не
+// выводится, печать идёт в output. Исключения таблицы пробрасываются.
+void ExecuteCommand(SheetInterface& sheet, const Command& command, std::ostream& output);
+
+// Итоги воспроизведения журнала, по типам команд
+struct ReplayReport {
+    struct Operation {
+        LatencyHistogram latency;
+        // команды, на которых таблица бросила исключение; их задержка тоже
+        // учитывается
+        std::uint64_t errors = 0;
+    };
+
+    std::array<Operation, Command::TYPE_COUNT> operations;
+    std::chrono::nanoseconds elapsed{ 0 };
+
+    const Operation& Get(Command::Type type) const {
+        return operations[static_cast<std::size_t>(type)];
+    }
+    std::uint64_t GetCommandCount() const;
+    // команд в секунду за всё воспроизведение
+    double GetThroughput() const;
+};
+
+struct ReplayOptions {
+    // Выдерживать ли время команд из журнала. Задержка команды тогда
+    // считается от её запланированного времени, а не от фактического
+    // начала: если таблица не успевает, ожидание в очереди входит в
+    // задержку, как у настоящих клиентов.
+    bool original_timing = false;
+};
+
+// Воспроизводит журнал из input над sheet. Бросает std::invalid_argument с
+// номером строки, если строка журнала некорректна.
+ReplayReport ReplayCommands(SheetInterface& sheet, std::istream& input, const ReplayOptions& options = {});
@@ -0,0 +1,274 @@
+#include "command_server.h"
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace {
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+    constexpr std::size_t READ_SIZE = 1 << 16;
+
+    [[noreturn]] void ThrowError(const std::string& what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    void WriteAll(int fd, std::string_view data) {
+        while (!data.empty()) {
+            const ssize_t written = ::write(fd, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ThrowError("write");
+            }
+            data.remove_prefix(static_cast<std::size_t>(written));
+        }
+    }
+
+    // SOCK_CLOEXEC и accept4() есть не везде (нет на macOS), поэтому флаг
+    // ставится отдельным вызовом
+    void SetCloseOnExec(int fd) {
+        const int flags = ::fcntl(fd, F_GETFD);
+        if (flags < 0 || ::fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
+            ThrowError("fcntl");
+        }
+    }
+#else
+    [[noreturn]] void ThrowUnsupported(const std::string& what) {
+        throw std::system_error(std::make_error_code(std::errc::function_not_supported), what);
+    }
+#endif
+
+    // Сообщение об ошибке в одну строку
+    void AppendError(std::string& responses, std::string_view message) {
+        responses += "ERR\t";
+        for (char c : message) {
+            responses += c == '\n' || c == '\t' ? ' ' : c;
+        }
+        responses += '\n';
+    }
+
+    void AppendError(std::string& responses, const std::exception_ptr& error) {
+        try {
+            std::rethrow_exception(error);
+        }
+        catch (const std::exception& e) {
+            AppendError(responses, e.what());
+        }
+    }
+}  // namespace
+
+void CommandServer::Feed(std::string_view input, std::string& responses) {
+    while (!input.empty()) {
+        const std::size_t end = input.find('\n');
+        if (end == std::string_view::npos) {
+            partial_line_.append(input);
+            break;
+        }
+        if (partial_line_.empty()) {
+            HandleLine(input.substr(0, end), responses);
+        }
+        else {
+            partial_line_.append(input.substr(0, end));
+            HandleLine(partial_line_, responses);
+            partial_line_.clear();
+        }
+        input.remove_prefix(end + 1);
+    }
+    // дальше данных пока нет: накопленные правки задаются сейчас, чтобы
+    // клиент получил ответы
+    CommitBatch(responses);
+}
+
+void CommandServer::Finish(std::string& responses) {
+    if (!partial_line_.empty()) {
+        std::string line = std::move(partial_line_);
+        partial_line_.clear();
+        HandleLine(line, responses);
+    }
+    CommitBatch(responses);
+}
+
+void CommandServer::HandleLine(std::string_view line, std::string& responses) {
+    std::optional<Command> command;
+    try {
+        command = ParseCommand(line);
+    }
+    catch (const std::invalid_argument& error) {
+        CommitBatch(responses);
+        AppendError(responses, error.what());
+        ++commands_;
+        return;
+    }
+    if (!command) {
+        return;
+    }
+    ++commands_;
+
+    if (command->type == Command::Type::Set) {
+        batch_.emplace_back(command->pos, std::move(command->text));
+        return;
+    }
+    CommitBatch(responses);
+
+    try {
+        switch (command->type) {
+        case Command::Type::Get: {
+            std::ostringstream value;
+            if (const CellInterface* cell = sheet_.GetCell(command->pos)) {
+                std::visit([&value](const auto& item) { value << item; }, cell->GetValueView());
+            }
+            responses += "VALUE\t";
+            responses += value.str();
+            responses += '\n';
+            break;
+        }
+        case Command::Type::PrintValues:
+        case Command::Type::PrintTexts: {
+            std::ostringstream table;
+            if (command->type == Command::Type::PrintValues) {
+                sheet_.PrintValues(table);
+            }
+            else {
+                sheet_.PrintTexts(table);
+            }
+            const std::string text = table.str();
+            responses += "TABLE\t" + std::to_string(std::count(text.begin(), text.end(), '\n')) + '\n';
+            responses += text;
+            break;
+        }
+        case Command::Type::Clear:
+            sheet_.ClearCell(command->pos);
+            responses += "OK\n";
+            break;
+        case Command::Type::Set:
+            break;
+        }
+    }
+    catch (const std::exception& error) {
+        AppendError(responses, error.what());
+    }
+}
+
+void CommandServer::CommitBatch(std::string& responses) {
+    if (batch_.empty()) {
+        return;
+    }
+    const std::vector<std::exception_ptr> failures = sheet_.TrySetCells(std::move(batch_));
+    batch_.clear();
+    ++batches_;
+    for (const auto& failure : failures) {
+        if (failure) {
+            AppendError(responses, failure);
+        }
+        else {
+            responses += "OK\n";
+        }
+    }
+}
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+void CommandServer::Serve(int input_fd, int output_fd) {
+    std::string buffer(READ_SIZE, '\0');
+    std::string responses;
+    for (;;) {
+        const ssize_t count = ::read(input_fd, buffer.data(), buffer.size());
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ThrowError("read");
+        }
+        if (count == 0) {
+            break;
+        }
+        Feed(std::string_view(buffer.data(), static_cast<std::size_t>(count)), responses);
+        WriteAll(output_fd, responses);
+        responses.clear();
+    }
+    Finish(responses);
+    WriteAll(output_fd, responses);
+}
+
+void CommandServer::ServeUnixSocket(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("socket path is too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    // клиент, закрывший соединение раньше ответа, не должен завершать процесс
+    std::signal(SIGPIPE, SIG_IGN);
+    const int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        ThrowError("socket");
+    }
+    try {
+        // сокет прошлого запуска заменяется, а обычный файл по ошибочному
+        // пути не удаляется
+        struct stat status;
+        if (::lstat(path.c_str(), &status) == 0) {
+            if (!S_ISSOCK(status.st_mode)) {
+                errno = EADDRINUSE;
+                ThrowError("bind " + path);
+            }
+            ::unlink(path.c_str());
+        }
+        SetCloseOnExec(listener);
+        if (::bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0
+            || ::listen(listener, 16) != 0) {
+            ThrowError("bind " + path);
+        }
+    }
+    catch (...) {
+        ::close(listener);
+        throw;
+    }
+
+    for (;;) {
+        const int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            const int error = errno;
+            ::close(listener);
+            errno = error;
+            ThrowError("accept");
+        }
+        try {
+            SetCloseOnExec(client);
+            Serve(client, client);
+        }
+        catch (const std::system_error&) {
+            // оборванное соединение не останавливает сервер
+            partial_line_.clear();
+            batch_.clear();
+        }
+        ::close(client);
+    }
+}
+#else
+void CommandServer::Serve(int, int) {
+    ThrowUnsupported("serve");
+}
+
+void CommandServer::ServeUnixSocket(const std::string& path) {
+    ThrowUnsupported("bind " + path);
+}
+#endif
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "command_log.h"
+#include "platform.h"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class Sheet;
+
+// Сервер команд над одной таблицей. Запросы - строки журнала команд (см.
+// command_log.h, время в начале строки игнорируется), на каждый запрос по
+// порядку приходит ответ:
+//   OK                     SET и CLEAR выполнены
+//   VALUE\t<значение>      GET: значение ячейки, пустое для пустой ячейки
+//   TABLE\t<n>             PRINT_VALUES и PRINT_TEXTS, за ним n строк таблицы
+//   ERR\t<сообщение>       запрос некорректен или таблица его отвергла
+// Клиент может отправлять запросы, не дожидаясь ответов. Сервер разбирает
+// всё, что уже пришло: подряд идущие SET собираются в пакет и задаются
+// одним Sheet::TrySetCells() с разбором формул в нескольких потоках, а
+// ответы отправляются одной записью, когда входящих данных больше нет.
+// Чтения после пакета берут значения из кэша ячеек.
+class CommandServer {
+public:
+    explicit CommandServer(Sheet& sheet)
+        : sheet_(sheet) {
+    }
+
+    // Обрабатывает очередную порцию входных данных и дописывает ответы в
+    // responses. Незаконченная строка ждёт следующей порции.
+    void Feed(std::string_view input, std::string& responses);
+    // Обрабатывает остаток входных данных в конце потока
+    void Finish(std::string& responses);
+
+    // Обслуживает поток: читает запросы из input_fd до конца и пишет
+    // ответы в output_fd. Бросает std::system_error при ошибке ввода-вывода.
+    void Serve(int input_fd, int output_fd);
+    // Слушает Unix-сокет path и обслуживает соединения по очереди, пока не
+    // произойдёт ошибка. Оставшийся от прошлого запуска сокет заменяется;
+    // если по пути лежит не сокет, бросается std::system_error с кодом
+    // EADDRINUSE. Отключает SIGPIPE для процесса.
+    // Без POSIX (см. platform.h) Serve() и ServeUnixSocket() бросают
+    // std::system_error с кодом std::errc::function_not_supported.
+    void ServeUnixSocket(const std::string& path);
+
+    // Выполненные запросы и пакеты SET
+    std::uint64_t GetCommandCount() const {
+        return commands_;
+    }
+    std::uint64_t GetBatchCount() const {
+        return batches_;
+    }
+
+private:
+    void HandleLine(std::string_view line, std::string& responses);
+    void CommitBatch(std::string& responses);
+
+    Sheet& sheet_;
+    std::string partial_line_;
+    std::vector<std::pair<Position, std::string>> batch_;
+    std::uint64_t commands_ = 0;
+    std::uint64_t batches_ = 0;
+};
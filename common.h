@@ -1,7 +1,9 @@
 #pragma once
 
+#include <algorithm>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -29,7 +31,87 @@ struct Position {
 
 struct PositionHasher {
     std::size_t operator()(const Position& key) const {
-        return key.col;
+        return static_cast<std::size_t>(key.row) * Position::MAX_COLS + key.col;
+    }
+};
+
+// Непрерывный массив позиций, на который ссылаются без копирования и без
+// владения памятью (аналог std::span<const Position>).
+class PositionSpan {
+public:
+    PositionSpan() = default;
+    PositionSpan(const Position* begin, const Position* end)
+        : begin_(begin)
+        , end_(end) {
+    }
+    PositionSpan(const std::vector<Position>& positions)
+        : begin_(positions.data())
+        , end_(positions.data() + positions.size()) {
+    }
+
+    const Position* begin() const {
+        return begin_;
+    }
+    const Position* end() const {
+        return end_;
+    }
+    std::size_t size() const {
+        return end_ - begin_;
+    }
+    bool empty() const {
+        return begin_ == end_;
+    }
+
+private:
+    const Position* begin_ = nullptr;
+    const Position* end_ = nullptr;
+};
+
+// Вставка или удаление строк либо столбцов таблицы: индексы от first и
+// дальше сдвигаются на count. При удалении (count < 0) индексы
+// [first, first - count) пропадают.
+struct PositionShift {
+    enum class Axis {
+        Rows,
+        Cols,
+    };
+
+    Axis axis = Axis::Rows;
+    int first = 0;
+    int count = 0;
+
+    // Новая позиция ячейки либо Position::NONE, если ячейка удалена или ушла
+    // за край таблицы
+    Position Apply(Position pos) const {
+        int& index = axis == Axis::Rows ? pos.row : pos.col;
+        if (index < first) {
+            return pos;
+        }
+        if (count < 0 && index < first - count) {
+            return Position::NONE;
+        }
+        index += count;
+        return index < GetLimit() ? pos : Position::NONE;
+    }
+
+    // Переносит отрезок [lo, hi] индексов по оси сдвига. Удалённые индексы
+    // отрезаются с краёв, вставленные внутрь отрезка расширяют его. Возвращает
+    // false, если отрезок удалён целиком.
+    bool Apply(int& lo, int& hi) const {
+        if (count > 0) {
+            lo += lo >= first ? count : 0;
+            hi += hi >= first ? count : 0;
+            hi = std::min(hi, GetLimit() - 1);
+            return lo <= hi;
+        }
+        const int end = first - count;
+        lo = lo < first ? lo : (lo < end ? first : lo + count);
+        hi = hi < first ? hi : (hi < end ? first - 1 : hi + count);
+        return lo <= hi;
+    }
+
+    int GetLimit() const {
+        return axis == Axis::Rows ? Position::MAX_ROWS : Position::MAX_COLS;
     }
 };
 
@@ -47,6 +129,7 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Div0,  // в результате вычисления возникло деление на ноль
+        NA,    // функция поиска не нашла ключ
         Unknown,
     };
 
@@ -89,6 +172,9 @@ public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
     // формулы
     using Value = std::variant<std::string, double, FormulaError>;
+    // То же значение, но текст не копируется и указывает во внутреннее
+    // хранилище таблицы
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
 
     virtual ~CellInterface() = default;
 
@@ -96,6 +182,9 @@ public:
     // В случае текстовой ячейки это её текст (без экранирующих символов). В
     // случае формулы - числовое значение формулы или сообщение об ошибке.
     virtual Value GetValue() const = 0;
+    // То же, что GetValue(), но без копирования текста. Представление
+    // действительно, пока содержимое ячейки не изменено.
+    virtual ValueView GetValueView() const = 0;
     // Возвращает внутренний текст ячейки, как если бы мы начали её
     // редактирование. В случае текстовой ячейки это её текст (возможно,
     // содержащий экранирующие символы). В случае формулы - её выражение.
@@ -105,6 +194,11 @@ public:
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // То же, что GetReferencedCells(), но без выделения памяти: возвращает
+    // представление списка, который хранится в самой ячейке. Оно действительно,
+    // пока содержимое ячейки не изменено.
+    virtual PositionSpan GetReferencedCellsView() const = 0;
 };
 
 inline constexpr char FORMULA_SIGN = '=';
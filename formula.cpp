@@ -1,44 +1,139 @@
 #include "formula.h"
 
 #include "FormulaAST.h"
+#include "formula_jit.h"
 
-#include <forward_list>
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cstdlib>
 #include <sstream>
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 namespace {
+    // Пустой текст трактуется как ноль, текст, который целиком не является
+    // числом, - как ошибка #VALUE!
+    double TextToNumber(std::string_view text) {
+        if (text.empty()) {
+            return 0.0;
+        }
+        if (std::isspace(static_cast<unsigned char>(text.front()))) {
+            return FormulaValue::MakeError(FormulaError::Category::Value);
+        }
+        // strtod требует завершающего нуля: короткие тексты копируются на
+        // стек, длинные - в кучу
+        constexpr std::size_t BUFFER_SIZE = 64;
+        char buffer[BUFFER_SIZE];
+        std::string long_text;
+        const char* begin = buffer;
+        if (text.size() < BUFFER_SIZE) {
+            text.copy(buffer, text.size());
+            buffer[text.size()] = '\0';
+        }
+        else {
+            long_text = std::string(text);
+            begin = long_text.c_str();
+        }
+
+        char* end = nullptr;
+        double result = std::strtod(begin, &end);
+        if (end != begin + text.size()) {
+            return FormulaValue::MakeError(FormulaError::Category::Value);
+        }
+        return result;
+    }
+
+    // Поиск для таблиц без FormulaSheetAccess: просмотр ячеек по порядку
+    std::optional<int> MatchRowByCells(const SheetInterface& sheet, double key, int col, int first_row, int last_row) {
+        for (int row = first_row; row <= last_row; ++row) {
+            const CellInterface* cell = sheet.GetCell({ row, col });
+            if (cell && !cell->GetText().empty() && GetFormulaOperand(sheet, nullptr, { row, col }) == key) {
+                return row;
+            }
+        }
+        return std::nullopt;
+    }
+
+    std::vector<FormulaProgram::Range> GetLookupColumns(const FormulaProgram& program) {
+        std::vector<FormulaProgram::Range> columns;
+        auto add_column = [&columns](const FormulaProgram::Range& range, int col) {
+            FormulaProgram::Range column{ { range.first.row, col }, { range.last.row, col } };
+            if (std::find(columns.begin(), columns.end(), column) == columns.end()) {
+                columns.push_back(column);
+            }
+        };
+
+        for (const auto& op : program.ops) {
+            if (!op.IsLookup() || !program.ranges[op.lookup.range].first.IsValid()) {
+                continue;
+            }
+            const FormulaProgram::Range& range = program.ranges[op.lookup.range];
+            add_column(range, range.first.col);
+            if (op.code == FormulaProgram::OpCode::VLookup) {
+                add_column(range, range.first.col + static_cast<int>(op.lookup.column));
+            }
+        }
+        return columns;
+    }
+
+    // Ячейки вне ветвей IF: ветви занимают узлы между JumpIfFalse и If
+    std::vector<Position> GetUnconditionalCells(const FormulaProgram& program) {
+        std::vector<Position> cells;
+        if (!program.has_branches) {
+            return cells;
+        }
+        std::vector<std::size_t> branch_ends;
+        for (std::size_t i = 0; i < program.ops.size(); ++i) {
+            const auto& op = program.ops[i];
+            while (!branch_ends.empty() && branch_ends.back() <= i) {
+                branch_ends.pop_back();
+            }
+            if (op.code == FormulaProgram::OpCode::JumpIfFalse) {
+                branch_ends.push_back(program.ops[op.lhs].lhs);
+            }
+            else if (op.code == FormulaProgram::OpCode::Cell && branch_ends.empty()) {
+                cells.push_back(op.cell);
+            }
+        }
+        std::sort(cells.begin(), cells.end());
+        cells.erase(std::unique(cells.begin(), cells.end()), cells.end());
+        return cells;
+    }
+
     class Formula : public FormulaInterface {
     public:
         explicit Formula(std::string expression)
-            : ast_( ParseFormulaAST(std::move(expression) ) )
+            : Formula(ParseFormulaAST(std::move(expression)))
         {}
 
-        Value Evaluate(const SheetInterface& sheet) const override {   
-            try {
-                auto getValue = [&sheet](Position pos) {
-                    CellInterface::Value value = sheet.GetCell(pos)->GetValue();
-                    if (std::holds_alternative<double>(value)) {
-                        return std::get<double>(value);
-                    }
-                    else if (std::holds_alternative<FormulaError>(value)) {
-                        throw std::get<FormulaError>(value);
-                    }
-                    return std::stod(sheet.GetCell(pos)->GetText());  
-                };
-
-                return ast_.Execute(getValue);
+        explicit Formula(FormulaAST ast)
+            : ast_(std::move(ast))
+            , referenced_cells_(ast_.GetCells())
+            , referenced_ranges_(GetLookupColumns(ast_.GetProgram()))
+            , unconditional_cells_(GetUnconditionalCells(ast_.GetProgram()))
+        {
+            // observed_cells_ не растёт при вычислениях: каждый узел
+            // выполняется не больше раза, а VLOOKUP читает одну ячейку
+            if (ast_.GetProgram().has_branches) {
+                observed_cells_.reserve(std::count_if(ast_.GetProgram().ops.begin(), ast_.GetProgram().ops.end(),
+                    [](const FormulaProgram::Op& op) {
+                        return op.code == FormulaProgram::OpCode::Cell || op.code == FormulaProgram::OpCode::VLookup;
+                    }));
             }
-            catch (FormulaError error) {
-                return error;
+        }
+
+        Value Evaluate(const SheetInterface& sheet) const override {   
+            const auto* access = dynamic_cast<const FormulaSheetAccess*>(&sheet);
+            double result = IsHot() ? ExecuteCompiled(sheet, access) : ExecuteTree(sheet, access);
+            if (FormulaValue::IsError(result)) {
+                return FormulaError(FormulaValue::GetErrorCategory(result));
             }
+            return result;
         }
 
 
@@ -48,16 +143,158 @@ namespace {
             return result.str();
         }
 
-        std::vector<Position> GetReferencedCells() const {
-            std::forward_list<Position> cells = ast_.GetCells();
-            return { cells.begin(), cells.end() };
+        std::vector<Position> GetReferencedCells() const override {
+            return referenced_cells_;
+        }
+
+        PositionSpan GetReferencedCellsView() const override {
+            return referenced_cells_;
+        }
+
+        PositionSpan GetObservedCellsView() const override {
+            if (ast_.GetProgram().has_branches) {
+                return observed_cells_;
+            }
+            return referenced_cells_;
+        }
+
+        PositionSpan GetUnconditionalCellsView() const override {
+            if (ast_.GetProgram().has_branches) {
+                return unconditional_cells_;
+            }
+            return referenced_cells_;
+        }
+
+        const std::vector<FormulaProgram::Range>& GetReferencedRanges() const override {
+            return referenced_ranges_;
+        }
+
+        const FormulaProgram& GetProgram() const override {
+            return ast_.GetProgram();
+        }
+
+        std::unique_ptr<FormulaInterface> Copy(int row_shift, int col_shift) const override {
+            FormulaProgram program = ast_.GetProgram();
+            program.Offset(row_shift, col_shift);
+            return std::make_unique<Formula>(FormulaAST(std::move(program)));
+        }
+
+        std::size_t GetMemoryUsage() const override {
+            const FormulaProgram& program = ast_.GetProgram();
+            return sizeof(*this)
+                + program.ops.capacity() * sizeof(FormulaProgram::Op)
+                + program.ranges.capacity() * sizeof(FormulaProgram::Range)
+                + (referenced_cells_.capacity() + unconditional_cells_.capacity() + observed_cells_.capacity())
+                    * sizeof(Position)
+                + referenced_ranges_.capacity() * sizeof(FormulaProgram::Range)
+                + (jit_ ? jit_->GetMemoryUsage() : 0) + jit_inputs_.capacity() * sizeof(double);
+        }
+
+        bool ShiftReferences(const PositionShift& shift) override {
+            bool changed = ast_.ShiftReferences(shift);
+            referenced_cells_ = ast_.GetCells();
+            referenced_ranges_ = GetLookupColumns(ast_.GetProgram());
+            unconditional_cells_ = GetUnconditionalCells(ast_.GetProgram());
+
+            // сдвиг по одной оси сохраняет порядок уцелевших позиций
+            std::size_t kept = 0;
+            for (Position pos : observed_cells_) {
+                pos = shift.Apply(pos);
+                if (pos.IsValid()) {
+                    observed_cells_[kept++] = pos;
+                }
+            }
+            observed_cells_.resize(kept);
+
+            // скомпилированный код читает ячейки по порядку, а ссылка могла
+            // стать числом
+            if (changed) {
+                evaluations_ = 0;
+                jit_.reset();
+            }
+            return changed;
         }
 
     private:
+        double ExecuteTree(const SheetInterface& sheet, const FormulaSheetAccess* access) const {
+            auto matchRow = [&sheet, access](double key, int col, int first_row, int last_row) {
+                return access ? access->MatchRow(key, col, first_row, last_row)
+                              : MatchRowByCells(sheet, key, col, first_row, last_row);
+            };
+
+            if (!ast_.GetProgram().has_branches) {
+                auto getValue = [&sheet, access](Position pos) {
+                    return GetFormulaOperand(sheet, access, pos);
+                };
+                return ast_.Execute(getValue, matchRow);
+            }
+
+            // у формулы с IF запоминаются ячейки выбранных ветвей
+            observed_cells_.clear();
+            auto observeValue = [this, &sheet, access](Position pos) {
+                observed_cells_.push_back(pos);
+                return GetFormulaOperand(sheet, access, pos);
+            };
+            double result = ast_.Execute(observeValue, matchRow);
+            std::sort(observed_cells_.begin(), observed_cells_.end());
+            observed_cells_.erase(std::unique(observed_cells_.begin(), observed_cells_.end()), observed_cells_.end());
+            return result;
+        }
+
+        // Часто вычисляемая формула компилируется в машинный код. Если это
+        // невозможно, она навсегда остаётся на обходе дерева.
+        bool IsHot() const {
+            if (evaluations_ < JitFormula::HOT_THRESHOLD) {
+                ++evaluations_;
+                if (evaluations_ == JitFormula::HOT_THRESHOLD) {
+                    jit_ = JitFormula::Compile(ast_.GetProgram());
+                }
+            }
+            return jit_ != nullptr;
+        }
+
+        // Операнды читаются тем же путём, что и при обходе дерева: выигрыш
+        // JIT только в вычислении, а не в чтении ячеек
+        double ExecuteCompiled(const SheetInterface& sheet, const FormulaSheetAccess* access) const {
+            jit_inputs_.clear();
+            for (const auto& op : ast_.GetProgram().ops) {
+                if (op.code == FormulaProgram::OpCode::Cell) {
+                    jit_inputs_.push_back(GetFormulaOperand(sheet, access, op.cell));
+                }
+            }
+            return (*jit_)(jit_inputs_.data());
+        }
+
         FormulaAST ast_;
+        std::vector<Position> referenced_cells_;
+        std::vector<FormulaProgram::Range> referenced_ranges_;
+        std::vector<Position> unconditional_cells_;
+        mutable std::vector<Position> observed_cells_;
+
+        mutable int evaluations_ = 0;
+        mutable std::unique_ptr<JitFormula> jit_;
+        mutable std::vector<double> jit_inputs_;
     };
 }  // namespace
 
+double GetFormulaOperand(const SheetInterface& sheet, const FormulaSheetAccess* access, Position pos) {
+    if (const double* number = access ? access->FindNumber(pos) : nullptr) {
+        return *number;
+    }
+    const CellInterface* cell = sheet.GetCell(pos);
+    if (!cell) {
+        return 0.0;
+    }
+    CellInterface::ValueView value = cell->GetValueView();
+    if (std::holds_alternative<double>(value)) {
+        return std::get<double>(value);
+    }
+    else if (std::holds_alternative<FormulaError>(value)) {
+        return FormulaValue::MakeError(std::get<FormulaError>(value).GetCategory());
+    }
+    return TextToNumber(std::get<std::string_view>(value));
+}
+
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -1,14 +1,18 @@
 #pragma once
 
 #include "common.h"
+#include "formula_program.h"
 
 #include <memory>
+#include <optional>
 #include <vector>
 
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Точный поиск по столбцу: MATCH(A1,B1:B100), VLOOKUP(A1,B1:D100,3)
+// * Сравнения и условие: IF(A1>0,B1,C1/A1), невыбранная ветвь не вычисляется
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,8 +38,65 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // То же, что GetReferencedCells(), но без копирования списка.
+    virtual PositionSpan GetReferencedCellsView() const = 0;
+
+    // Возвращает ячейки, прочитанные при последнем вычислении формулы, по
+    // возрастанию и без повторов. У формулы без IF совпадает с
+    // GetReferencedCellsView().
+    virtual PositionSpan GetObservedCellsView() const = 0;
+
+    // Возвращает ячейки, которые формула читает при любом исходе условий IF,
+    // по возрастанию и без повторов.
+    virtual PositionSpan GetUnconditionalCellsView() const = 0;
+
+    // Возвращает столбцы, которые функции поиска просматривают целиком: столбец
+    // ключей и столбец результата VLOOKUP. Каждый диапазон занимает один
+    // столбец. Ячейки диапазонов не входят в GetReferencedCells().
+    virtual const std::vector<FormulaProgram::Range>& GetReferencedRanges() const = 0;
+
+    // Возвращает формулу в виде постфиксной программы для пакетного вычисления.
+    virtual const FormulaProgram& GetProgram() const = 0;
+
+    // Переносит ссылки формулы при вставке или удалении строк либо столбцов
+    // таблицы, не разбирая формулу заново. Ссылки на удалённые ячейки
+    // становятся ошибкой #REF!. Возвращает true, если значение формулы могло
+    // измениться.
+    virtual bool ShiftReferences(const PositionShift& shift) = 0;
+
+    // Возвращает копию формулы со ссылками, сдвинутыми на row_shift строк и
+    // col_shift столбцов, как при протягивании. Формула не разбирается заново.
+    virtual std::unique_ptr<FormulaInterface> Copy(int row_shift, int col_shift) const = 0;
+
+    // Память, которую занимает формула вместе с программой, списками ссылок и
+    // машинным кодом. Растёт при вычислении, на котором формула компилируется.
+    virtual std::size_t GetMemoryUsage() const = 0;
 };
 
+// Быстрые пути таблицы для вычисления формул. В SheetInterface они не входят:
+// их реализует Sheet, а у других таблиц формулы читают ячейки через GetCell().
+class FormulaSheetAccess {
+public:
+    // Возвращает указатель на значение ячейки, хранимой как число, или nullptr.
+    // Позволяет формулам читать числа, не обращаясь к объекту ячейки.
+    virtual const double* FindNumber(Position pos) const = 0;
+
+    // Возвращает первую строку из [first_row, last_row] столбца col, значение
+    // ячейки в которой как операнд формулы равно key. Используется функциями
+    // поиска; пустые ячейки и текст, не являющийся числом, не совпадают ни с
+    // каким ключом.
+    virtual std::optional<int> MatchRow(double key, int col, int first_row, int last_row) const = 0;
+
+protected:
+    ~FormulaSheetAccess() = default;
+};
+
+// Возвращает значение ячейки как операнд формулы: пустая ячейка - ноль, текст -
+// число либо ошибка #VALUE!, ошибка ячейки - значение с ошибкой (FormulaValue).
+// access - быстрые пути той же таблицы или nullptr.
+double GetFormulaOperand(const SheetInterface& sheet, const FormulaSheetAccess* access, Position pos);
+
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
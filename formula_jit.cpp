@@ -0,0 +1,347 @@
+#include "formula_jit.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef SPREADSHEET_JIT_AVAILABLE
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#endif
+
+namespace {
+#ifdef SPREADSHEET_JIT_AVAILABLE
+    using OpCode = FormulaProgram::OpCode;
+
+    // Стек программы отображается на регистры xmm0..xmm13, глубина d - это
+    // регистр xmm<d>; xmm15 используется как временный.
+    constexpr std::size_t MAX_DEPTH = 14;
+    constexpr int SCRATCH = 15;
+
+    class Assembler {
+    public:
+        std::vector<std::uint8_t>& Code() {
+            return code_;
+        }
+
+        // movsd xmm<dst>, [rdi + offset]
+        void LoadInput(int dst, std::int32_t offset) {
+            Emit(0xF2);
+            Rex(false, dst, 0);
+            Emit(0x0F, 0x10);
+            Emit(0x80 | ((dst & 7) << 3) | 7);
+            Emit32(static_cast<std::uint32_t>(offset));
+        }
+
+        // mov rax, imm64; movq xmm<dst>, rax
+        void LoadConstant(int dst, double value) {
+            std::uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(bits));
+            Emit(0x48, 0xB8);
+            Emit32(static_cast<std::uint32_t>(bits));
+            Emit32(static_cast<std::uint32_t>(bits >> 32));
+            Emit(0x66);
+            Rex(true, dst, 0);
+            Emit(0x0F, 0x6E);
+            Emit(0xC0 | ((dst & 7) << 3));
+        }
+
+        // addsd/subsd/mulsd/divsd xmm<dst>, xmm<src>
+        void Arithmetic(std::uint8_t opcode, int dst, int src) {
+            Emit(0xF2);
+            Rex(false, dst, src);
+            Emit(0x0F, opcode);
+            Emit(0xC0 | ((dst & 7) << 3) | (src & 7));
+        }
+
+        // ucomisd xmm<lhs>, xmm<rhs>
+        void Compare(int lhs, int rhs) {
+            Packed(0x2E, lhs, rhs);
+        }
+
+        // movapd xmm<dst>, xmm<src>
+        void Move(int dst, int src) {
+            Packed(0x28, dst, src);
+        }
+
+        // xorpd xmm<dst>, xmm<src>
+        void Xor(int dst, int src) {
+            Packed(0x57, dst, src);
+        }
+
+        // условный переход по флагу (0x8A - jp, 0x85 - jne) или безусловный;
+        // возвращает место для последующей записи смещения
+        std::size_t Jump(std::uint8_t condition) {
+            if (condition) {
+                Emit(0x0F, condition);
+            }
+            else {
+                Emit(0xE9);
+            }
+            Emit32(0);
+            return code_.size();
+        }
+
+        void Bind(std::size_t jump) {
+            std::uint32_t offset = static_cast<std::uint32_t>(code_.size() - jump);
+            std::memcpy(code_.data() + jump - 4, &offset, sizeof(offset));
+        }
+
+        void Return() {
+            Emit(0xC3);
+        }
+
+    private:
+        void Packed(std::uint8_t opcode, int dst, int src) {
+            Emit(0x66);
+            Rex(false, dst, src);
+            Emit(0x0F, opcode);
+            Emit(0xC0 | ((dst & 7) << 3) | (src & 7));
+        }
+
+        void Rex(bool wide, int reg, int rm) {
+            std::uint8_t rex = 0x40 | (wide ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0) | (rm >= 8 ? 0x01 : 0);
+            if (rex != 0x40) {
+                Emit(rex);
+            }
+        }
+
+        void Emit(std::uint8_t byte) {
+            code_.push_back(byte);
+        }
+
+        void Emit(std::uint8_t first, std::uint8_t second) {
+            code_.push_back(first);
+            code_.push_back(second);
+        }
+
+        void Emit32(std::uint32_t value) {
+            for (int i = 0; i < 4; ++i) {
+                code_.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+            }
+        }
+
+        std::vector<std::uint8_t> code_;
+    };
+
+    constexpr std::uint8_t JP = 0x8A;
+    constexpr std::uint8_t JNE = 0x85;
+    constexpr std::uint8_t JMP = 0;
+
+    // Повторяет FormulaProgram::Apply: ошибка (NaN) левого операнда важнее
+    // ошибки правого, а та важнее деления на ноль.
+    void EmitBinary(Assembler& assembler, OpCode code, int lhs, int rhs) {
+        assembler.Compare(lhs, lhs);
+        std::size_t lhs_is_nan = assembler.Jump(JP);
+        assembler.Compare(rhs, rhs);
+        std::size_t rhs_is_nan = assembler.Jump(JP);
+
+        std::size_t div0_done = 0;
+        if (code == OpCode::Divide) {
+            assembler.Xor(SCRATCH, SCRATCH);
+            assembler.Compare(rhs, SCRATCH);
+            std::size_t not_zero = assembler.Jump(JNE);
+            assembler.LoadConstant(lhs, FormulaValue::MakeError(FormulaError::Category::Div0));
+            div0_done = assembler.Jump(JMP);
+            assembler.Bind(not_zero);
+        }
+
+        switch (code) {
+        case OpCode::Add: assembler.Arithmetic(0x58, lhs, rhs); break;
+        case OpCode::Subtract: assembler.Arithmetic(0x5C, lhs, rhs); break;
+        case OpCode::Multiply: assembler.Arithmetic(0x59, lhs, rhs); break;
+        default: assembler.Arithmetic(0x5E, lhs, rhs); break;
+        }
+        std::size_t done = assembler.Jump(JMP);
+
+        assembler.Bind(rhs_is_nan);
+        assembler.Move(lhs, rhs);
+
+        assembler.Bind(lhs_is_nan);
+        assembler.Bind(done);
+        if (div0_done) {
+            assembler.Bind(div0_done);
+        }
+    }
+
+    bool Generate(const FormulaProgram& program, Assembler& assembler) {
+        if (program.max_depth > MAX_DEPTH) {
+            return false;
+        }
+
+        int depth = 0;
+        std::int32_t input = 0;
+        for (const auto& op : program.ops) {
+            switch (op.code) {
+            case OpCode::Number:
+                assembler.LoadConstant(depth++, op.number);
+                break;
+            case OpCode::Cell:
+                assembler.LoadInput(depth++, input++ * static_cast<std::int32_t>(sizeof(double)));
+                break;
+            case OpCode::UnaryPlus:
+                break;
+            case OpCode::UnaryMinus:
+                assembler.LoadConstant(SCRATCH, -0.0);
+                assembler.Xor(depth - 1, SCRATCH);
+                break;
+            case OpCode::Add:
+            case OpCode::Subtract:
+            case OpCode::Multiply:
+            case OpCode::Divide:
+                EmitBinary(assembler, op.code, depth - 2, depth - 1);
+                --depth;
+                break;
+            default:
+                return false;
+            }
+        }
+        assembler.Return();
+        return depth == 1;
+    }
+#endif
+}  // namespace
+
+#ifdef SPREADSHEET_JIT_AVAILABLE
+namespace {
+    // Общая память под машинный код формул. Каждая область отображается
+    // дважды: для записи и для исполнения, поэтому код, уже выданный
+    // формулам, остаётся исполняемым, пока рядом дописывается новый.
+    // Область освобождается вместе с последней формулой в ней, кроме
+    // текущей, в которую идёт запись.
+    class CodeArena {
+    public:
+        struct Chunk {
+            std::uint8_t* writable = nullptr;
+            std::uint8_t* executable = nullptr;
+            std::size_t size = 0;
+            std::size_t used = 0;
+            // формулы, код которых лежит в области
+            std::size_t live = 0;
+        };
+
+        static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+        static constexpr std::size_t ALIGNMENT = 16;
+
+        // Формулы могут пережить статические объекты, поэтому область не
+        // уничтожается
+        static CodeArena& Instance() {
+            static CodeArena* arena = new CodeArena;
+            return *arena;
+        }
+
+        // Копирует код в область; nullptr, если память не выделяется
+        const void* Allocate(const std::vector<std::uint8_t>& code, Chunk*& chunk) {
+            std::lock_guard guard(mutex_);
+            const std::size_t size = (code.size() + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+            if (!current_ || current_->used + size > current_->size) {
+                Chunk* next = Map(std::max(CHUNK_SIZE, size));
+                if (!next) {
+                    return nullptr;
+                }
+                if (current_ && current_->live == 0) {
+                    Unmap(current_);
+                }
+                current_ = next;
+            }
+            chunk = current_;
+            std::memcpy(chunk->writable + chunk->used, code.data(), code.size());
+            const void* function = chunk->executable + chunk->used;
+            chunk->used += size;
+            ++chunk->live;
+            return function;
+        }
+
+        void Release(Chunk* chunk) {
+            std::lock_guard guard(mutex_);
+            if (--chunk->live == 0 && chunk != current_) {
+                Unmap(chunk);
+            }
+        }
+
+    private:
+        static Chunk* Map(std::size_t size) {
+            const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+            size = (size + page - 1) / page * page;
+#ifdef __linux__
+            const int fd = memfd_create("spreadsheet-jit", MFD_CLOEXEC);
+#else
+            char path[] = "/tmp/spreadsheet-jit-XXXXXX";
+            const int fd = mkstemp(path);
+            if (fd >= 0) {
+                unlink(path);
+            }
+#endif
+            if (fd < 0) {
+                return nullptr;
+            }
+            auto chunk = std::make_unique<Chunk>();
+            chunk->size = size;
+            void* writable = MAP_FAILED;
+            void* executable = MAP_FAILED;
+            if (ftruncate(fd, static_cast<off_t>(size)) == 0) {
+                writable = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                executable = mmap(nullptr, size, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+            }
+            close(fd);
+            if (writable == MAP_FAILED || executable == MAP_FAILED) {
+                if (writable != MAP_FAILED) {
+                    munmap(writable, size);
+                }
+                if (executable != MAP_FAILED) {
+                    munmap(executable, size);
+                }
+                return nullptr;
+            }
+            chunk->writable = static_cast<std::uint8_t*>(writable);
+            chunk->executable = static_cast<std::uint8_t*>(executable);
+            return chunk.release();
+        }
+
+        static void Unmap(Chunk* chunk) {
+            munmap(chunk->writable, chunk->size);
+            munmap(chunk->executable, chunk->size);
+            delete chunk;
+        }
+
+        std::mutex mutex_;
+        Chunk* current_ = nullptr;
+    };
+}  // namespace
+#endif
+
+std::unique_ptr<JitFormula> JitFormula::Compile(const FormulaProgram& program) {
+#ifdef SPREADSHEET_JIT_AVAILABLE
+    Assembler assembler;
+    if (!Generate(program, assembler)) {
+        return nullptr;
+    }
+
+    const std::vector<std::uint8_t>& code = assembler.Code();
+    CodeArena::Chunk* chunk = nullptr;
+    const void* function = CodeArena::Instance().Allocate(code, chunk);
+    if (!function) {
+        return nullptr;
+    }
+    return std::unique_ptr<JitFormula>(new JitFormula(function, code.size(), chunk));
+#else
+    return nullptr;
+#endif
+}
+
+JitFormula::JitFormula(const void* code, std::size_t size, void* chunk)
+    : size_(size)
+    , chunk_(chunk)
+    , function_(reinterpret_cast<Function>(const_cast<void*>(code))) {
+}
+
+JitFormula::~JitFormula() {
+#ifdef SPREADSHEET_JIT_AVAILABLE
+    CodeArena::Instance().Release(static_cast<CodeArena::Chunk*>(chunk_));
+#endif
+}
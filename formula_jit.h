@@ -0,0 +1,52 @@
+#pragma once
+
+#include "formula_program.h"
+
+#include <cstddef>
+#include <memory>
+
+#if defined(SPREADSHEET_ENABLE_JIT) && (defined(__x86_64__) || defined(_M_X64)) \
+    && (defined(__unix__) || defined(__APPLE__))
+#define SPREADSHEET_JIT_AVAILABLE
+#endif
+
+// Формула, скомпилированная в машинный код x86-64 (SSE2). Компилируется
+// только арифметика: значения ячеек формула собирает заранее обычным чтением
+// через таблицу (см. GetFormulaOperand()) в массив в порядке операций
+// OpCode::Cell, и код читает операнды из этого массива. Ветвления остаются
+// только для проверок на ошибки. Семантика совпадает с обходом дерева,
+// включая выбор ошибки и деление на ноль.
+// Код всех формул плотно укладывается в общие области по 64 КиБ, а не
+// занимает по странице на формулу.
+class JitFormula {
+public:
+    using Function = double (*)(const double* inputs);
+
+    // Формула компилируется после стольких вычислений обходом дерева
+    static constexpr int HOT_THRESHOLD = 64;
+
+    // Возвращает nullptr, если JIT недоступен на этой платформе или программа
+    // слишком глубокая для регистров XMM.
+    static std::unique_ptr<JitFormula> Compile(const FormulaProgram& program);
+
+    JitFormula(const JitFormula&) = delete;
+    JitFormula& operator=(const JitFormula&) = delete;
+    ~JitFormula();
+
+    double operator()(const double* inputs) const {
+        return function_(inputs);
+    }
+
+    // Память объекта вместе с его кодом в общей области
+    std::size_t GetMemoryUsage() const {
+        return sizeof(*this) + size_;
+    }
+
+private:
+    JitFormula(const void* code, std::size_t size, void* chunk);
+
+    std::size_t size_;
+    // область, в которой лежит код
+    void* chunk_;
+    Function function_;
+};
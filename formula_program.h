@@ -0,0 +1,211 @@
+#pragma once
+
+#include "common.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Ошибки вычисления передаются по дереву как обычные значения: FormulaError
+// кодируется "тихим" NaN с меткой и категорией в мантиссе. Арифметика сама
+// переносит такие значения, поэтому вычисление не бросает исключений.
+namespace FormulaValue {
+    inline constexpr std::uint64_t ERROR_MASK = 0x7FFFFFFFFFFFFF00ull;
+    inline constexpr std::uint64_t ERROR_TAG = 0x7FFCE44E44E44E00ull;
+
+    inline double MakeError(FormulaError::Category category) {
+        std::uint64_t bits = ERROR_TAG | static_cast<std::uint64_t>(category);
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    // знак не учитывается: унарный минус меняет его и у NaN
+    inline bool IsError(double value) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return (bits & ERROR_MASK) == ERROR_TAG;
+    }
+
+    inline FormulaError::Category GetErrorCategory(double value) {
+        std::uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return static_cast<FormulaError::Category>(bits & 0xFF);
+    }
+}  // namespace FormulaValue
+
+// Плоское представление формулы: все узлы дерева лежат в одном векторе в
+// постфиксном порядке, операнды перед операцией. Правый (или единственный)
+// операнд операции - соседний узел перед ней, индекс левого хранится в узле.
+// Ссылки на ячейки лежат прямо в узлах. Тот же вектор служит программой для
+// стековой машины: операнды кладутся на стек, операции снимают их оттуда.
+struct FormulaProgram {
+    enum class OpCode : std::uint8_t {
+        Number,
+        Cell,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Less,  // сравнения дают 1 или 0
+        LessEqual,
+        Greater,
+        GreaterEqual,
+        Equal,
+        NotEqual,
+        UnaryPlus,
+        UnaryMinus,
+        Match,    // MATCH(ключ, диапазон): номер строки с ключом в диапазоне
+        VLookup,  // VLOOKUP(ключ, диапазон, столбец): значение из строки с ключом
+        // IF(условие, то, иначе) занимает в программе
+        //   условие JumpIfFalse то Jump иначе If
+        // JumpIfFalse снимает условие со стека и при нуле переходит на узел
+        // после Jump (lhs - индекс Jump), Jump переходит на If (lhs - индекс
+        // If). Так вычисляется только выбранная ветвь. Сам If ничего не делает,
+        // его lhs - индекс корня условия.
+        JumpIfFalse,
+        Jump,
+        If,
+    };
+
+    // Прямоугольный диапазон ячеек: first - левый верхний угол, last - правый нижний
+    struct Range {
+        Position first;
+        Position last;
+
+        bool operator==(const Range& rhs) const {
+            return first == rhs.first && last == rhs.last;
+        }
+    };
+
+    // Аргументы функции поиска: индекс диапазона в ranges и смещение столбца
+    // результата от первого столбца диапазона
+    struct Lookup {
+        std::uint32_t range;
+        std::uint32_t column;
+    };
+
+    struct Op {
+        OpCode code;
+        std::uint32_t lhs;  // индекс левого операнда бинарной операции
+        union {
+            double number;  // для OpCode::Number
+            Position cell;  // для OpCode::Cell
+            Lookup lookup;  // для OpCode::Match и OpCode::VLookup
+        };
+
+        Op()
+            : code(OpCode::Number)
+            , lhs(0)
+            , number(0) {
+        }
+
+        static Op MakeNumber(double value) {
+            Op op;
+            op.number = value;
+            return op;
+        }
+
+        static Op MakeCell(Position position) {
+            Op op;
+            op.code = OpCode::Cell;
+            op.cell = position;
+            return op;
+        }
+
+        static Op MakeOperation(OpCode code, std::uint32_t lhs = 0) {
+            Op op;
+            op.code = code;
+            op.lhs = lhs;
+            return op;
+        }
+
+        // ключ функции поиска - соседний узел перед ней, как у унарной операции
+        static Op MakeLookup(OpCode code, std::uint32_t range, std::uint32_t column = 0) {
+            Op op;
+            op.code = code;
+            op.lookup = { range, column };
+            return op;
+        }
+
+        bool IsBinary() const {
+            return code >= OpCode::Add && code <= OpCode::NotEqual;
+        }
+
+        bool IsComparison() const {
+            return code >= OpCode::Less && code <= OpCode::NotEqual;
+        }
+
+        bool IsUnary() const {
+            return code == OpCode::UnaryPlus || code == OpCode::UnaryMinus;
+        }
+
+        bool IsLookup() const {
+            return code == OpCode::Match || code == OpCode::VLookup;
+        }
+    };
+
+    std::vector<Op> ops;
+    std::vector<Range> ranges;  // диапазоны функций поиска
+    std::size_t max_depth = 0;  // наибольшая глубина стека при вычислении
+    bool has_branches = false;  // есть ли IF, то есть переходы
+
+    // Только числа, ячейки и арифметика: такую программу можно вычислять
+    // пакетно и компилировать
+    bool IsArithmetic() const {
+        for (const auto& op : ops) {
+            if (op.IsComparison() || op.IsLookup() || op.code >= OpCode::JumpIfFalse) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Проверяет, получается ли программа из base сдвигом всех ссылок на
+    // row_shift строк, как при протягивании формулы вниз по столбцу.
+    bool IsRowShiftOf(const FormulaProgram& base, int row_shift) const;
+
+    // Переносит ссылки вслед за ячейками при вставке или удалении строк либо
+    // столбцов. Ссылка на удалённую ячейку становится числом-ошибкой #REF!,
+    // диапазон поиска, удалённый целиком, отмечается как Position::NONE.
+    // Возвращает true, если от этого могло измениться значение формулы.
+    bool ShiftReferences(const PositionShift& shift);
+
+    // Сдвигает все ссылки на row_shift строк и col_shift столбцов, как при
+    // копировании формулы в другую ячейку. Ссылки, ушедшие за край таблицы,
+    // становятся #REF!, как в ShiftReferences().
+    void Offset(int row_shift, int col_shift);
+
+    // Вычисляет бинарную операцию. Ошибка (NaN) левого операнда важнее ошибки
+    // правого, а та важнее деления на ноль. Все способы вычисления формул
+    // должны следовать этим правилам, чтобы давать побитово равные результаты.
+    static double Apply(OpCode code, double lhs, double rhs) {
+        if (std::isnan(lhs)) {
+            return lhs;
+        }
+        if (std::isnan(rhs)) {
+            return rhs;
+        }
+
+        switch (code) {
+        case OpCode::Add: return lhs + rhs;
+        case OpCode::Subtract: return lhs - rhs;
+        case OpCode::Multiply: return lhs * rhs;
+        case OpCode::Divide:
+            if (rhs == 0) {
+                return FormulaValue::MakeError(FormulaError::Category::Div0);
+            }
+            return lhs / rhs;
+        case OpCode::Less: return lhs < rhs;
+        case OpCode::LessEqual: return lhs <= rhs;
+        case OpCode::Greater: return lhs > rhs;
+        case OpCode::GreaterEqual: return lhs >= rhs;
+        case OpCode::Equal: return lhs == rhs;
+        case OpCode::NotEqual: return lhs != rhs;
+        default:
+            return FormulaValue::MakeError(FormulaError::Category::Unknown);
+        }
+    }
+};
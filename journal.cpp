@@ -0,0 +1,122 @@
+#include "journal.h"
+
+#include <cassert>
+#include <stdexcept>
+
+void Journal::SetBudget(std::size_t bytes) {
+    budget_ = bytes;
+    if (budget_ == 0) {
+        Clear();
+        return;
+    }
+    Evict();
+}
+
+void Journal::Begin() {
+    ++depth_;
+}
+
+void Journal::End() {
+    assert(depth_ > 0);
+    if (--depth_ > 0 || current_.empty()) {
+        return;
+    }
+    recorded_.clear();
+    PushUndo(std::move(current_));
+    current_.clear();
+}
+
+void Journal::Record(Position pos, CellState state) {
+    if (!IsEnabled()) {
+        return;
+    }
+    if (depth_ > 0 && !recorded_.insert(pos).second) {
+        return;
+    }
+
+    for (const auto& entry : redo_) {
+        memory_ -= entry.bytes;
+    }
+    redo_.clear();
+
+    current_.push_back({ pos, std::move(state) });
+    if (depth_ == 0) {
+        PushUndo(std::move(current_));
+        current_.clear();
+    }
+}
+
+std::optional<Journal::Entry> Journal::TakeUndo() {
+    if (depth_ > 0) {
+        throw std::logic_error("undo inside an open edit");
+    }
+    if (undo_.empty()) {
+        return std::nullopt;
+    }
+    StoredEntry entry = std::move(undo_.back());
+    undo_.pop_back();
+    memory_ -= entry.bytes;
+    return std::move(entry.changes);
+}
+
+std::optional<Journal::Entry> Journal::TakeRedo() {
+    if (depth_ > 0) {
+        throw std::logic_error("redo inside an open edit");
+    }
+    if (redo_.empty()) {
+        return std::nullopt;
+    }
+    StoredEntry entry = std::move(redo_.back());
+    redo_.pop_back();
+    memory_ -= entry.bytes;
+    return std::move(entry.changes);
+}
+
+void Journal::PushUndo(Entry entry) {
+    undo_.push_back(Store(std::move(entry)));
+    Evict();
+}
+
+void Journal::PushRedo(Entry entry) {
+    redo_.push_back(Store(std::move(entry)));
+    Evict();
+}
+
+void Journal::Clear() {
+    undo_.clear();
+    redo_.clear();
+    current_.clear();
+    recorded_.clear();
+    memory_ = 0;
+}
+
+// Оценка сверху: текст ячейки считается целиком, хотя пул может делить его с
+// другими ячейками
+std::size_t Journal::GetMemoryUsage(const Entry& entry) {
+    std::size_t bytes = entry.capacity() * sizeof(Change);
+    for (const auto& change : entry) {
+        if (change.state.content) {
+            bytes += change.state.content->GetMemoryUsage();
+        }
+    }
+    return bytes;
+}
+
+Journal::StoredEntry Journal::Store(Entry entry) {
+    StoredEntry stored{ std::move(entry), 0 };
+    stored.bytes = GetMemoryUsage(stored.changes);
+    memory_ += stored.bytes;
+    return stored;
+}
+
+// Сначала вытесняется самая старая история отмены, затем самые дальние повторы
+void Journal::Evict() {
+    while (memory_ > budget_ && !undo_.empty()) {
+        memory_ -= undo_.front().bytes;
+        undo_.pop_front();
+    }
+    while (memory_ > budget_ && !redo_.empty()) {
+        memory_ -= redo_.front().bytes;
+        redo_.erase(redo_.begin());
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+// Состояние ячейки для журнала: разобранное содержимое (текст в пуле строк
+// или готовая формула), число либо пустая ячейка, если нет ни того, ни другого
+struct CellState {
+    std::optional<Cell::Content> content;
+    std::optional<double> number;
+};
+
+// Журнал правок для отмены и повтора. Запись хранит прежние состояния только
+// изменённых ячеек, а зависимости таблица выводит из самих состояний, поэтому
+// отмена не разбирает формулы заново. Память журнала ограничена бюджетом:
+// при превышении вытесняются самые старые записи. Пока бюджет не задан,
+// журнал ничего не записывает.
+class Journal {
+public:
+    struct Change {
+        Position pos;
+        CellState state;
+    };
+    using Entry = std::vector<Change>;
+
+    // Нулевой бюджет отключает журнал. Изначально журнал отключён.
+    void SetBudget(std::size_t bytes);
+    bool IsEnabled() const {
+        return budget_ > 0;
+    }
+    std::size_t GetMemoryUsage() const {
+        return memory_;
+    }
+
+    // Изменения между Begin() и End() образуют одну запись. Вызовы могут быть
+    // вложенными.
+    void Begin();
+    void End();
+
+    // Запоминает прежнее состояние ячейки. Внутри записи сохраняется только
+    // первое состояние каждой ячейки. Новая правка делает повтор невозможным.
+    void Record(Position pos, CellState state);
+
+    // Последняя запись для отмены; после применения её нужно вернуть через
+    // PushRedo() с состояниями, которые заменила отмена. Для повтора - так же.
+    // Внутри незавершённой записи бросают std::logic_error.
+    std::optional<Entry> TakeUndo();
+    std::optional<Entry> TakeRedo();
+    void PushUndo(Entry entry);
+    void PushRedo(Entry entry);
+
+    // Забывает всю историю, например когда сдвиг строк делает позиции записей
+    // недействительными
+    void Clear();
+
+    // Изменения, пока объект жив, образуют одну запись
+    class Batch {
+    public:
+        explicit Batch(Journal& journal)
+            : journal_(journal) {
+            journal_.Begin();
+        }
+        ~Batch() {
+            journal_.End();
+        }
+
+        Batch(const Batch&) = delete;
+        Batch& operator=(const Batch&) = delete;
+
+    private:
+        Journal& journal_;
+    };
+
+private:
+    struct StoredEntry {
+        Entry changes;
+        std::size_t bytes = 0;
+    };
+
+    static std::size_t GetMemoryUsage(const Entry& entry);
+    StoredEntry Store(Entry entry);
+    void Evict();
+
+    std::deque<StoredEntry> undo_;  // самые старые записи в начале
+    std::vector<StoredEntry> redo_;  // следующая для повтора - в конце
+    Entry current_;
+    std::unordered_set<Position, PositionHasher> recorded_;  // ячейки current_
+    int depth_ = 0;
+    std::size_t budget_ = 0;
+    std::size_t memory_ = 0;
+};
@@ -0,0 +1,60 @@
+#include "latency_histogram.h"
+
+#include "bit_ops.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Корзины [0, SUB_BUCKETS) точные. Дальше значение с старшим битом e
+// попадает в группу e - SUB_BUCKET_BITS + 1, номер внутри группы - следующие
+// за старшим SUB_BUCKET_BITS бит.
+std::size_t LatencyHistogram::GetBucket(std::uint64_t ns) {
+    if (ns < SUB_BUCKETS) {
+        return static_cast<std::size_t>(ns);
+    }
+    const int exponent = HighestSetBit(ns);
+    const int shift = exponent - SUB_BUCKET_BITS;
+    const std::size_t group = static_cast<std::size_t>(shift + 1);
+    const std::size_t sub_bucket = static_cast<std::size_t>((ns >> shift) - SUB_BUCKETS);
+    return group * SUB_BUCKETS + sub_bucket;
+}
+
+std::uint64_t LatencyHistogram::GetUpperBound(std::size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    const int shift = static_cast<int>(bucket / SUB_BUCKETS) - 1;
+    const std::uint64_t sub_bucket = bucket % SUB_BUCKETS + SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Record(std::uint64_t ns) {
+    ++buckets_[GetBucket(ns)];
+    ++count_;
+    total_ += ns;
+    max_ = std::max(max_, ns);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram& other) {
+    for (std::size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+        buckets_[bucket] += other.buckets_[bucket];
+    }
+    count_ += other.count_;
+    total_ += other.total_;
+    max_ = std::max(max_, other.max_);
+}
+
+std::uint64_t LatencyHistogram::GetPercentile(double quantile) const {
+    if (count_ == 0) {
+        return 0;
+    }
+    const auto rank = static_cast<std::uint64_t>(std::ceil(std::clamp(quantile, 0.0, 1.0) * count_));
+    std::uint64_t seen = 0;
+    for (std::size_t bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+        seen += buckets_[bucket];
+        if (seen >= std::max<std::uint64_t>(rank, 1)) {
+            return std::min(GetUpperBound(bucket), max_);
+        }
+    }
+    return max_;
+}
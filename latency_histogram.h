@@ -0,0 +1,43 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+// Гистограмма задержек в наносекундах с логарифмическими корзинами: каждая
+// степень двойки делится на SUB_BUCKETS равных частей, так что перцентиль
+// известен с точностью около 1/SUB_BUCKETS при постоянной памяти. Значения
+// меньше SUB_BUCKETS хранятся точно.
+class LatencyHistogram {
+public:
+    void Record(std::uint64_t ns);
+    // Добавляет все значения other
+    void Merge(const LatencyHistogram& other);
+
+    std::uint64_t GetCount() const {
+        return count_;
+    }
+    std::uint64_t GetTotal() const {
+        return total_;
+    }
+    std::uint64_t GetMax() const {
+        return max_;
+    }
+
+    // Верхняя граница корзины, в которую попадает доля quantile значений,
+    // но не больше наибольшего значения; 0 для пустой гистограммы
+    std::uint64_t GetPercentile(double quantile) const;
+
+private:
+    static constexpr int SUB_BUCKET_BITS = 4;
+    static constexpr std::uint64_t SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static constexpr std::size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    static std::size_t GetBucket(std::uint64_t ns);
+    static std::uint64_t GetUpperBound(std::size_t bucket);
+
+    std::array<std::uint64_t, BUCKET_COUNT> buckets_{};
+    std::uint64_t count_ = 0;
+    std::uint64_t total_ = 0;
+    std::uint64_t max_ = 0;
+};
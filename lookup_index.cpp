@@ -0,0 +1,111 @@
+#include "lookup_index.h"
+
+#include "formula.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cmath>
+
+LookupIndex::LookupIndex(const Sheet& sheet)
+    : sheet_(sheet) {
+}
+
+std::optional<int> LookupIndex::Find(double key, int col, int first_row, int last_row) {
+    Column& column = GetColumn(col);
+
+    std::optional<int> found;
+    int limit = last_row;
+    if (auto it = column.rows.find(key); it != column.rows.end()) {
+        auto row = std::lower_bound(it->second.begin(), it->second.end(), first_row);
+        if (row != it->second.end() && *row <= last_row) {
+            found = *row;
+            limit = *row - 1;
+        }
+    }
+
+    // формула выше найденной строки может вычисляться в тот же ключ
+    for (auto row = column.formula_rows.lower_bound(first_row);
+        row != column.formula_rows.end() && *row <= limit; ++row) {
+        if (GetFormulaOperand(sheet_, &sheet_, { *row, col }) == key) {
+            return *row;
+        }
+    }
+    return found;
+}
+
+void LookupIndex::Erase(Position pos) {
+    auto column = columns_.find(pos.col);
+    if (column == columns_.end()) {
+        return;
+    }
+
+    if (column->second.formula_rows.erase(pos.row) > 0) {
+        return;
+    }
+    std::optional<double> key = GetKey(pos);
+    if (!key) {
+        return;
+    }
+
+    auto it = column->second.rows.find(*key);
+    if (it == column->second.rows.end()) {
+        return;
+    }
+    auto& rows = it->second;
+    rows.erase(std::lower_bound(rows.begin(), rows.end(), pos.row));
+    if (rows.empty()) {
+        column->second.rows.erase(it);
+    }
+}
+
+void LookupIndex::Insert(Position pos) {
+    auto column = columns_.find(pos.col);
+    if (column != columns_.end()) {
+        Insert(column->second, pos);
+    }
+}
+
+LookupIndex::Column& LookupIndex::GetColumn(int col) {
+    auto [it, inserted] = columns_.try_emplace(col);
+    if (inserted) {
+        // ниже области печати ячеек нет, а появившиеся позже попадут в
+        // индекс через Insert()
+        const int rows = sheet_.GetPrintSize().rows;
+        for (int row = 0; row < rows; ++row) {
+            Insert(it->second, { row, col });
+        }
+    }
+    return it->second;
+}
+
+void LookupIndex::Insert(Column& column, Position pos) {
+    if (IsFormula(pos)) {
+        column.formula_rows.insert(pos.row);
+        return;
+    }
+    if (std::optional<double> key = GetKey(pos)) {
+        auto& rows = column.rows[*key];
+        rows.insert(std::lower_bound(rows.begin(), rows.end(), pos.row), pos.row);
+    }
+}
+
+std::optional<double> LookupIndex::GetKey(Position pos) const {
+    if (const double* number = sheet_.FindNumber(pos)) {
+        return *number;
+    }
+
+    const Cell* cell = sheet_.GetConcreteCell(pos);
+    if (!cell || cell->GetFormula() || std::get<std::string_view>(cell->GetValueView()).empty()) {
+        return std::nullopt;
+    }
+    double key = GetFormulaOperand(sheet_, &sheet_, pos);
+    if (std::isnan(key)) {
+        return std::nullopt;
+    }
+    return key;
+}
+
+bool LookupIndex::IsFormula(Position pos) const {
+    const Cell* cell = sheet_.GetConcreteCell(pos);
+    return cell && cell->GetFormula();
+}
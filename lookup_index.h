@@ -0,0 +1,52 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+class Sheet;
+
+// Хеш-индекс столбцов для функций поиска. Индекс столбца строится при первом
+// поиске в нём, а затем таблица обновляет его при каждом изменении ячеек
+// столбца, так что поиск не просматривает столбец заново и все формулы,
+// ищущие в одном столбце, пользуются одним индексом.
+// Ключ ячейки - её значение как операнда формулы. Значения формул меняются
+// без записи в ячейку, поэтому строки с формулами хранятся отдельно и
+// вычисляются при поиске.
+class LookupIndex {
+public:
+    explicit LookupIndex(const Sheet& sheet);
+
+    // Первая строка из [first_row, last_row] столбца col со значением key
+    std::optional<int> Find(double key, int col, int first_row, int last_row);
+
+    // Таблица вызывает Erase() до изменения ячейки и Insert() после него
+    void Erase(Position pos);
+    void Insert(Position pos);
+
+    // Забывает все столбцы, например после сдвига строк или столбцов таблицы.
+    // Столбцы строятся заново при следующем поиске в них.
+    void Clear() {
+        columns_.clear();
+    }
+
+private:
+    struct Column {
+        std::unordered_map<double, std::vector<int>> rows;  // строки по возрастанию
+        std::set<int> formula_rows;
+    };
+
+    Column& GetColumn(int col);
+    void Insert(Column& column, Position pos);
+    // Ключ ячейки без формулы; пустая ячейка и текст, не являющийся числом,
+    // ключа не имеют
+    std::optional<double> GetKey(Position pos) const;
+    bool IsFormula(Position pos) const;
+
+    const Sheet& sheet_;
+    // ссылки на элементы unordered_map не теряют силу при добавлении столбцов
+    std::unordered_map<int, Column> columns_;
+};
@@ -1,11 +1,28 @@
 #include "common.h"
 #include "test_runner_p.h"
 #include "formula.h"
+#include "formula_jit.h"
+#include "FormulaAST.h"
+#include "command_log.h"
+#include "command_server.h"
 #include "sheet.h"
+#include "workbook_generator.h"
+#include "write_ahead_log.h"
 
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <string_view>
 #include <string>
 #include <iostream>
+#include <sstream>
+#include <thread>
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+#include <unistd.h>
+#endif
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
@@ -24,6 +41,11 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+// Для формул без функций поиска
+std::optional<int> NoLookups(double, int, int, int) {
+    return std::nullopt;
+}
+
 void TestValue() {
     {
         auto sheet = CreateSheet();
@@ -145,12 +167,1795 @@ void TestSheetSize() {
     }
 }
 
-int main() {
+void TestFormulaExpression() {
+    ASSERT_EQUAL(ParseFormula("1+2*3")->GetExpression(), "1+2*3");
+    ASSERT_EQUAL(ParseFormula("(1+2)*3")->GetExpression(), "(1+2)*3");
+    ASSERT_EQUAL(ParseFormula("((A1))")->GetExpression(), "A1");
+    ASSERT_EQUAL(ParseFormula("A1-(B1-C1)")->GetExpression(), "A1-(B1-C1)");
+    ASSERT_EQUAL(ParseFormula("(A1-B1)-C1")->GetExpression(), "A1-B1-C1");
+    ASSERT_EQUAL(ParseFormula("A1/(B1*C1)")->GetExpression(), "A1/(B1*C1)");
+    ASSERT_EQUAL(ParseFormula("-(A1+B1)*+(C1/D1)")->GetExpression(), "-(A1+B1)*+C1/D1");
+    ASSERT_EQUAL(ParseFormula(" 2.5 * ( 2 + 3.5 / 7 ) ")->GetExpression(), "2.5*(2+3.5/7)");
+
+    std::ostringstream tree;
+    ParseFormulaAST("-A1+2*B2").Print(tree);
+    ASSERT_EQUAL(tree.str(), "(+ (- A1) (* 2 B2))");
+
+    // приоритеты и лексемы Formula.g4
+    ASSERT_EQUAL(ParseFormula("1<2+3")->GetExpression(), "1<2+3");
+    ASSERT_EQUAL(ParseFormula("(1<2)<3")->GetExpression(), "1<2<3");
+    ASSERT_EQUAL(ParseFormula("1<(2<3)")->GetExpression(), "1<(2<3)");
+    ASSERT_EQUAL(ParseFormula("1<=2<>3>=4")->GetExpression(), "1<=2<>3>=4");
+    ASSERT_EQUAL(ParseFormula("2*-3- -1")->GetExpression(), "2*-3--1");
+    ASSERT_EQUAL(ParseFormula("\tMATCH ( 2 , B5:B1 )\n")->GetExpression(), "MATCH(2,B1:B5)");
+    ASSERT_EQUAL(ParseFormula("VLOOKUP(A1,A1:C3,3.0)")->GetExpression(), "VLOOKUP(A1,A1:C3,3)");
+    ASSERT_EQUAL(ParseFormula("IF1+IF(1,2,3)")->GetReferencedCells(), std::vector<Position>{ "IF1"_pos });
+    std::ostringstream unary;
+    ParseFormulaAST("-A1*2").Print(unary);
+    ASSERT_EQUAL(unary.str(), "(* (- A1) 2)");
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1e3+.5+2E-2+1.25e+1");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 1e3 + .5 + 2E-2 + 1.25e+1);
+    for (const char* text : { "= ", "=1+", "=(1", "=1)", "=1 2", "=a1", "=1.", "=1e", "=.", "=A1B1", "=A0",
+             "=ZZZZ1", "=1;2", "=IF(1,2)", "=IFX(1,2,3)", "=MATCH(1,A1)", "=MATCH(1,A1:B2)",
+             "=VLOOKUP(1,A1:B2,3)", "=VLOOKUP(1,A1:B2,A1)" }) {
+        try {
+            sheet->SetCell("B1"_pos, text);
+            Assert(false, std::string("accepted ") + text);
+        } catch (const FormulaException&) {}
+        ASSERT(sheet->GetCell("B1"_pos) == nullptr);
+    }
+}
+
+void TestReferencedCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("D4"_pos, "=B2+A1+B2*A10-C1/A1");
+    const CellInterface* cell = sheet->GetCell("D4"_pos);
+
+    const std::vector<Position> expected = { "A1"_pos, "C1"_pos, "B2"_pos, "A10"_pos };
+    ASSERT_EQUAL(cell->GetReferencedCells(), expected);
+
+    PositionSpan view = cell->GetReferencedCellsView();
+    ASSERT_EQUAL(std::vector<Position>(view.begin(), view.end()), expected);
+    ASSERT(cell->GetReferencedCellsView().begin() == view.begin());
+
+    sheet->SetCell("E4"_pos, "text");
+    ASSERT(sheet->GetCell("E4"_pos)->GetReferencedCellsView().empty());
+}
+
+void TestSetCellReuse() {
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1+C1");
+        sheet.SetCell("B1"_pos, "1");
+        sheet.SetCell("C1"_pos, "2");
+        const CellInterface* cell = sheet.GetCell("A1"_pos);
+        ASSERT_EQUAL(std::get<double>(cell->GetValue()), 3.0);
+
+        sheet.SetCell("A1"_pos, "=B1+C1");
+        ASSERT(sheet.GetConcreteCell("A1"_pos)->HasCachedValue());
+
+        sheet.SetCell("A1"_pos, "=C1+D1");
+        ASSERT(sheet.GetCell("A1"_pos) == cell);
+        ASSERT_EQUAL(std::get<double>(cell->GetValue()), 2.0);
+
+        sheet.SetCell("B1"_pos, "10");
+        ASSERT(sheet.GetConcreteCell("A1"_pos)->HasCachedValue());
+        sheet.SetCell("D1"_pos, "10");
+        ASSERT(!sheet.GetConcreteCell("A1"_pos)->HasCachedValue());
+        ASSERT_EQUAL(std::get<double>(cell->GetValue()), 12.0);
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=1+2");
+        sheet.SetCell("B1"_pos, "=A1*2");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 6.0);
+
+        sheet.SetCell("A1"_pos, "=2+1");
+        ASSERT(sheet.GetConcreteCell("B1"_pos)->HasCachedValue());
+        sheet.SetCell("A1"_pos, "=4");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("B1"_pos)->GetValue()), 8.0);
+    }
+    {
+        // новая формула над невычисленной цепочкой не считается при правке
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 1; row < 2000; ++row) {
+            sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+1");
+        }
+        sheet.SetCell("B1"_pos, "=2000");
+        sheet.SetCell("C1"_pos, "=B1");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2000.0);
+
+        sheet.SetCell("B1"_pos, "=A2000");
+        ASSERT(!sheet.GetConcreteCell("A2000"_pos)->HasCachedValue());
+        ASSERT(!sheet.GetConcreteCell("C1"_pos)->HasCachedValue());
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 2000.0);
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1");
+        try {
+            sheet.SetCell("B1"_pos, "=A1");
+            ASSERT(false);
+        } catch (CircularDependencyException&) {}
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=B1");
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    }
+}
+
+void TestDeepChain() {
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "1");
+        for (int row = 1; row < Position::MAX_ROWS; ++row) {
+            sheet->SetCell(Position{ row, 0 }, "=" + Position{ row - 1, 0 }.ToString() + "+1");
+        }
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{ Position::MAX_ROWS - 1, 0 })->GetValue()),
+            static_cast<double>(Position::MAX_ROWS));
+
+        sheet->SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell(Position{ Position::MAX_ROWS - 1, 0 })->GetValue()),
+            static_cast<double>(Position::MAX_ROWS + 9));
+    }
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B1+1");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 1.0);
+        sheet->SetCell("B1"_pos, "2");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 3.0);
+        sheet->ClearCell("B1"_pos);
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A1"_pos)->GetValue()), 1.0);
+    }
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=B1");
+        sheet->SetCell("A1"_pos, "5");
+        sheet->SetCell("B1"_pos, "=A1");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("B1"_pos)->GetValue()), 5.0);
+    }
+}
+
+void TestErrorPropagation() {
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "=1/0");
+        sheet->SetCell("A2"_pos, "=A1+1");
+        sheet->SetCell("A3"_pos, "=-A2*2");
+        ASSERT_EQUAL(std::get<FormulaError>(sheet->GetCell("A3"_pos)->GetValue()),
+            FormulaError(FormulaError::Category::Div0));
+
+        sheet->SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("A3"_pos)->GetValue()), -10.0);
+    }
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "meow");
+        sheet->SetCell("B1"_pos, "");
+        sheet->SetCell("C1"_pos, "=B1+A1");
+        sheet->SetCell("D1"_pos, "=B1+1");
+        ASSERT_EQUAL(std::get<FormulaError>(sheet->GetCell("C1"_pos)->GetValue()),
+            FormulaError(FormulaError::Category::Value));
+        ASSERT_EQUAL(std::get<double>(sheet->GetCell("D1"_pos)->GetValue()), 1.0);
+
+        std::ostringstream values;
+        sheet->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "meow\t\t#VALUE!\t1\n");
+    }
+}
+
+void FillColumns(SheetInterface& sheet, int rows) {
+    for (int row = 0; row < rows; ++row) {
+        const std::string index = std::to_string(row + 1);
+        if (row % 7 == 3) {
+            sheet.SetCell(Position{ row, 0 }, "text");
+        }
+        else if (row % 11 != 5) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row * 0.37 - 5));
+        }
+        sheet.SetCell(Position{ row, 1 }, row % 5 == 0 ? "0" : std::to_string(1.0 / (row + 1)));
+        sheet.SetCell(Position{ row, 2 }, "=A" + index + "*B" + index + "+1");
+        sheet.SetCell(Position{ row, 3 }, "=-(A" + index + "-3.5)/B" + index);
+        sheet.SetCell(Position{ row, 4 }, "=D" + index + "/C" + index + "+A1");
+    }
+}
+
+void TestColumnBatchedEvaluation() {
+    const int rows = 1003;
+    Sheet per_cell;
+    Sheet batched;
+    FillColumns(per_cell, rows);
+    FillColumns(batched, rows);
+
+    batched.EvaluateBatched();
+
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 2; col < 5; ++col) {
+            const Position pos{ row, col };
+            ASSERT(batched.GetConcreteCell(pos)->HasCachedValue());
+            auto expected = per_cell.GetCell(pos)->GetValue();
+            auto actual = batched.GetCell(pos)->GetValue();
+            ASSERT_EQUAL(expected.index(), actual.index());
+            if (std::holds_alternative<double>(expected)) {
+                double lhs = std::get<double>(expected);
+                double rhs = std::get<double>(actual);
+                ASSERT(std::memcmp(&lhs, &rhs, sizeof(double)) == 0);
+            }
+            else {
+                ASSERT_EQUAL(std::get<FormulaError>(expected), std::get<FormulaError>(actual));
+            }
+        }
+    }
+}
+
+// Значения ячеек для формул из JIT-тестов: A1, B1, C1, ... по порядку
+std::vector<double> CollectJitInputs(const FormulaProgram& program, const std::vector<double>& values) {
+    std::vector<double> inputs;
+    for (const auto& op : program.ops) {
+        if (op.code == FormulaProgram::OpCode::Cell) {
+            inputs.push_back(values.at(op.cell.col));
+        }
+    }
+    return inputs;
+}
+
+void TestJitFormula() {
+    const double div0 = FormulaValue::MakeError(FormulaError::Category::Div0);
+    const double value = FormulaValue::MakeError(FormulaError::Category::Value);
+    const std::vector<std::vector<double>> value_sets = {
+        { 1, 2, 3, 4 },
+        { -1.5, 0, 2.25, 1e300 },
+        { 0, -0.0, 7, 3 },
+        { value, 1, div0, 0 },
+        { 2, div0, value, 5 },
+    };
+    const std::vector<std::string> expressions = {
+        "A1", "-A1", "+B1", "A1+B1*C1-D1", "A1/B1", "(A1-B1)/(C1-D1)", "-(A1+2.5)/B1*3",
+        "A1/0", "D1/B1+A1*A1", "((A1+B1)*(C1+D1))/((A1-B1)*(C1-D1)+1)", "1e308*10-1e308*10", "42",
+        "A1-(B1-(C1-(D1-(A1-(B1-(C1-(D1-(A1-(B1/(C1/-D1))))))))))",
+    };
+
+    for (const auto& expression : expressions) {
+        FormulaAST ast = ParseFormulaAST(expression);
+        auto jit = JitFormula::Compile(ast.GetProgram());
+#ifdef SPREADSHEET_JIT_AVAILABLE
+        ASSERT(jit != nullptr);
+#else
+        ASSERT(jit == nullptr);
+#endif
+        for (const auto& values : value_sets) {
+            double expected = ast.Execute([&values](Position pos) { return values.at(pos.col); }, NoLookups);
+
+            // обход дерева сверяется с вычислением формулы в таблице, где
+            // значения без ошибок лежат в ячейках
+            if (std::none_of(values.begin(), values.end(), FormulaValue::IsError)) {
+                Sheet sheet;
+                for (std::size_t col = 0; col < values.size(); ++col) {
+                    sheet.SetCell(Position{ 0, static_cast<int>(col) }, NumberColumns::Format(values[col]));
+                }
+                const FormulaInterface::Value value = ParseFormula(expression)->Evaluate(sheet);
+                if (FormulaValue::IsError(expected)) {
+                    ASSERT(std::get<FormulaError>(value).GetCategory() == FormulaValue::GetErrorCategory(expected));
+                }
+                else {
+                    const double number = std::get<double>(value);
+                    ASSERT(std::memcmp(&expected, &number, sizeof(double)) == 0);
+                }
+            }
+
+            if (jit) {
+                std::vector<double> inputs = CollectJitInputs(ast.GetProgram(), values);
+                double actual = (*jit)(inputs.data());
+                ASSERT(std::memcmp(&expected, &actual, sizeof(double)) == 0);
+            }
+        }
+    }
+
+    {
+        auto sheet = CreateSheet();
+        sheet->SetCell("A1"_pos, "6");
+        sheet->SetCell("B1"_pos, "3");
+        auto formula = ParseFormula("A1/B1+1");
+        for (int i = 0; i < 2 * JitFormula::HOT_THRESHOLD; ++i) {
+            ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 3.0);
+        }
+        sheet->SetCell("B1"_pos, "0");
+        ASSERT_EQUAL(std::get<FormulaError>(formula->Evaluate(*sheet)), FormulaError(FormulaError::Category::Div0));
+    }
+}
+
+void TestIncrementalRecalc() {
+    auto build = [](Sheet& sheet) {
+        sheet.SetCell("A1"_pos, "1");
+        for (int row = 0; row < 500; ++row) {
+            const std::string above = row == 0 ? "A1" : "B" + std::to_string(row);
+            sheet.SetCell(Position{ row, 1 }, "=" + above + "+1");
+            sheet.SetCell(Position{ row, 2 }, "=A1*2");
+        }
+        sheet.SetCell("D1"_pos, "=IF(A1>3,B500,C1)");
+    };
+    auto values = [](const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+        return output.str();
+    };
+
+    Sheet reference;
+    build(reference);
+    Sheet sheet;
+    build(sheet);
+    ASSERT_EQUAL(values(sheet), values(reference));
+    sheet.SetIncrementalRecalc(true);
+
+    // правка сбрасывает только саму ячейку, остальное ждёт RecalcFor()
+    sheet.SetCell("A1"_pos, "5");
+    reference.SetCell("A1"_pos, "5");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("B500"_pos)->GetValue()), 501.0);
+    Sheet::RecalcProgress progress = sheet.RecalcFor(std::chrono::nanoseconds(0));
+    ASSERT(!progress.IsConsistent());
+    ASSERT(progress.invalidated > 0u && progress.invalidated < 1000u);
+
+    // новая правка и вставка строк посреди пересчёта
+    sheet.SetCell("B250"_pos, "=B249+10");
+    reference.SetCell("B250"_pos, "=B249+10");
+    sheet.InsertRows(100, 3);
+    reference.InsertRows(100, 3);
+
+    std::size_t slices = 1;
+    std::size_t evaluated = 0;
+    bool consistent = false;
+    do {
+        progress = sheet.RecalcFor(std::chrono::nanoseconds(0));
+        evaluated += progress.evaluated;
+        if (progress.IsConsistent() && !consistent) {
+            consistent = true;
+            ASSERT(!progress.IsComplete());
+        }
+        ++slices;
+    } while (!progress.IsComplete());
+    ASSERT(slices > 10u);
+    ASSERT(evaluated > 0u && evaluated <= 1001u);
+    ASSERT(sheet.GetConcreteCell("B503"_pos)->HasCachedValue());
+    ASSERT(sheet.GetConcreteCell("D1"_pos)->HasCachedValue());
+    ASSERT_EQUAL(values(sheet), values(reference));
+
+    // без ограничения пересчёт заканчивается за один вызов
+    sheet.SetCell("A1"_pos, "2");
+    reference.SetCell("A1"_pos, "2");
+    progress = sheet.RecalcFor(std::chrono::hours(1));
+    ASSERT(progress.IsComplete());
+    ASSERT_EQUAL(values(sheet), values(reference));
+
+    // выключение доводит сброс до конца
+    sheet.SetCell("A1"_pos, "3");
+    reference.SetCell("A1"_pos, "3");
+    sheet.SetIncrementalRecalc(false);
+    ASSERT_EQUAL(values(sheet), values(reference));
+    sheet.SetCell("A1"_pos, "4");
+    reference.SetCell("A1"_pos, "4");
+    ASSERT_EQUAL(values(sheet), values(reference));
+
+    {
+        // ссылки ветвей IF и диапазонов VLOOKUP вычисляются шагами, а не
+        // целиком внутри одного шага
+        Sheet chains;
+        const int rows = 2000;
+        chains.SetCell("A1"_pos, "0");
+        chains.SetCell("B1"_pos, "0");
+        chains.SetCell("C1"_pos, "0");
+        for (int row = 1; row < rows; ++row) {
+            const std::string prev = std::to_string(row);
+            chains.SetCell(Position{ row, 0 }, "=IF(1,A" + prev + "+1,0)");
+            chains.SetCell(Position{ row, 1 }, std::to_string(row));
+            chains.SetCell(Position{ row, 2 }, "=VLOOKUP(" + std::to_string(row - 1) + ",B1:C" + prev + ",2)+1");
+        }
+        chains.GetCell(Position{ rows - 1, 0 })->GetValue();
+        chains.GetCell(Position{ rows - 1, 2 })->GetValue();
+        chains.SetIncrementalRecalc(true);
+        chains.SetCell("A1"_pos, "10");
+        chains.SetCell("C1"_pos, "10");
+
+        auto cached = [&chains]() {
+            std::size_t count = 0;
+            for (int row = 1; row < rows; ++row) {
+                count += chains.GetConcreteCell(Position{ row, 0 })->HasCachedValue() ? 1 : 0;
+                count += chains.GetConcreteCell(Position{ row, 2 })->HasCachedValue() ? 1 : 0;
+            }
+            return count;
+        };
+        std::size_t before = cached();
+        do {
+            progress = chains.RecalcFor(std::chrono::nanoseconds(0));
+            const std::size_t after = cached();
+            ASSERT(progress.evaluated <= 8u);
+            ASSERT(after <= before + progress.evaluated);
+            before = after;
+        } while (!progress.IsComplete());
+        ASSERT_EQUAL(std::get<double>(chains.GetCell(Position{ rows - 1, 0 })->GetValue()), rows + 9.0);
+        ASSERT_EQUAL(std::get<double>(chains.GetCell(Position{ rows - 1, 2 })->GetValue()), rows + 9.0);
+    }
+}
+
+void TestStringPool() {
+    Sheet sheet;
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell(Position{ row, 0 }, row % 2 ? "north" : "south");
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 2u);
+
+    auto view = [&](Position pos) {
+        return std::get<std::string_view>(sheet.GetCell(pos)->GetValueView());
+    };
+    ASSERT_EQUAL(view("A1"_pos), "south");
+    ASSERT(view("A1"_pos).data() == view("A3"_pos).data());
+    ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A2"_pos)->GetValue()), "north");
+
+    sheet.SetCell("B1"_pos, "'=1+2");
+    ASSERT_EQUAL(view("B1"_pos), "=1+2");
+    ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "'=1+2");
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 3u);
+
+    sheet.SetCell("C1"_pos, "'5");
+    sheet.SetCell("D1"_pos, "=C1*2");
+    ASSERT_EQUAL(std::get<double>(sheet.GetCell("D1"_pos)->GetValue()), 10.0);
+
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 3u);
+    for (int row = 1; row < 100; row += 2) {
+        sheet.SetCell(Position{ row, 0 }, "south");
+    }
+    ASSERT_EQUAL(sheet.GetStringPool().Size(), 2u);
+}
+
+void TestNumberColumns() {
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1.5");
+        sheet.SetCell("A2"_pos, "1.50");
+        sheet.SetCell("B3"_pos, "-2");
+        ASSERT(sheet.FindNumber("A1"_pos) != nullptr);
+        ASSERT(sheet.FindNumber("A2"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1.5");
+        ASSERT_EQUAL(std::get<std::string>(sheet.GetCell("A1"_pos)->GetValue()), "1.5");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "1.50");
+        ASSERT(sheet.GetCell("A1"_pos) == sheet.GetCell("A1"_pos));
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 3, 2 }));
+
+        sheet.SetCell("C1"_pos, "=A1+A2+B3");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("C1"_pos)->GetValue()), 1.0);
+
+        // длинная неканоническая запись остаётся текстом, но читается числом
+        Sheet long_texts;
+        long_texts.SetCell("A1"_pos, "2." + std::string(80, '0'));
+        long_texts.SetCell("B1"_pos, "=A1*3");
+        ASSERT(long_texts.FindNumber("A1"_pos) == nullptr);
+        ASSERT_EQUAL(std::get<double>(long_texts.GetCell("B1"_pos)->GetValue()), 6.0);
+
+        std::ostringstream texts;
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "1.5\t\t=A1+A2+B3\n1.50\t\t\n\t-2\t\n");
+    }
+    {
+        // представление числовой ячейки учитывается в памяти и переживает сдвиги
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "-2.2250738585072014e-308");
+        const std::size_t numbers_memory = sheet.GetMemoryUsage().numbers;
+        const CellInterface* cell = sheet.GetCell("A1"_pos);
+        ASSERT(sheet.GetMemoryUsage().numbers > numbers_memory);
+        ASSERT_EQUAL(cell->GetText(), "-2.2250738585072014e-308");
+        ASSERT(std::get<std::string_view>(cell->GetValueView()) == "-2.2250738585072014e-308");
+
+        sheet.InsertRows(0, 2);
+        sheet.InsertCols(0);
+        ASSERT(sheet.GetCell("B3"_pos) == cell);
+        ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+        sheet.DeleteRows(0);
+        ASSERT(sheet.GetCell("B2"_pos) == cell);
+        ASSERT_EQUAL(cell->GetText(), "-2.2250738585072014e-308");
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1*2");
+        sheet.SetCell("B1"_pos, "3");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 6.0);
+
+        sheet.SetCell("B1"_pos, "4");
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 8.0);
+
+        sheet.SetCell("B1"_pos, "=5");
+        ASSERT(sheet.FindNumber("B1"_pos) == nullptr);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 10.0);
+
+        sheet.SetCell("B1"_pos, "6");
+        ASSERT(sheet.GetConcreteCell("B1"_pos) == nullptr);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 12.0);
+
+        sheet.ClearCell("B1"_pos);
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT_EQUAL(std::get<double>(sheet.GetCell("A1"_pos)->GetValue()), 0.0);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+    }
+    {
+        // счётчик памяти совпадает с обходом столбцов после любых правок
+        NumberColumns columns;
+        for (int row = 0; row < 3000; row += 7) {
+            columns.Set(Position{ row, row % 5 }, row);
+        }
+        ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+        columns.Erase(Position{ 14, 4 });
+        columns.Shift({ PositionShift::Axis::Rows, 100, 600 });
+        ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+        columns.Shift({ PositionShift::Axis::Cols, 1, -2 });
+        columns.Set(Position{ 5000, 9 }, 1.0);
+        ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+        columns.Shift({ PositionShift::Axis::Rows, 0, -4000 });
+        ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+    }
+}
+
+void TestNumberPaging() {
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.spill").string();
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+    auto fill = [](Sheet& sheet) {
+        for (int col = 0; col < 20; ++col) {
+            for (int row = 0; row < 2000; ++row) {
+                sheet.SetCell(Position{ row, col }, std::to_string(row * 100 + col));
+            }
+        }
+        sheet.SetCell("V1"_pos, "=A1+T2000+J1000");
+    };
+    auto values = [](const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintValues(output);
+        return output.str();
+    };
+
+    Sheet resident;
+    fill(resident);
+    Sheet paged;
+    paged.SetNumberPaging(path, 8 * NumberColumns::PAGE_ROWS * sizeof(double));
+    ASSERT(!std::filesystem::exists(path));
+    fill(paged);
+
+    NumberColumns::PagingStats stats = paged.GetNumberPagingStats();
+    ASSERT(stats.resident_pages <= 8u);
+    ASSERT_EQUAL(stats.resident_pages + stats.spilled_pages, 80u);
+    ASSERT(paged.GetMemoryUsage().numbers < resident.GetMemoryUsage().numbers / 4);
+    ASSERT_EQUAL(std::get<double>(paged.GetCell("V1"_pos)->GetValue()), 199919.0 + 99909.0);
+    ASSERT_EQUAL(paged.GetCell("T1999"_pos)->GetText(), "199819");
+    ASSERT(paged.GetNumberPagingStats().faults > stats.faults);
+
+    // обход всех ячеек через GetCell() не выходит за бюджет страниц, а
+    // выданные представления остаются действительными и учитываются в памяти
+    const std::size_t numbers_memory = paged.GetMemoryUsage().numbers;
+    const CellInterface* first_cell = paged.GetCell("A1"_pos);
+    for (int col = 0; col < 20; ++col) {
+        for (int row = 0; row < 2000; ++row) {
+            ASSERT_EQUAL(paged.GetCell(Position{ row, col })->GetText(), std::to_string(row * 100 + col));
+        }
+    }
+    ASSERT(paged.GetNumberPagingStats().resident_pages <= 8u);
+    ASSERT(paged.GetMemoryUsage().numbers >= numbers_memory + 40000 * sizeof(NumberCell));
+    ASSERT(paged.GetCell("A1"_pos) == first_cell);
+    ASSERT_EQUAL(first_cell->GetText(), "0");
+
+    // правки и сдвиги над вытесненными страницами
+    for (Sheet* sheet : { &resident, &paged }) {
+        sheet->SetCell("A1"_pos, "7");
+        sheet->ClearCell("B1500"_pos);
+        sheet->InsertRows(100, 700);
+        sheet->DeleteCols(3, 2);
+        sheet->SetCell("C2"_pos, "0.25");
+    }
+    ASSERT_EQUAL(values(paged), values(resident));
+    ASSERT(paged.GetNumberPagingStats().resident_pages <= 8u);
+
+    const CellInterface* moved_cell = paged.GetCell("C1"_pos);
+    ASSERT_EQUAL(moved_cell->GetText(), "2");
+    paged.SetNumberPaging(path, 0);
+    stats = paged.GetNumberPagingStats();
+    ASSERT_EQUAL(stats.spilled_pages, 0u);
+    ASSERT_EQUAL(values(paged), values(resident));
+    ASSERT(paged.GetCell("C1"_pos) == moved_cell);
+
+    // вытеснение, чтение и освобождение страниц меняют счётчик памяти
+    NumberColumns columns;
+    columns.SetPaging(path, 2 * NumberColumns::PAGE_ROWS * sizeof(double));
+    for (int row = 0; row < 4000; ++row) {
+        columns.Set(Position{ row, row % 3 }, row);
+    }
+    ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+    ASSERT_EQUAL(*columns.Find(Position{ 3, 0 }), 3.0);
+    ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+    columns.Shift({ PositionShift::Axis::Cols, 0, -1 });
+    columns.Shift({ PositionShift::Axis::Rows, 10, -1000 });
+    ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+    columns.SetPaging(path, 0);
+    ASSERT_EQUAL(columns.GetMemoryUsage(), columns.CountMemoryUsage());
+#else
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    try {
+        sheet.SetNumberPaging(path, 1 << 20);
+        ASSERT(false);
+    }
+    catch (const std::system_error& error) {
+        ASSERT(error.code() == std::errc::function_not_supported);
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+#endif
+}
+
+void TestBulkLoad() {
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 500; ++row) {
+        const std::string index = std::to_string(row + 1);
+        cells.emplace_back(Position{ row, 0 }, std::to_string(row));
+        cells.emplace_back(Position{ row, 1 }, "=A" + index + "*2");
+        cells.emplace_back(Position{ row, 2 }, row == 0 ? "=1" : "=C" + std::to_string(row) + "+B" + index);
+    }
+    cells.emplace_back("B1"_pos, "=A1*3");
+
+    Sheet sequential;
+    for (const auto& [pos, text] : cells) {
+        sequential.SetCell(pos, text);
+    }
+    Sheet bulk;
+    bulk.SetCells(cells, 4);
+
+    std::ostringstream expected;
+    std::ostringstream actual;
+    sequential.PrintValues(expected);
+    bulk.PrintValues(actual);
+    ASSERT_EQUAL(actual.str(), expected.str());
+    ASSERT_EQUAL(bulk.GetCell("B1"_pos)->GetText(), "=A1*3");
+
+    // несколько таблиц грузятся одновременно, каждая в нескольких потоках
+    std::vector<std::string> loaded(4);
+    std::vector<std::thread> loaders;
+    for (std::size_t i = 0; i < loaded.size(); ++i) {
+        loaders.emplace_back([&cells, &result = loaded[i]] {
+            Sheet sheet;
+            sheet.SetCells(cells, 4);
+            std::ostringstream output;
+            sheet.PrintValues(output);
+            result = output.str();
+        });
+    }
+    for (auto& loader : loaders) {
+        loader.join();
+    }
+    for (const auto& result : loaded) {
+        ASSERT_EQUAL(result, expected.str());
+    }
+
+    Sheet failed;
+    try {
+        failed.SetCells({ { "A1"_pos, "=1" }, { "A2"_pos, "=A3" }, { "A3"_pos, "=A2" }, { "A4"_pos, "=2" } }, 2);
+        ASSERT(false);
+    } catch (CircularDependencyException&) {}
+    ASSERT_EQUAL(failed.GetCell("A2"_pos)->GetText(), "=A3");
+    ASSERT(failed.GetCell("A3"_pos) == nullptr);
+    ASSERT(failed.GetCell("A4"_pos) == nullptr);
+
+    try {
+        failed.SetCells({ { "B1"_pos, "=1" }, { "B2"_pos, "=1+" } }, 2);
+        ASSERT(false);
+    } catch (FormulaException&) {}
+    ASSERT_EQUAL(failed.GetCell("B1"_pos)->GetText(), "=1");
+    ASSERT(failed.GetCell("B2"_pos) == nullptr);
+}
+
+void TestLookup() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "10");
+        sheet.SetCell("A2"_pos, "20");
+        sheet.SetCell("A3"_pos, "30");
+        sheet.SetCell("A4"_pos, "20");
+        sheet.SetCell("A5"_pos, "label");
+        sheet.SetCell("B1"_pos, "1.5");
+        sheet.SetCell("B2"_pos, "2.5");
+        sheet.SetCell("B3"_pos, "=B2*2");
+        sheet.SetCell("D1"_pos, "=MATCH(20,A1:A5)");
+        sheet.SetCell("D2"_pos, "=VLOOKUP(E1+10,A1:B5,2)");
+        sheet.SetCell("D3"_pos, "=MATCH(40,A5:A1)");
+        sheet.SetCell("D4"_pos, "=MATCH(1/0,A1:A5)");
+        sheet.SetCell("E1"_pos, "20");
+
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(2.0));
+        ASSERT_EQUAL(value(sheet, "D2"_pos), CellInterface::Value(5.0));
+        ASSERT_EQUAL(value(sheet, "D3"_pos), CellInterface::Value(FormulaError::Category::NA));
+        ASSERT_EQUAL(value(sheet, "D4"_pos), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=VLOOKUP(E1+10,A1:B5,2)");
+        ASSERT_EQUAL(sheet.GetCell("D3"_pos)->GetText(), "=MATCH(40,A1:A5)");
+        ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetReferencedCells(), std::vector{ "E1"_pos });
+
+        // индекс обновляется при изменении ячеек столбца ключей
+        sheet.SetCell("A2"_pos, "25");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(4.0));
+        sheet.SetCell("A3"_pos, "=A1*4");
+        ASSERT_EQUAL(value(sheet, "D3"_pos), CellInterface::Value(3.0));
+        ASSERT_EQUAL(value(sheet, "D2"_pos), CellInterface::Value(FormulaError::Category::NA));
+        sheet.SetCell("A1"_pos, "'30");
+        ASSERT_EQUAL(value(sheet, "D2"_pos), CellInterface::Value(1.5));
+        ASSERT_EQUAL(value(sheet, "D3"_pos), CellInterface::Value(FormulaError::Category::NA));
+        sheet.ClearCell("A4"_pos);
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(FormulaError::Category::NA));
+        sheet.SetCell("D1"_pos, "=VLOOKUP(25,A1:B5,2)");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(2.5));
+        sheet.SetCell("B2"_pos, "7");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(7.0));
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=MATCH(1,A1:A3)");
+        try {
+            sheet.SetCell("A2"_pos, "=B1");
+            ASSERT(false);
+        } catch (CircularDependencyException&) {}
+        try {
+            sheet.SetCell("A4"_pos, "=MATCH(1,A1:A5)");
+            ASSERT(false);
+        } catch (CircularDependencyException&) {}
+        try {
+            sheet.SetCell("C1"_pos, "=MATCH(1,A1:B3)");
+            ASSERT(false);
+        } catch (FormulaException&) {}
+        try {
+            sheet.SetCell("C1"_pos, "=VLOOKUP(1,A1:B3,3)");
+            ASSERT(false);
+        } catch (FormulaException&) {}
+        sheet.SetCell("A4"_pos, "=B1");
+        ASSERT_EQUAL(value(sheet, "A4"_pos), CellInterface::Value(FormulaError::Category::NA));
+    }
+    {
+        // таблица без FormulaSheetAccess: числа и поиск через GetCell()
+        class CellsOnly : public SheetInterface {
+        public:
+            void SetCell(Position pos, std::string text) override {
+                sheet_.SetCell(pos, std::move(text));
+            }
+            const CellInterface* GetCell(Position pos) const override {
+                return sheet_.GetCell(pos);
+            }
+            CellInterface* GetCell(Position pos) override {
+                return sheet_.GetCell(pos);
+            }
+            void ClearCell(Position pos) override {
+                sheet_.ClearCell(pos);
+            }
+            Size GetPrintableSize() const override {
+                return sheet_.GetPrintableSize();
+            }
+            void PrintValues(std::ostream& output) const override {
+                sheet_.PrintValues(output);
+            }
+            void PrintTexts(std::ostream& output) const override {
+                sheet_.PrintTexts(output);
+            }
+
+        private:
+            Sheet sheet_;
+        };
+
+        CellsOnly sheet;
+        sheet.SetCell("A2"_pos, "0");
+        sheet.SetCell("A3"_pos, "=1+2");
+        sheet.SetCell("B3"_pos, "1.5");
+        auto lookup = ParseFormula("VLOOKUP(3,A1:B3,2)*2");
+        ASSERT_EQUAL(std::get<double>(lookup->Evaluate(sheet)), 3.0);
+        ASSERT_EQUAL(std::get<double>(ParseFormula("MATCH(0,A1:A3)")->Evaluate(sheet)), 2.0);
+    }
+}
+
+void TestConditional() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=1+2<4");
+        sheet.SetCell("A2"_pos, "=(1<2)<1");
+        sheet.SetCell("A3"_pos, "=1<(2<1)");
+        sheet.SetCell("A4"_pos, "=-(1<>2)+(3>=3)*2");
+        sheet.SetCell("A5"_pos, "=IF(A1=1,10,IF(A2>A1,20,30))");
+        sheet.SetCell("A6"_pos, "=IF(1/0,1,2)");
+
+        ASSERT_EQUAL(value(sheet, "A1"_pos), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value(sheet, "A2"_pos), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value(sheet, "A3"_pos), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value(sheet, "A4"_pos), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value(sheet, "A5"_pos), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value(sheet, "A6"_pos), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "=1+2<4");
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=1<2<1");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetText(), "=1<(2<1)");
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetText(), "=-(1<>2)+(3>=3)*2");
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetText(), "=IF(A1=1,10,IF(A2>A1,20,30))");
+        ASSERT_EQUAL(sheet.GetCell("A5"_pos)->GetReferencedCells(), (std::vector{ "A1"_pos, "A2"_pos }));
+
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(value(sheet, "A5"_pos), CellInterface::Value(30.0));
+        sheet.SetCell("A2"_pos, "1");
+        ASSERT_EQUAL(value(sheet, "A5"_pos), CellInterface::Value(20.0));
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=C1*2");
+        sheet.SetCell("C1"_pos, "5");
+        sheet.SetCell("D1"_pos, "=IF(A1>0,A1,B1)");
+        sheet.SetCell("E1"_pos, "=D1+1");
+
+        // невыбранная ветвь не вычисляется
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(2.0));
+        ASSERT(!sheet.GetConcreteCell("B1"_pos)->HasCachedValue());
+
+        // изменение ячейки невыбранной ветви не сбрасывает кэш
+        sheet.SetCell("C1"_pos, "6");
+        ASSERT(sheet.GetConcreteCell("D1"_pos)->HasCachedValue());
+        ASSERT(sheet.GetConcreteCell("E1"_pos)->HasCachedValue());
+
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT(!sheet.GetConcreteCell("E1"_pos)->HasCachedValue());
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(13.0));
+        sheet.SetCell("C1"_pos, "7");
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(15.0));
+
+        // цикл через невыбранную ветвь всё равно запрещён
+        try {
+            sheet.SetCell("C1"_pos, "=IF(1,0,E1)");
+            ASSERT(false);
+        } catch (CircularDependencyException&) {}
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "7");
+    }
+    {
+        // ссылки условия вычисляются заранее, длинная цепочка IF не растит стек
+        Sheet sheet;
+        const int rows = Position::MAX_ROWS;
+        sheet.SetCell(Position{ 0, 0 }, "0");
+        for (int row = 1; row < rows; ++row) {
+            const std::string prev = "A" + std::to_string(row);
+            sheet.SetCell(Position{ row, 0 }, "=IF(" + prev + ">=0," + prev + "+1,0)");
+        }
+        ASSERT_EQUAL(value(sheet, Position{ rows - 1, 0 }), CellInterface::Value(static_cast<double>(rows - 1)));
+    }
+    {
+        // ссылки только в ветвях и диапазонах поиска тоже не растят стек
+        Sheet sheet;
+        const int rows = Position::MAX_ROWS;
+        sheet.SetCell(Position{ 0, 0 }, "0");
+        sheet.SetCell(Position{ 0, 1 }, "0");
+        sheet.SetCell(Position{ 0, 2 }, "0");
+        for (int row = 1; row < rows; ++row) {
+            const std::string prev = std::to_string(row);
+            sheet.SetCell(Position{ row, 0 }, "=IF(1,A" + prev + "+1,0)");
+            sheet.SetCell(Position{ row, 1 }, std::to_string(row));
+            sheet.SetCell(Position{ row, 2 }, "=VLOOKUP(" + std::to_string(row - 1) + ",B1:C" + prev + ",2)+1");
+        }
+        ASSERT_EQUAL(value(sheet, Position{ rows - 1, 0 }), CellInterface::Value(static_cast<double>(rows - 1)));
+        ASSERT_EQUAL(value(sheet, Position{ rows - 1, 2 }), CellInterface::Value(static_cast<double>(rows - 1)));
+
+        sheet.SetCell(Position{ 0, 0 }, "10");
+        sheet.SetCell(Position{ 0, 2 }, "10");
+        ASSERT_EQUAL(value(sheet, Position{ rows - 1, 0 }), CellInterface::Value(static_cast<double>(rows + 9)));
+        ASSERT_EQUAL(value(sheet, Position{ rows - 1, 2 }), CellInterface::Value(static_cast<double>(rows + 9)));
+    }
+}
+
+void TestInsertDelete() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto text = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetText();
+    };
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "=A1+A2");
+        sheet.SetCell("B3"_pos, "=A3*10");
+        sheet.SetCell("C1"_pos, "text");
+        ASSERT_EQUAL(value(sheet, "B3"_pos), CellInterface::Value(30.0));
+
+        sheet.InsertRows(1, 2);
+        ASSERT_EQUAL(text(sheet, "A5"_pos), "=A1+A4");
+        ASSERT_EQUAL(text(sheet, "B5"_pos), "=A5*10");
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT(sheet.GetConcreteCell("B5"_pos)->HasCachedValue());
+        ASSERT_EQUAL(value(sheet, "B5"_pos), CellInterface::Value(30.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 3 }));
+        sheet.SetCell("A4"_pos, "5");
+        ASSERT_EQUAL(value(sheet, "B5"_pos), CellInterface::Value(60.0));
+
+        sheet.DeleteRows(0);
+        ASSERT_EQUAL(text(sheet, "A4"_pos), "=#REF!+A3");
+        ASSERT_EQUAL(value(sheet, "A4"_pos), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(value(sheet, "B4"_pos), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetReferencedCells(), std::vector{ "A3"_pos });
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 2 }));
+
+        sheet.DeleteRows(1);
+        ASSERT_EQUAL(text(sheet, "A3"_pos), "=#REF!+A2");
+        ASSERT_EQUAL(text(sheet, "B3"_pos), "=A3*10");
+        sheet.SetCell("A3"_pos, "=A2*2");
+        ASSERT_EQUAL(value(sheet, "B3"_pos), CellInterface::Value(100.0));
+    }
+    {
+        Sheet sheet;
+        for (int row = 0; row < 3; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string((row + 1) * 10));
+            sheet.SetCell(Position{ row, 1 }, std::to_string(row + 1));
+            sheet.SetCell(Position{ row, 2 }, std::to_string((row + 1) * 100));
+        }
+        sheet.SetCell("D1"_pos, "=VLOOKUP(20,A1:C3,3)");
+        sheet.SetCell("E1"_pos, "=MATCH(30,A1:A3)");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(200.0));
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(3.0));
+
+        sheet.InsertCols(1);
+        ASSERT_EQUAL(text(sheet, "E1"_pos), "=VLOOKUP(20,A1:D3,4)");
+        ASSERT_EQUAL(text(sheet, "F1"_pos), "=MATCH(30,A1:A3)");
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(200.0));
+        sheet.SetCell("D2"_pos, "7");
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(7.0));
+
+        sheet.DeleteCols(3);
+        ASSERT_EQUAL(text(sheet, "D1"_pos), "=VLOOKUP(20,#REF!,4)");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+
+        sheet.InsertRows(1);
+        ASSERT_EQUAL(text(sheet, "E1"_pos), "=MATCH(30,A1:A4)");
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(4.0));
+        sheet.SetCell("A2"_pos, "30");
+        ASSERT_EQUAL(value(sheet, "E1"_pos), CellInterface::Value(2.0));
+
+        sheet.DeleteCols(0);
+        ASSERT_EQUAL(text(sheet, "D1"_pos), "=MATCH(30,#REF!)");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "5");
+        sheet.SetCell("C1"_pos, "=IF(A1,B1,0)");
+        sheet.SetCell("C2"_pos, "=A16384");
+        ASSERT_EQUAL(value(sheet, "C1"_pos), CellInterface::Value(5.0));
+
+        sheet.InsertCols(0);
+        ASSERT_EQUAL(text(sheet, "D1"_pos), "=IF(B1,C1,0)");
+        sheet.SetCell("C1"_pos, "7");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(7.0));
+
+        sheet.InsertRows(0);
+        ASSERT_EQUAL(text(sheet, "D3"_pos), "=#REF!");
+
+        sheet.SetCell(Position{ Position::MAX_ROWS - 1, 0 }, "x");
+        try {
+            sheet.InsertRows(0);
+            ASSERT(false);
+        } catch (InvalidPositionException&) {}
+        try {
+            sheet.DeleteCols(Position::MAX_COLS - 1, 2);
+            ASSERT(false);
+        } catch (InvalidPositionException&) {}
+        ASSERT_EQUAL(text(sheet, "D2"_pos), "=IF(B2,C2,0)");
+    }
+}
+
+void TestFillRange() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto text = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetText();
+    };
+    {
+        Sheet sheet;
+        for (int row = 0; row < 4; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row + 1));
+        }
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("C1"_pos, "=MATCH(B1,B1:B4)");
+        sheet.SetCell("D1"_pos, "=B4+1");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(1.0));
+
+        sheet.FillRange("B1"_pos, { "B1"_pos, "B4"_pos });
+        ASSERT_EQUAL(text(sheet, "B4"_pos), "=A4*2");
+        ASSERT_EQUAL(value(sheet, "B3"_pos), CellInterface::Value(6.0));
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(9.0));
+
+        sheet.FillRange("C1"_pos, { "C2"_pos, "C3"_pos });
+        ASSERT_EQUAL(text(sheet, "C3"_pos), "=MATCH(B3,B3:B6)");
+        ASSERT_EQUAL(value(sheet, "C2"_pos), CellInterface::Value(1.0));
+
+        // ссылка за край таблицы становится #REF!
+        sheet.FillRange("B2"_pos, { "A1"_pos, "A1"_pos });
+        ASSERT_EQUAL(text(sheet, "A1"_pos), "=#REF!*2");
+        ASSERT_EQUAL(value(sheet, "B1"_pos), CellInterface::Value(FormulaError::Category::Ref));
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(9.0));
+
+        sheet.FillRange("A2"_pos, { "E1"_pos, "F2"_pos });
+        ASSERT_EQUAL(text(sheet, "F2"_pos), "2");
+        sheet.FillRange("G1"_pos, { "E1"_pos, "E2"_pos });
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 6 }));
+    }
+    {
+        Sheet sheet;
+        sheet.SetCell("A2"_pos, "=C2");
+        sheet.SetCell("C1"_pos, "=A1");
+        sheet.SetCell("C2"_pos, "5");
+        sheet.SetCell("D1"_pos, "=A2+1");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(6.0));
+        try {
+            sheet.FillRange("C1"_pos, { "C1"_pos, "C3"_pos });
+            ASSERT(false);
+        } catch (CircularDependencyException&) {}
+        ASSERT_EQUAL(text(sheet, "C2"_pos), "5");
+        ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+        sheet.SetCell("C2"_pos, "7");
+        ASSERT_EQUAL(value(sheet, "D1"_pos), CellInterface::Value(8.0));
+
+        // формулы области, ссылающиеся друг на друга, - не цикл
+        sheet.SetCell("E1"_pos, "1");
+        sheet.SetCell("E2"_pos, "=E1+1");
+        sheet.FillRange("E2"_pos, { "E3"_pos, "E100"_pos });
+        ASSERT_EQUAL(value(sheet, "E100"_pos), CellInterface::Value(100.0));
+    }
+}
+
+void TestUndoRedo() {
+    auto value = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetValue();
+    };
+    auto text = [](const Sheet& sheet, Position pos) {
+        return sheet.GetCell(pos)->GetText();
+    };
+    {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT(!sheet.Undo());
+
+        sheet.SetJournalBudget(1 << 20);
+        sheet.SetCell("A2"_pos, "=A1*2");
+        sheet.SetCell("A1"_pos, "5");
+        sheet.SetCell("B1"_pos, "text");
+        ASSERT_EQUAL(value(sheet, "A2"_pos), CellInterface::Value(10.0));
+
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 1 }));
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(value(sheet, "A2"_pos), CellInterface::Value(2.0));
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+        ASSERT(!sheet.Undo());
+        ASSERT_EQUAL(text(sheet, "A1"_pos), "1");
+
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(text(sheet, "A2"_pos), "=A1*2");
+        ASSERT(sheet.Redo());
+        ASSERT_EQUAL(value(sheet, "A2"_pos), CellInterface::Value(10.0));
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT(!sheet.Redo());
+        ASSERT_EQUAL(value(sheet, "A2"_pos), CellInterface::Value(6.0));
+
+        sheet.ClearCell("A2"_pos);
+        ASSERT(sheet.Undo());
+        sheet.SetCell("A1"_pos, "4");
+        ASSERT_EQUAL(value(sheet, "A2"_pos), CellInterface::Value(8.0));
+    }
+    {
+        Sheet sheet;
+        sheet.SetJournalBudget(1 << 20);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("B3"_pos, "old");
+        sheet.FillRange("B1"_pos, { "B2"_pos, "B4"_pos });
+        ASSERT_EQUAL(text(sheet, "B3"_pos), "=A3+1");
+        ASSERT(sheet.Undo());
+        ASSERT_EQUAL(text(sheet, "B3"_pos), "old");
+        ASSERT(sheet.GetCell("B4"_pos) == nullptr);
+
+        sheet.SetCells({ { "C1"_pos, "=B1" }, { "C2"_pos, "2" }, { "C1"_pos, "=C2" } }, 2);
+        ASSERT_EQUAL(value(sheet, "C1"_pos), CellInterface::Value(2.0));
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+        ASSERT(sheet.GetCell("C2"_pos) == nullptr);
+
+        sheet.BeginEdit();
+        sheet.SetCell("D1"_pos, "1");
+        sheet.SetCell("D2"_pos, "=D1");
+        // отмена внутри незавершённой правки запрещена
+        for (bool undo : { true, false }) {
+            try {
+                undo ? sheet.Undo() : sheet.Redo();
+                ASSERT(false);
+            } catch (const std::logic_error&) {}
+        }
+        ASSERT(sheet.GetCell("D2"_pos) != nullptr);
+        sheet.EndEdit();
+        ASSERT(sheet.Undo());
+        ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+
+        sheet.InsertRows(0);
+        ASSERT(!sheet.Undo());
+        ASSERT(!sheet.Redo());
+    }
+    {
+        Sheet sheet;
+        const std::size_t budget = 4096;
+        sheet.SetJournalBudget(budget);
+        for (int i = 0; i < 1000; ++i) {
+            sheet.SetCell("A1"_pos, "=" + std::to_string(i) + "+B1");
+        }
+        ASSERT(sheet.GetJournal().GetMemoryUsage() <= budget);
+        int undone = 0;
+        while (sheet.Undo()) {
+            ++undone;
+        }
+        ASSERT(undone > 0 && undone < 1000);
+        ASSERT_EQUAL(text(sheet, "A1"_pos), "=" + std::to_string(999 - undone) + "+B1");
+    }
+}
+
+void TestWorkbookGenerator() {
+    WorkbookShape shape;
+    shape.seed = 7;
+    shape.rows = 64;
+    shape.cols = 8;
+    shape.density = 0.8;
+    shape.formula_ratio = 0.5;
+    shape.error_ratio = 0.1;
+    shape.fan_in = { 1, 6, 2.0 };
+    shape.fan_out.skew = 3.0;
+    shape.chains = 2;
+    shape.chain_depth = 100;
+    shape.diamonds = 1;
+    shape.diamond_layers = 10;
+    shape.diamond_width = 3;
+    shape.fill_down_columns = 1;
+
+    const WorkbookGenerator generator(shape);
+    ASSERT_EQUAL(generator.GetColumnCount(), 8 + 2 * 2 + 3 + 2);
+    {
+        std::ostringstream first;
+        std::ostringstream second;
+        generator.WriteCommandLog(first);
+        WorkbookGenerator(shape).WriteCommandLog(second);
+        ASSERT_EQUAL(first.str(), second.str());
+
+        shape.seed = 8;
+        std::ostringstream other;
+        WorkbookGenerator(shape).WriteCommandLog(other);
+        ASSERT(first.str() != other.str());
+        ASSERT_EQUAL(first.str().substr(0, 7), "SET\tA1\t");
+    }
+    {
+        // формулы ссылаются только на созданные раньше ячейки, поэтому
+        // SetCell() не находит циклов
+        Sheet sheet;
+        generator.Fill(sheet);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 64, 17 }));
+
+        int errors = 0;
+        int formulas = 0;
+        for (int row = 0; row < 64; ++row) {
+            for (int col = 0; col < 8; ++col) {
+                const CellInterface* cell = sheet.GetCell({ row, col });
+                if (!cell || cell->GetText().empty() || cell->GetText()[0] != '=') {
+                    continue;
+                }
+                ++formulas;
+                errors += std::holds_alternative<FormulaError>(cell->GetValue()) ? 1 : 0;
+            }
+        }
+        ASSERT(formulas > 100);
+        ASSERT(errors > 0 && errors < formulas);
+
+        // вторая цепочка начинается в столбце 11 и продолжается в 12
+        const double head = std::stod(sheet.GetCell("K1"_pos)->GetText());
+        ASSERT_EQUAL(sheet.GetCell("L36"_pos)->GetValue(), CellInterface::Value(head + 99));
+        ASSERT_EQUAL(sheet.GetCell("N10"_pos)->GetText(), "=(N9+O9)/2");
+        ASSERT_EQUAL(sheet.GetCell("Q2"_pos)->GetText(), "=P2*2+Q1");
+
+        std::ostringstream tsv;
+        std::ostringstream texts;
+        generator.WriteTsv(tsv);
+        sheet.PrintTexts(texts);
+        ASSERT_EQUAL(tsv.str(), texts.str());
+    }
+    {
+        shape.cols = Position::MAX_COLS;
+        try {
+            WorkbookGenerator{ shape };
+            ASSERT(false);
+        }
+        catch (const InvalidPositionException&) {
+        }
+    }
+}
+
+void TestStats() {
+    {
+        // объекты завершившихся потоков переходят к новым вместе со значениями
+        PerThread<int> counters;
+        for (int i = 0; i < 100; ++i) {
+            std::thread([&counters] {
+                ++counters.Get();
+            }).join();
+        }
+        int objects = 0;
+        int total = 0;
+        counters.ForEach([&](int value) {
+            ++objects;
+            total += value;
+        });
+        ASSERT_EQUAL(objects, 1);
+        ASSERT_EQUAL(total, 100);
+    }
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2+A1");
+    sheet.SetCell("B1"_pos, "=MATCH(1,A1:A3)");
+    sheet.SetCell("C1"_pos, "text");
+
+    SheetStats stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.formula_cells, 3u);
+    ASSERT_EQUAL(stats.dependency_cells, 2u);
+    ASSERT_EQUAL(stats.dependency_edges, 4u);
+
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.SetCell("A1"_pos, "2");
+    sheet.GetPrintableSize();
+
+    stats = sheet.GetStats();
+#ifdef SPREADSHEET_ENABLE_STATS
+    ASSERT_EQUAL(stats.formulas_parsed, 3u);
+    ASSERT(stats.parse_ns > 0);
+    // A3 читает вычисленную A2 как операнд, затем повторное чтение A3
+    ASSERT_EQUAL(stats.cache_misses, 1u);
+    ASSERT_EQUAL(stats.cache_hits, 2u);
+    ASSERT_EQUAL(stats.evaluations, 2u);
+    ASSERT_EQUAL(stats.max_invalidated_cells, 2u);
+    ASSERT(stats.cycle_checks >= 3u && stats.cycle_check_visits >= stats.cycle_checks);
+    ASSERT_EQUAL(stats.printable_size_calls, 1u);
+
+    // разбор в нескольких потоках попадает в общие счётчики
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 1000; ++row) {
+        cells.emplace_back(Position{ row, 3 }, "=A1+" + std::to_string(row));
+    }
+    sheet.SetCells(std::move(cells), 4);
+    ASSERT_EQUAL(sheet.GetStats().formulas_parsed, 1003u);
+
+    sheet.ResetStats();
+    stats = sheet.GetStats();
+    ASSERT_EQUAL(stats.formulas_parsed, 0u);
+    ASSERT_EQUAL(stats.cache_hits, 0u);
+    ASSERT_EQUAL(stats.formula_cells, 1003u);
+#else
+    ASSERT_EQUAL(stats.formulas_parsed, 0u);
+    ASSERT_EQUAL(stats.cache_hits, 0u);
+#endif
+}
+
+void TestMemoryUsage() {
+    // числовые столбцы при сдвиге перестраиваются, поэтому сравниваются
+    // только части, которые учитываются по мере правок
+    auto assert_equal = [](const SheetMemoryUsage& lhs, const SheetMemoryUsage& rhs) {
+        ASSERT_EQUAL(lhs.cells, rhs.cells);
+        ASSERT_EQUAL(lhs.contents, rhs.contents);
+        ASSERT_EQUAL(lhs.cached_values, rhs.cached_values);
+        ASSERT_EQUAL(lhs.formulas, rhs.formulas);
+        ASSERT_EQUAL(lhs.dependencies, rhs.dependencies);
+    };
+
+    Sheet sheet;
+    const SheetMemoryUsage empty = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(empty.formulas, 0u);
+    ASSERT_EQUAL(empty.cached_values, 0u);
+
+    sheet.SetJournalBudget(1 << 20);
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 100; ++row) {
+        cells.emplace_back(Position{ row, 0 }, std::to_string(row));
+        cells.emplace_back(Position{ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+        cells.emplace_back(Position{ row, 2 }, "=IF(A1>0,B1,C" + std::to_string(row + 10) + ")");
+        cells.emplace_back(Position{ row, 3 }, "long text in row " + std::to_string(row));
+    }
+    cells.emplace_back("E1"_pos, "=VLOOKUP(5,A1:B100,2)");
+    sheet.SetCells(std::move(cells), 4);
+    sheet.FillRange("B1"_pos, { "F1"_pos, "F50"_pos });
+    sheet.ClearCell("C50"_pos);
+    sheet.SetCell("D3"_pos, "=D4");
+    sheet.Undo();
+
+    SheetMemoryUsage usage = sheet.GetMemoryUsage();
+    ASSERT(usage.cells > empty.cells);
+    ASSERT(usage.contents > empty.contents);
+    ASSERT(usage.cached_values > 0);
+    ASSERT(usage.formulas > 0);
+    ASSERT(usage.dependencies > empty.dependencies);
+    ASSERT(usage.numbers > empty.numbers);
+    ASSERT(usage.journal > 0);
+    ASSERT_EQUAL(usage.Total(), usage.cells + usage.contents + usage.cached_values + usage.formulas
+        + usage.dependencies + usage.numbers + usage.journal);
+
+    // вычисление формул не меняет занятую память
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    assert_equal(sheet.GetMemoryUsage(), usage);
+
+    // вставка строк за таблицей пересчитывает счётчики обходом
+    sheet.SetJournalBudget(0);
+    usage = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(usage.journal, 0u);
+    sheet.InsertRows(1000);
+    assert_equal(sheet.GetMemoryUsage(), usage);
+
+    sheet.DeleteRows(10, 20);
+    usage = sheet.GetMemoryUsage();
+    sheet.InsertRows(1000);
+    assert_equal(sheet.GetMemoryUsage(), usage);
+
+    for (int row = 0; row < 100; ++row) {
+        for (int col = 0; col < 6; ++col) {
+            sheet.ClearCell({ row, col });
+        }
+    }
+    usage = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(usage.formulas, 0u);
+    ASSERT_EQUAL(usage.cached_values, 0u);
+    sheet.InsertRows(1000);
+    assert_equal(sheet.GetMemoryUsage(), usage);
+
+    // машинный код часто вычисляемой формулы учитывается в памяти формул
+    sheet.SetCell("B1"_pos, "=A1*2+A2");
+    usage = sheet.GetMemoryUsage();
+    for (int i = 0; i < JitFormula::HOT_THRESHOLD; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        sheet.GetCell("B1"_pos)->GetValue();
+    }
+#ifdef SPREADSHEET_JIT_AVAILABLE
+    ASSERT(sheet.GetMemoryUsage().formulas > usage.formulas);
+#endif
+    usage = sheet.GetMemoryUsage();
+    sheet.InsertRows(1000);
+    assert_equal(sheet.GetMemoryUsage(), usage);
+}
+
+void TestWriteAheadLog() {
+    const auto directory = std::filesystem::temp_directory_path();
+    const std::string log_path = (directory / "spreadsheet_test.wal").string();
+    const std::string snapshot_path = (directory / "spreadsheet_test.snapshot").string();
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(snapshot_path);
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+    auto texts = [](const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        return output.str();
+    };
+    auto recover = [&] {
+        auto sheet = std::make_unique<Sheet>();
+        RecoverSheet(*sheet, snapshot_path, log_path);
+        return sheet;
+    };
+
+    Sheet sheet;
+    ASSERT_EQUAL(RecoverSheet(sheet, snapshot_path, log_path), 0u);
+    {
+        WriteAheadLog log(log_path);
+        sheet.SetWriteAheadLog(&log);
+        sheet.SetJournalBudget(1 << 20);
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B1"_pos, "text");
+        sheet.SetCell("B2"_pos, "1.50");
+        sheet.FillRange("A2"_pos, { "A3"_pos, "A5"_pos });
+        sheet.ClearCell("B1"_pos);
+        sheet.InsertRows(0, 2);
+        sheet.DeleteCols(1);
+        // отмена меняет ячейки в обход SetCell(), и это тоже попадает в журнал
+        sheet.SetCell("A4"_pos, "=A3*10");
+        sheet.Undo();
+        log.Sync();
+        ASSERT(log.GetBatchCount() <= log.GetRecordCount());
+        ASSERT_EQUAL(texts(*recover()), texts(sheet));
+
+        // после снимка журнал начинается заново и содержит только новые правки
+        WriteSnapshot(sheet, log, snapshot_path);
+        ASSERT_EQUAL(log.GetGeneration(), 1u);
+        sheet.SetCell("C1"_pos, "=A7");
+        sheet.SetCell("A3"_pos, "2");
+        sheet.SetWriteAheadLog(nullptr);
+    }
+    auto recovered = std::make_unique<Sheet>();
+    ASSERT_EQUAL(RecoverSheet(*recovered, snapshot_path, log_path), 2u);
+    ASSERT_EQUAL(texts(*recovered), texts(sheet));
+    ASSERT_EQUAL(std::get<double>(recovered->GetCell("C1"_pos)->GetValue()), 6.0);
+
+    // недописанная при сбое запись отбрасывается и затирается новыми
+    {
+        std::ofstream output(log_path, std::ios::binary | std::ios::app);
+        output.write("\x40\0\0\0garbage", 11);
+    }
+    ASSERT_EQUAL(texts(*recover()), texts(sheet));
+    {
+        WriteAheadLog log(log_path);
+        sheet.SetWriteAheadLog(&log);
+        sheet.SetCell("D1"_pos, "after crash");
+        sheet.SetWriteAheadLog(nullptr);
+        ASSERT(!log.GetError());
+    }
+    ASSERT_EQUAL(texts(*recover()), texts(sheet));
+
+    // сбой посреди Restart(): журнал уже обрезан, а заголовок не записан
+    std::uint64_t generation = 0;
+    {
+        WriteAheadLog log(log_path);
+        WriteSnapshot(sheet, log, snapshot_path);
+        generation = log.GetGeneration();
+    }
+    std::filesystem::resize_file(log_path, 0);
+    {
+        auto restored = recover();
+        ASSERT_EQUAL(texts(*restored), texts(sheet));
+        WriteAheadLog log(log_path);
+        ASSERT_EQUAL(log.GetGeneration(), generation);
+        restored->SetWriteAheadLog(&log);
+        restored->SetCell("E1"_pos, "after torn restart");
+        restored->SetWriteAheadLog(nullptr);
+    }
+    sheet.SetCell("E1"_pos, "after torn restart");
+    ASSERT_EQUAL(texts(*recover()), texts(sheet));
+
+    // WriteSnapshot() переименовывает снимок и только потом сбрасывает
+    // журнал; восстанавливаются все состояния файлов на этом пути
+    const auto copy = [](const std::string& from, const std::string& to) {
+        std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing);
+    };
+    copy(snapshot_path, snapshot_path + ".old");
+    {
+        WriteAheadLog log(log_path);
+        sheet.SetWriteAheadLog(&log);
+        sheet.SetCell("F1"_pos, "before snapshot");
+        sheet.SetWriteAheadLog(nullptr);
+        log.Sync();
+        copy(log_path, log_path + ".old");
+        WriteSnapshot(sheet, log, snapshot_path);
+    }
+    // снимок переименован, журнал сброшен
+    ASSERT_EQUAL(texts(*recover()), texts(sheet));
+    // имя нового снимка не дошло до диска, а сброс журнала дошёл: правки
+    // потеряны, и восстановление сообщает об этом
+    copy(snapshot_path, snapshot_path + ".new");
+    copy(snapshot_path + ".old", snapshot_path);
+    bool reported = false;
+    try {
+        recover();
+    }
+    catch (const std::runtime_error&) {
+        reported = true;
+    }
+    ASSERT(reported);
+    // снимок переименован, журнал ещё не сброшен
+    copy(snapshot_path + ".new", snapshot_path);
+    copy(log_path + ".old", log_path);
+    ASSERT_EQUAL(texts(*recover()), texts(sheet));
+    ASSERT_EQUAL(texts(*recover()), texts(sheet));
+    for (const char* suffix : { ".old", ".new" }) {
+        std::filesystem::remove(snapshot_path + suffix);
+        std::filesystem::remove(log_path + suffix);
+    }
+#else
+    try {
+        WriteAheadLog log(log_path);
+        ASSERT(false);
+    }
+    catch (const std::system_error& error) {
+        ASSERT(error.code() == std::errc::function_not_supported);
+    }
+#endif
+
+    std::filesystem::remove(log_path);
+    std::filesystem::remove(snapshot_path);
+}
+
+void TestCommandLog() {
+    auto command = ParseCommand("SET\tB2\t=A1 + 1");
+    ASSERT(command && command->type == Command::Type::Set);
+    ASSERT(command->pos == "B2"_pos);
+    ASSERT_EQUAL(command->text, "=A1 + 1");
+    ASSERT(!command->time);
+
+    command = ParseCommand("1500\tGET\tC3\r");
+    ASSERT(command && command->type == Command::Type::Get);
+    ASSERT(command->pos == "C3"_pos);
+    ASSERT_EQUAL(command->time->count(), 1500);
+    std::ostringstream written;
+    WriteCommand(written, *command);
+    ASSERT_EQUAL(written.str(), "1500\tGET\tC3\n");
+
+    ASSERT(!ParseCommand(""));
+    ASSERT(!ParseCommand("# comment"));
+    for (const char* line : { "PUT\tA1\t1", "GET\tA0", "12x\tGET\tA1", "CLEAR", "\tGET\tA1", "1500\t\tGET" }) {
+        try {
+            ParseCommand(line);
+            ASSERT(false);
+        }
+        catch (const std::invalid_argument&) {
+        }
+    }
+
+    std::istringstream log(
+        "SET\tA1\t2\n"
+        "SET\tA2\t=A1*10\n"
+        "GET\tA2\n"
+        "SET\tA1\t=A2\n"
+        "CLEAR\tA1\n"
+        "GET\tA2\n"
+        "PRINT_VALUES\n");
+    auto sheet = CreateSheet();
+    const ReplayReport report = ReplayCommands(*sheet, log);
+    ASSERT_EQUAL(report.GetCommandCount(), 7u);
+    ASSERT_EQUAL(report.Get(Command::Type::Set).latency.GetCount(), 3u);
+    // цикл отвергнут таблицей и учтён как ошибка
+    ASSERT_EQUAL(report.Get(Command::Type::Set).errors, 1u);
+    ASSERT_EQUAL(report.Get(Command::Type::Get).latency.GetCount(), 2u);
+    ASSERT_EQUAL(report.Get(Command::Type::PrintValues).latency.GetCount(), 1u);
+    ASSERT(sheet->GetCell("A1"_pos) == nullptr || sheet->GetCell("A1"_pos)->GetText().empty());
+    ASSERT(report.GetThroughput() > 0);
+
+    std::istringstream broken("SET\tA1\t1\nGET\n");
+    try {
+        ReplayCommands(*sheet, broken);
+        ASSERT(false);
+    }
+    catch (const std::invalid_argument& error) {
+        ASSERT(std::string_view(error.what()).substr(0, 7) == "line 2:");
+    }
+
+    LatencyHistogram histogram;
+    for (std::uint64_t ns = 1; ns <= 1000; ++ns) {
+        histogram.Record(ns * 1000);
+    }
+    ASSERT_EQUAL(histogram.GetCount(), 1000u);
+    ASSERT_EQUAL(histogram.GetMax(), 1000000u);
+    // корзины дают точность около 1/16
+    for (double quantile : { 0.5, 0.99, 0.999 }) {
+        const double expected = quantile * 1000000;
+        const double actual = static_cast<double>(histogram.GetPercentile(quantile));
+        ASSERT(actual >= expected && actual <= expected * 1.07);
+    }
+    ASSERT_EQUAL(histogram.GetPercentile(1.0), 1000000u);
+    ASSERT_EQUAL(LatencyHistogram().GetPercentile(0.5), 0u);
+}
+
+void TestCommandServer() {
+    Sheet sheet;
+    CommandServer server(sheet);
+    std::string responses;
+    // запросы приходят кусками, строка может оборваться посередине
+    server.Feed("SET\tA1\t2\nSET\tA2\t=A1*", responses);
+    ASSERT_EQUAL(responses, "OK\n");
+    server.Feed("3\nSET\tA3\t=A2+A1\nSET\tA1\t=A3\nGET\tA3\nSET\tB1\ttext\n"
+        "CLEAR\tB1\nGET\tB1\nGET\tZZZZ1\nPRINT_TEXTS\nFOO\n", responses);
+    ASSERT_EQUAL(responses,
+        "OK\n"
+        "OK\n"
+        "OK\n"
+        "ERR\tcircular dependenses\n"
+        "VALUE\t8\n"
+        "OK\n"
+        "OK\n"
+        "VALUE\t\n"
+        "ERR\tinvalid cell ZZZZ1\n"
+        "TABLE\t3\n2\n=A1*3\n=A2+A1\n"
+        "ERR\tunknown command FOO\n");
+    // подряд идущие SET задаются пакетами: A2, A3 и A1 одним, B1 другим
+    ASSERT_EQUAL(server.GetBatchCount(), 3u);
+    ASSERT_EQUAL(server.GetCommandCount(), 11u);
+
+    responses.clear();
+    server.Feed("GET\tA3", responses);
+    ASSERT(responses.empty());
+    server.Finish(responses);
+    ASSERT_EQUAL(responses, "VALUE\t8\n");
+
+    // тот же обмен через дескрипторы
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+    int input[2];
+    int output[2];
+    ASSERT(pipe(input) == 0 && pipe(output) == 0);
+    const std::string requests = "SET\tC1\t=A3*2\nGET\tC1\n";
+    ASSERT(write(input[1], requests.data(), requests.size()) == static_cast<ssize_t>(requests.size()));
+    close(input[1]);
+    server.Serve(input[0], output[1]);
+    close(input[0]);
+    close(output[1]);
+    char buffer[256];
+    const ssize_t count = read(output[0], buffer, sizeof(buffer));
+    close(output[0]);
+    ASSERT_EQUAL(std::string(buffer, std::max<ssize_t>(count, 0)), "OK\nVALUE\t16\n");
+
+    // обычный файл на месте сокета не удаляется
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_test.sock").string();
+    std::ofstream(path) << "data";
+    try {
+        server.ServeUnixSocket(path);
+        ASSERT(false);
+    }
+    catch (const std::system_error& error) {
+        ASSERT(error.code() == std::errc::address_in_use);
+    }
+    ASSERT(std::filesystem::exists(path));
+    std::filesystem::remove(path);
+#else
+    try {
+        server.Serve(0, 1);
+        ASSERT(false);
+    }
+    catch (const std::system_error& error) {
+        ASSERT(error.code() == std::errc::function_not_supported);
+    }
+#endif
+}
+
+void TestTracer() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+#ifdef SPREADSHEET_ENABLE_TRACE
+    auto has_span = [](const std::vector<Tracer::Span>& spans, std::string_view name, Position pos) {
+        return std::any_of(spans.begin(), spans.end(), [&](const Tracer::Span& span) {
+            return span.name == name && span.pos == pos && !(span.end < span.start);
+        });
+    };
+
+    sheet.GetTracer().Start();
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.GetCell("A2"_pos)->GetValue();
+    sheet.InsertRows(0);
+    sheet.GetCell("A2"_pos)->GetValue();
+    sheet.SetCell("A2"_pos, "5");
+    sheet.GetCell("A3"_pos)->GetValue();
+    sheet.GetTracer().Stop();
+    sheet.SetCell("B1"_pos, "=A2");
+
+    std::vector<Tracer::Span> spans = sheet.GetTracer().GetSpans();
+    ASSERT(has_span(spans, "SetCell", "A2"_pos));
+    ASSERT(has_span(spans, "parse", "A2"_pos));
+    ASSERT(has_span(spans, "cycle check", "A2"_pos));
+    ASSERT(has_span(spans, "dependency rewire", "A2"_pos));
+    ASSERT(has_span(spans, "invalidation", "A2"_pos));
+    ASSERT(has_span(spans, "evaluate", "A2"_pos));
+    // после вставки строки формула вычисляется уже в A3
+    ASSERT(has_span(spans, "evaluate", "A3"_pos));
+    ASSERT(!has_span(spans, "SetCell", "B1"_pos));
+
+    std::ostringstream trace;
+    sheet.GetTracer().WriteChromeTrace(trace);
+    ASSERT(trace.str().find("\"name\":\"evaluate\",\"cat\":\"sheet\",\"ph\":\"X\"") != std::string::npos);
+    ASSERT(trace.str().find("\"args\":{\"cell\":\"A3\"}") != std::string::npos);
+
+    // буфер хранит последние интервалы, разбор в потоках попадает в свои буферы
+    sheet.GetTracer().Start(4);
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 1000; ++row) {
+        cells.emplace_back(Position{ row, 3 }, "=A1+" + std::to_string(row));
+    }
+    sheet.SetCells(std::move(cells), 4);
+    sheet.GetTracer().Stop();
+    spans = sheet.GetTracer().GetSpans();
+    ASSERT(spans.size() >= 4 && spans.size() <= 16);
+    ASSERT(has_span(spans, "SetCells", Position::NONE));
+
+    // перезапуск не трогает буферы пишущих потоков, они начинают их заново сами
+    {
+        Tracer tracer;
+        tracer.Start();
+        std::atomic<bool> done{ false };
+        std::thread writer([&] {
+            for (int i = 0; !done.load(); ++i) {
+                TraceScope scope(tracer, "writer", Position{ i % Position::MAX_ROWS, 0 });
+            }
+        });
+        for (int i = 0; i < 100; ++i) {
+            tracer.Start(8);
+        }
+        done = true;
+        writer.join();
+        tracer.Stop();
+        spans = tracer.GetSpans();
+        ASSERT(spans.size() <= 8u);
+        tracer.Start();
+        ASSERT(tracer.GetSpans().empty());
+    }
+#else
+    sheet.GetTracer().Start();
+    sheet.SetCell("A2"_pos, "=A1+1");
+    ASSERT(sheet.GetTracer().GetSpans().empty());
+#endif
+}
+
+// Режим сервера: spreadsheet --serve [--socket PATH], см. CommandServer.
+// Без --socket запросы читаются из stdin, ответы пишутся в stdout.
+int RunServer(int argc, char** argv) {
+    std::string socket_path;
+    for (int i = 2; i < argc; ++i) {
+        if (std::string_view(argv[i]) == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " --serve [--socket PATH]" << std::endl;
+            return 2;
+        }
+    }
+
+    Sheet sheet;
+    CommandServer server(sheet);
+    try {
+        if (socket_path.empty()) {
+            server.Serve(0, 1);  // stdin и stdout
+        }
+        else {
+            server.ServeUnixSocket(socket_path);
+        }
+    }
+    catch (const std::exception& error) {
+        std::cerr << error.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && std::string_view(argv[1]) == "--serve") {
+        return RunServer(argc, argv);
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestErrorPosition);
     RUN_TEST(tr, TestValue);
     RUN_TEST(tr, TestFormulaException);
     RUN_TEST(tr, TestSheetSize);
+    RUN_TEST(tr, TestFormulaExpression);
+    RUN_TEST(tr, TestReferencedCells);
+    RUN_TEST(tr, TestSetCellReuse);
+    RUN_TEST(tr, TestDeepChain);
+    RUN_TEST(tr, TestErrorPropagation);
+    RUN_TEST(tr, TestColumnBatchedEvaluation);
+    RUN_TEST(tr, TestJitFormula);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestNumberColumns);
+    RUN_TEST(tr, TestNumberPaging);
+    RUN_TEST(tr, TestBulkLoad);
+    RUN_TEST(tr, TestLookup);
+    RUN_TEST(tr, TestConditional);
+    RUN_TEST(tr, TestInsertDelete);
+    RUN_TEST(tr, TestFillRange);
+    RUN_TEST(tr, TestUndoRedo);
+    RUN_TEST(tr, TestWorkbookGenerator);
+    RUN_TEST(tr, TestStats);
+    RUN_TEST(tr, TestTracer);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestWriteAheadLog);
+    RUN_TEST(tr, TestCommandLog);
+    RUN_TEST(tr, TestCommandServer);
+    RUN_TEST(tr, TestIncrementalRecalc);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+
+// Память таблицы по подсистемам в байтах, см. Sheet::GetMemoryUsage().
+// Учитываются выделенные объекты и ёмкости контейнеров; служебные заголовки
+// распределителя памяти не учитываются, узлы хеш-таблиц оцениваются.
+struct SheetMemoryUsage {
+    // векторы cells_ и объекты Cell без места под кэш значения
+    std::size_t cells = 0;
+    // объекты содержимого ячеек и пул строк с текстами
+    std::size_t contents = 0;
+    // место под кэш значений в ячейках; оно есть у каждой ячейки, поэтому
+    // не зависит от того, сколько формул вычислено
+    std::size_t cached_values = 0;
+    // программы формул и списки ссылок, без скомпилированного кода
+    std::size_t formulas = 0;
+    // индекс зависимых ячеек и формул с диапазонами функций поиска
+    std::size_t dependencies = 0;
+    // столбцы числовых ячеек и выданные для них представления
+    std::size_t numbers = 0;
+    // история правок
+    std::size_t journal = 0;
+
+    std::size_t Total() const {
+        return cells + contents + cached_values + formulas + dependencies + numbers + journal;
+    }
+};
+
+// Оценка памяти узловой хеш-таблицы (unordered_map, unordered_set): массив
+// корзин и узлы со значением, указателем на следующий узел и хешем
+template <typename Table>
+std::size_t GetHashTableMemoryUsage(const Table& table) {
+    return table.bucket_count() * sizeof(void*)
+        + table.size() * (sizeof(typename Table::value_type) + 2 * sizeof(void*));
+}
@@ -0,0 +1,435 @@
+#include "number_columns.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <limits>
+#include <system_error>
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    constexpr std::uint32_t NO_PAGE = std::numeric_limits<std::uint32_t>::max();
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+    [[noreturn]] void ThrowError(const std::string& what) {
+        throw std::system_error(errno, std::generic_category(), what);
+    }
+
+    // Создаёт файл подкачки заново и сразу удаляет его из каталога: файл
+    // нужен только этому процессу и не должен его пережить
+    int OpenSpillFile(const std::string& path) {
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            ThrowError("open " + path);
+        }
+        ::unlink(path.c_str());
+        return fd;
+    }
+
+    void CloseSpillFile(int fd) {
+        ::close(fd);
+    }
+
+    void ReadAt(int fd, void* data, std::size_t bytes, std::int64_t offset) {
+        std::size_t done = 0;
+        while (done < bytes) {
+            const ssize_t count = ::pread(fd, static_cast<char*>(data) + done, bytes - done, offset + done);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                if (count == 0) {
+                    errno = EIO;
+                }
+                ThrowError("read number page");
+            }
+            done += count;
+        }
+    }
+
+    void WriteAt(int fd, const void* data, std::size_t bytes, std::int64_t offset) {
+        std::size_t done = 0;
+        while (done < bytes) {
+            const ssize_t count = ::pwrite(fd, static_cast<const char*>(data) + done, bytes - done, offset + done);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ThrowError("write number page");
+            }
+            done += count;
+        }
+    }
+#else
+    [[noreturn]] void ThrowUnsupported(const std::string& what) {
+        throw std::system_error(std::make_error_code(std::errc::function_not_supported), what);
+    }
+
+    // Без POSIX подкачка не включается, и остальные функции недостижимы
+    int OpenSpillFile(const std::string& path) {
+        ThrowUnsupported("open " + path);
+    }
+
+    void CloseSpillFile(int) {
+    }
+
+    void ReadAt(int, void*, std::size_t, std::int64_t) {
+        ThrowUnsupported("read number page");
+    }
+
+    void WriteAt(int, const void*, std::size_t, std::int64_t) {
+        ThrowUnsupported("write number page");
+    }
+#endif
+}  // namespace
+
+NumberColumns::~NumberColumns() {
+    if (spill_fd_ >= 0) {
+        CloseSpillFile(spill_fd_);
+    }
+}
+
+std::optional<double> NumberColumns::Parse(std::string_view text) {
+    if (text.empty()) {
+        return std::nullopt;
+    }
+
+    double value = 0.0;
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (error != std::errc{} || end != text.data() + text.size() || !std::isfinite(value)) {
+        return std::nullopt;
+    }
+
+    // "1.50", "1e3" и подобные записи остаются текстом, иначе GetText()
+    // вернул бы не то, что было задано
+    if (Format(value) != text) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::string NumberColumns::Format(double value) {
+    char buffer[MAX_FORMAT_SIZE];
+    return std::string(Format(value, buffer));
+}
+
+std::string_view NumberColumns::Format(double value, char (&buffer)[MAX_FORMAT_SIZE]) {
+    auto [end, error] = std::to_chars(buffer, buffer + MAX_FORMAT_SIZE, value);
+    return std::string_view(buffer, end - buffer);
+}
+
+void NumberColumns::Set(Position pos, double value) {
+    if (static_cast<std::size_t>(pos.col) >= columns_.size()) {
+        const std::size_t capacity = columns_.capacity();
+        columns_.resize(pos.col + 1);
+        TrackCapacity(columns_, capacity);
+    }
+
+    Column& column = columns_[pos.col];
+    const std::size_t row = pos.row;
+    if (row / WORD_BITS >= column.valid.size()) {
+        const std::size_t capacity = column.valid.capacity();
+        column.valid.resize(row / WORD_BITS + 1);
+        TrackCapacity(column.valid, capacity);
+    }
+
+    std::uint64_t bit = std::uint64_t{1} << (row % WORD_BITS);
+    if (!(column.valid[row / WORD_BITS] & bit)) {
+        column.valid[row / WORD_BITS] |= bit;
+        ++count_;
+    }
+    Store(column, row, value);
+}
+
+bool NumberColumns::Erase(Position pos) {
+    if (!Contains(pos)) {
+        return false;
+    }
+    columns_[pos.col].valid[pos.row / WORD_BITS] &= ~(std::uint64_t{1} << (pos.row % WORD_BITS));
+    --count_;
+    return true;
+}
+
+// Столбцы переставляются целиком, их страницы не читаются. При сдвиге строк
+// каждый столбец собирается заново по установленным битам маски.
+void NumberColumns::Shift(const PositionShift& shift) {
+    auto count_valid = [](const Column& column) {
+        std::size_t count = 0;
+        for (std::uint64_t word : column.valid) {
+            count += PopCount(word);
+        }
+        return count;
+    };
+
+    if (shift.axis == PositionShift::Axis::Cols) {
+        std::vector<Column> columns;
+        for (std::size_t col = 0; col < columns_.size(); ++col) {
+            Position moved = shift.Apply({ 0, static_cast<int>(col) });
+            if (!moved.IsValid()) {
+                count_ -= count_valid(columns_[col]);
+                ReleaseColumn(columns_[col]);
+                continue;
+            }
+            if (static_cast<std::size_t>(moved.col) >= columns.size()) {
+                columns.resize(moved.col + 1);
+            }
+            columns[moved.col] = std::move(columns_[col]);
+        }
+        const std::size_t capacity = columns_.capacity();
+        columns_ = std::move(columns);
+        TrackCapacity(columns_, capacity);
+        return;
+    }
+
+    std::vector<std::pair<std::size_t, double>> moved;
+    for (auto& column : columns_) {
+        moved.clear();
+        for (std::size_t word = 0; word < column.valid.size(); ++word) {
+            for (std::uint64_t bits = column.valid[word]; bits != 0; bits &= bits - 1) {
+                const std::size_t row = word * WORD_BITS + LowestSetBit(bits);
+                const int moved_row = shift.Apply({ static_cast<int>(row), 0 }).row;
+                if (moved_row < 0) {
+                    --count_;
+                    continue;
+                }
+                moved.emplace_back(moved_row, GetPageValues(column.pages[row / PAGE_ROWS])[row % PAGE_ROWS]);
+            }
+        }
+
+        ReleaseColumn(column);
+        for (const auto& [row, value] : moved) {
+            if (row / WORD_BITS >= column.valid.size()) {
+                const std::size_t capacity = column.valid.capacity();
+                column.valid.resize(row / WORD_BITS + 1);
+                TrackCapacity(column.valid, capacity);
+            }
+            column.valid[row / WORD_BITS] |= std::uint64_t{1} << (row % WORD_BITS);
+            Store(column, row, value);
+        }
+    }
+}
+
+Size NumberColumns::GetBounds() const {
+    Size size;
+    for (std::size_t col = 0; col < columns_.size(); ++col) {
+        const auto& valid = columns_[col].valid;
+        auto last = std::find_if(valid.rbegin(), valid.rend(), [](std::uint64_t word) { return word != 0; });
+        if (last == valid.rend()) {
+            continue;
+        }
+
+        std::size_t word = valid.rend() - last - 1;
+        int row = static_cast<int>(word * WORD_BITS) + HighestSetBit(*last);
+        size.rows = std::max(size.rows, row + 1);
+        size.cols = static_cast<int>(col) + 1;
+    }
+    return size;
+}
+
+std::size_t NumberColumns::CountMemoryUsage() const {
+    std::size_t bytes = columns_.capacity() * sizeof(Column) + pages_.capacity() * sizeof(Page)
+        + free_pages_.capacity() * sizeof(PageId) + free_offsets_.capacity() * sizeof(std::int64_t);
+    for (const auto& column : columns_) {
+        bytes += column.pages.capacity() * sizeof(PageId);
+        bytes += column.valid.capacity() * sizeof(std::uint64_t);
+    }
+    for (const auto& page : pages_) {
+        bytes += page.values.capacity() * sizeof(double);
+    }
+    return bytes;
+}
+
+void NumberColumns::SetPaging(const std::string& spill_path, std::size_t memory_budget) {
+    if (spill_fd_ >= 0) {
+        // вытесненные страницы возвращаются в память, пока файл открыт
+        max_resident_pages_ = std::numeric_limits<std::size_t>::max();
+        for (PageId id = 0; id < pages_.size(); ++id) {
+            if (!pages_[id].resident && pages_[id].spill_offset >= 0) {
+                LoadPage(id);
+            }
+        }
+        for (auto& page : pages_) {
+            page.spill_offset = -1;
+            page.dirty = true;
+        }
+        CloseSpillFile(spill_fd_);
+        spill_fd_ = -1;
+        free_offsets_.clear();
+        spill_size_ = 0;
+    }
+    if (memory_budget == 0) {
+        return;
+    }
+
+    spill_fd_ = OpenSpillFile(spill_path);
+    max_resident_pages_ = std::max<std::size_t>(memory_budget / PAGE_BYTES, 2);
+    faults_ = 0;
+    writes_ = 0;
+    while (resident_pages_ > max_resident_pages_) {
+        ReserveResidentPage();
+    }
+}
+
+NumberColumns::PagingStats NumberColumns::GetPagingStats() const {
+    PagingStats stats;
+    for (const auto& page : pages_) {
+        if (page.resident) {
+            ++stats.resident_pages;
+        }
+        else if (page.spill_offset >= 0) {
+            ++stats.spilled_pages;
+        }
+    }
+    stats.faults = faults_;
+    stats.writes = writes_;
+    return stats;
+}
+
+void NumberColumns::LoadPage(PageId id) const {
+    ReserveResidentPage();
+    Page& page = pages_[id];
+    const std::size_t capacity = page.values.capacity();
+    page.values.resize(page.size);
+    try {
+        ReadAt(spill_fd_, page.values.data(), page.size * sizeof(double), page.spill_offset);
+    }
+    catch (...) {
+        page.values.clear();
+        page.values.shrink_to_fit();
+        TrackCapacity(page.values, capacity);
+        throw;
+    }
+    TrackCapacity(page.values, capacity);
+    page.resident = true;
+    page.dirty = false;
+    ++resident_pages_;
+    ++faults_;
+}
+
+// Алгоритм часов: стрелка обходит страницы в памяти и вытесняет первую, к
+// которой не обращались с прошлого прохода, снимая отметки обращения с
+// остальных
+void NumberColumns::ReserveResidentPage() const {
+    if (spill_fd_ < 0 || resident_pages_ < max_resident_pages_) {
+        return;
+    }
+    for (;;) {
+        if (clock_hand_ >= pages_.size()) {
+            clock_hand_ = 0;
+        }
+        const PageId id = clock_hand_++;
+        Page& page = pages_[id];
+        if (!page.resident) {
+            continue;
+        }
+        if (page.referenced) {
+            page.referenced = false;
+            continue;
+        }
+        EvictPage(id);
+        return;
+    }
+}
+
+void NumberColumns::EvictPage(PageId id) const {
+    Page& page = pages_[id];
+    if (page.dirty || page.spill_offset < 0) {
+        if (page.spill_offset < 0) {
+            if (!free_offsets_.empty()) {
+                page.spill_offset = free_offsets_.back();
+                free_offsets_.pop_back();
+            }
+            else {
+                page.spill_offset = spill_size_;
+                spill_size_ += PAGE_BYTES;
+            }
+        }
+        WriteAt(spill_fd_, page.values.data(), page.values.size() * sizeof(double), page.spill_offset);
+        ++writes_;
+    }
+    page.size = static_cast<std::uint32_t>(page.values.size());
+    const std::size_t capacity = page.values.capacity();
+    page.values.clear();
+    page.values.shrink_to_fit();
+    TrackCapacity(page.values, capacity);
+    page.resident = false;
+    page.dirty = false;
+    --resident_pages_;
+}
+
+NumberColumns::PageId NumberColumns::AllocatePage() {
+    ReserveResidentPage();
+    PageId id;
+    if (!free_pages_.empty()) {
+        id = free_pages_.back();
+        free_pages_.pop_back();
+    }
+    else {
+        id = static_cast<PageId>(pages_.size());
+        const std::size_t capacity = pages_.capacity();
+        pages_.emplace_back();
+        TrackCapacity(pages_, capacity);
+    }
+    Page& page = pages_[id];
+    page.resident = true;
+    page.referenced = true;
+    page.dirty = true;
+    ++resident_pages_;
+    return id;
+}
+
+void NumberColumns::FreePage(PageId id) {
+    Page& page = pages_[id];
+    if (page.resident) {
+        --resident_pages_;
+    }
+    if (page.spill_offset >= 0) {
+        const std::size_t capacity = free_offsets_.capacity();
+        free_offsets_.push_back(page.spill_offset);
+        TrackCapacity(free_offsets_, capacity);
+    }
+    memory_ -= page.values.capacity() * sizeof(double);
+    page = Page{};
+    const std::size_t capacity = free_pages_.capacity();
+    free_pages_.push_back(id);
+    TrackCapacity(free_pages_, capacity);
+}
+
+void NumberColumns::ReleaseColumn(Column& column) {
+    for (PageId id : column.pages) {
+        if (id != NO_PAGE) {
+            FreePage(id);
+        }
+    }
+    memory_ -= column.pages.capacity() * sizeof(PageId) + column.valid.capacity() * sizeof(std::uint64_t);
+    column = Column{};
+}
+
+void NumberColumns::Store(Column& column, std::size_t row, double value) {
+    const std::size_t index = row / PAGE_ROWS;
+    if (index >= column.pages.size()) {
+        const std::size_t capacity = column.pages.capacity();
+        column.pages.resize(index + 1, NO_PAGE);
+        TrackCapacity(column.pages, capacity);
+    }
+    if (column.pages[index] == NO_PAGE) {
+        column.pages[index] = AllocatePage();
+    }
+
+    const PageId id = column.pages[index];
+    GetPageValues(id);
+    Page& page = pages_[id];
+    const std::size_t offset = row % PAGE_ROWS;
+    if (offset >= page.values.size()) {
+        const std::size_t capacity = page.values.capacity();
+        page.values.resize(offset + 1);
+        TrackCapacity(page.values, capacity);
+    }
+    page.values[offset] = value;
+    page.dirty = true;
+}
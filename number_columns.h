@@ -0,0 +1,221 @@
+#pragma once
+
+#include "bit_ops.h"
+#include "common.h"
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Плотное хранение числовых ячеек. Для каждого столбца заводятся страницы по
+// PAGE_ROWS значений double и битовая маска занятых строк, поэтому числовая
+// ячейка занимает около 8 байт вместо объекта Cell с реализацией и кэшем в
+// куче. Числом считается только текст в канонической записи
+// (Format(Parse(text)) == text), так что исходный текст ячейки
+// восстанавливается из значения без потерь.
+//
+// Со SetPaging() страницы значений не держатся в памяти все сразу: сверх
+// бюджета давно не использованные страницы (алгоритм часов, приближение LRU)
+// записываются в файл подкачки и читаются обратно при обращении. Маски
+// занятых строк всегда остаются в памяти, поэтому Contains(), GetBounds() и
+// обходы пустых областей не читают файл. Подкачка касается только чисел:
+// ячейки с текстом и формулами таблица хранит в памяти всегда.
+class NumberColumns {
+public:
+    // Строк в странице значений: 4 КиБ
+    static constexpr std::size_t PAGE_ROWS = 512;
+
+    // Счётчики подкачки с момента SetPaging()
+    struct PagingStats {
+        std::size_t resident_pages = 0;
+        std::size_t spilled_pages = 0;
+        // чтения страниц из файла и записи в файл
+        std::uint64_t faults = 0;
+        std::uint64_t writes = 0;
+    };
+
+    NumberColumns() = default;
+    NumberColumns(const NumberColumns&) = delete;
+    NumberColumns& operator=(const NumberColumns&) = delete;
+    ~NumberColumns();
+
+    // Возвращает число, если text - конечное число в канонической записи
+    static std::optional<double> Parse(std::string_view text);
+    // Кратчайшая запись числа, которая читается обратно в то же значение
+    static std::string Format(double value);
+    // Самая длинная такая запись, "-2.2250738585072014e-308"
+    static constexpr std::size_t MAX_FORMAT_SIZE = 24;
+    // Format() без выделения памяти: запись кладётся в buffer
+    static std::string_view Format(double value, char (&buffer)[MAX_FORMAT_SIZE]);
+
+    bool Contains(Position pos) const {
+        if (static_cast<std::size_t>(pos.col) >= columns_.size()) {
+            return false;
+        }
+        const Column& column = columns_[pos.col];
+        std::size_t word = static_cast<std::size_t>(pos.row) / WORD_BITS;
+        return word < column.valid.size() && (column.valid[word] >> (pos.row % WORD_BITS)) & 1;
+    }
+
+    // Возвращает указатель на значение или nullptr, если ячейка не числовая.
+    // При подкачке указатель действителен только до следующего обращения к
+    // столбцам: оно может вытеснить его страницу.
+    const double* Find(Position pos) const {
+        if (!Contains(pos)) {
+            return nullptr;
+        }
+        const std::size_t row = pos.row;
+        return &GetPageValues(columns_[pos.col].pages[row / PAGE_ROWS])[row % PAGE_ROWS];
+    }
+
+    void Set(Position pos, double value);
+    // Возвращает false, если числа в ячейке не было
+    bool Erase(Position pos);
+
+    // Переносит числа при вставке или удалении строк либо столбцов таблицы
+    void Shift(const PositionShift& shift);
+
+    // Ограничивающий прямоугольник всех числовых ячеек
+    Size GetBounds() const;
+
+    std::size_t GetCount() const {
+        return count_;
+    }
+
+    // Включает подкачку: в памяти остаётся не больше memory_budget байт
+    // страниц значений (но не меньше двух страниц), остальные уходят в файл
+    // spill_path. Файл создаётся заново и удаляется из каталога сразу после
+    // открытия. Нулевой бюджет выключает подкачку и читает все страницы
+    // обратно. Бросает std::system_error, если файл не открывается, а без
+    // POSIX (см. platform.h) - при любом ненулевом бюджете.
+    void SetPaging(const std::string& spill_path, std::size_t memory_budget);
+    bool IsPaging() const {
+        return spill_fd_ >= 0;
+    }
+    PagingStats GetPagingStats() const;
+
+    // Вызывает function(pos, value) для каждой числовой ячейки по столбцам
+    template <typename Function>
+    void ForEach(Function function) const {
+        for (std::size_t col = 0; col < columns_.size(); ++col) {
+            const Column& column = columns_[col];
+            for (std::size_t word = 0; word < column.valid.size(); ++word) {
+                for (std::uint64_t bits = column.valid[word]; bits != 0; bits &= bits - 1) {
+                    const std::size_t row = word * WORD_BITS + LowestSetBit(bits);
+                    const double value = GetPageValues(column.pages[row / PAGE_ROWS])[row % PAGE_ROWS];
+                    function(Position{ static_cast<int>(row), static_cast<int>(col) }, value);
+                }
+            }
+        }
+    }
+    // Память столбцов без вытесненных страниц. Счётчик ведётся при каждом
+    // изменении ёмкости векторов, так что вызов не обходит страницы.
+    std::size_t GetMemoryUsage() const {
+        return memory_;
+    }
+    // То же значение, пересчитанное обходом столбцов и страниц, для проверки
+    // счётчика
+    std::size_t CountMemoryUsage() const;
+
+private:
+    static constexpr std::size_t WORD_BITS = 64;
+    static constexpr std::size_t PAGE_BYTES = PAGE_ROWS * sizeof(double);
+    using PageId = std::uint32_t;
+
+    struct Page {
+        // Значения до последней записанной строки страницы. У вытесненной
+        // страницы пусты, а size хранит их число в файле.
+        std::vector<double> values;
+        std::uint32_t size = 0;
+        bool resident = false;
+        // место страницы в файле подкачки, -1 - ещё не записывалась
+        std::int64_t spill_offset = -1;
+        // обращение после прошлого прохода стрелки часов
+        bool referenced = false;
+        // значения изменились после записи в файл
+        bool dirty = false;
+    };
+
+    struct Column {
+        // страница для каждых PAGE_ROWS строк до последней занятой
+        std::vector<PageId> pages;
+        std::vector<std::uint64_t> valid;
+    };
+
+    const double* GetPageValues(PageId id) const {
+        Page& page = pages_[id];
+        if (!page.resident) {
+            LoadPage(id);
+        }
+        page.referenced = true;
+        return page.values.data();
+    }
+    // Читает страницу из файла, при необходимости вытеснив другую
+    void LoadPage(PageId id) const;
+    // Освобождает место под ещё одну страницу в памяти
+    void ReserveResidentPage() const;
+    void EvictPage(PageId id) const;
+    PageId AllocatePage();
+    void FreePage(PageId id);
+    // Освобождает страницы и маску столбца
+    void ReleaseColumn(Column& column);
+    // Записывает значение, не меняя маску и счётчик
+    void Store(Column& column, std::size_t row, double value);
+    // Переносит в memory_ изменение ёмкости vector с прежней capacity
+    template <typename T>
+    void TrackCapacity(const std::vector<T>& vector, std::size_t capacity) const {
+        memory_ = memory_ - capacity * sizeof(T) + vector.capacity() * sizeof(T);
+    }
+
+    std::vector<Column> columns_;
+    std::size_t count_ = 0;
+    // Байты всех векторов, см. GetMemoryUsage()
+    mutable std::size_t memory_ = 0;
+
+    mutable std::vector<Page> pages_;
+    std::vector<PageId> free_pages_;
+    // Подкачка включена, пока файл открыт
+    int spill_fd_ = -1;
+    mutable std::vector<std::int64_t> free_offsets_;
+    mutable std::int64_t spill_size_ = 0;
+    std::size_t max_resident_pages_ = 0;
+    mutable std::size_t resident_pages_ = 0;
+    mutable std::size_t clock_hand_ = 0;
+    mutable std::uint64_t faults_ = 0;
+    mutable std::uint64_t writes_ = 0;
+};
+
+// Представление числовой ячейки для доступа через CellInterface. Создаётся
+// таблицей по требованию в GetCell(), при вычислении формул не используется.
+// Текст хранится в самом объекте, без отдельного выделения памяти.
+class NumberCell : public CellInterface {
+public:
+    explicit NumberCell(double value)
+        : size_(static_cast<std::uint8_t>(NumberColumns::Format(value, text_).size())) {}
+
+    // Как и у любой текстовой ячейки, значение - исходный текст
+    Value GetValue() const override {
+        return GetText();
+    }
+    ValueView GetValueView() const override {
+        return std::string_view(text_, size_);
+    }
+    std::string GetText() const override {
+        return std::string(text_, size_);
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return {};
+    }
+    PositionSpan GetReferencedCellsView() const override {
+        return {};
+    }
+
+private:
+    char text_[NumberColumns::MAX_FORMAT_SIZE];
+    std::uint8_t size_;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Отдельный объект T для каждого потока, который к нему обращается. Поток
+// находит свой объект через thread_local кэш на одну запись, без блокировки;
+// мьютекс берётся только при промахе кэша. Объект завершившегося потока не
+// удаляется, а со всем содержимым переходит к следующему новому потоку, так
+// что объектов не больше, чем потоков, одновременно обращавшихся к PerThread.
+// Объекты перебираются в порядке создания.
+template <typename T>
+class PerThread {
+public:
+    PerThread()
+        : id_(next_id_.fetch_add(1, std::memory_order_relaxed))
+        , state_(std::make_shared<State>()) {
+    }
+    PerThread(const PerThread&) = delete;
+    PerThread& operator=(const PerThread&) = delete;
+
+    T& Get() {
+        if (cache_.id != id_) {
+            cache_ = { id_, &Find() };
+        }
+        return *cache_.value;
+    }
+
+    // Обходит объекты всех потоков. Объекты других потоков могут меняться
+    // во время обхода, если T это допускает.
+    template <typename Function>
+    void ForEach(Function function) const {
+        std::lock_guard lock(state_->mutex);
+        for (const auto& value : state_->values) {
+            function(static_cast<const T&>(*value));
+        }
+    }
+    template <typename Function>
+    void ForEach(Function function) {
+        std::lock_guard lock(state_->mutex);
+        for (auto& value : state_->values) {
+            function(*value);
+        }
+    }
+
+private:
+    // Хуки завершения потока держат его слабой ссылкой, поэтому состояние
+    // умирает вместе с PerThread
+    struct State {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<T>> values;
+        // номер объекта каждого живого потока
+        std::unordered_map<std::thread::id, std::size_t> owners;
+        // объекты завершившихся потоков
+        std::vector<std::size_t> released;
+    };
+
+    struct Cache {
+        std::uint64_t id = 0;
+        T* value = nullptr;
+    };
+
+    // При завершении потока освобождает его объекты во всех ещё живых
+    // PerThread этого типа
+    struct ExitHooks {
+        std::vector<std::weak_ptr<State>> states;
+
+        ~ExitHooks() {
+            const std::thread::id thread = std::this_thread::get_id();
+            for (const auto& weak : states) {
+                if (const std::shared_ptr<State> state = weak.lock()) {
+                    std::lock_guard lock(state->mutex);
+                    if (auto owner = state->owners.find(thread); owner != state->owners.end()) {
+                        state->released.push_back(owner->second);
+                        state->owners.erase(owner);
+                    }
+                }
+            }
+        }
+    };
+
+    T& Find() {
+        State& state = *state_;
+        std::lock_guard lock(state.mutex);
+        const std::thread::id thread = std::this_thread::get_id();
+        if (auto owner = state.owners.find(thread); owner != state.owners.end()) {
+            return *state.values[owner->second];
+        }
+
+        std::size_t index = state.values.size();
+        if (state.released.empty()) {
+            state.values.push_back(std::make_unique<T>());
+        }
+        else {
+            index = state.released.back();
+            state.released.pop_back();
+        }
+        state.owners.emplace(thread, index);
+
+        // ссылки на удалённые PerThread отбрасываются, чтобы хуки долгого
+        // потока не росли с каждой новой таблицей
+        auto& hooks = exit_hooks_.states;
+        hooks.erase(std::remove_if(hooks.begin(), hooks.end(), [](const std::weak_ptr<State>& weak) {
+            return weak.expired();
+        }), hooks.end());
+        hooks.push_back(state_);
+        return *state.values[index];
+    }
+
+    // номер отличает объекты разных PerThread, даже если новый создан по
+    // адресу удалённого
+    const std::uint64_t id_;
+    std::shared_ptr<State> state_;
+
+    static inline std::atomic<std::uint64_t> next_id_{ 1 };
+    static inline thread_local Cache cache_;
+    static inline thread_local ExitHooks exit_hooks_;
+};
@@ -0,0 +1,9 @@
+#pragma once
+
+// Файлы через дескрипторы (open, pread, fdatasync) и сокеты Unix есть только
+// на POSIX-системах. Без них части, которым они нужны, собираются без
+// реализации и при включении бросают std::system_error с кодом
+// std::errc::function_not_supported.
+#if defined(__unix__) || defined(__APPLE__)
+#define SPREADSHEET_POSIX_AVAILABLE
+#endif
@@ -1,114 +1,740 @@
 #include "sheet.h"
 
+#include "column_evaluator.h"
 #include "common.h"
+#include "write_ahead_log.h"
 
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <optional>
 #include <stack>
+#include <thread>
 
 
 using namespace std::literals;
 
+namespace {
+    // Числа сравниваются побитово: 0 и -0 по-разному влияют на зависимые ячейки
+    bool IsSameValue(const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+        if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+            double lhs_number = std::get<double>(lhs);
+            double rhs_number = std::get<double>(rhs);
+            return std::memcmp(&lhs_number, &rhs_number, sizeof(double)) == 0;
+        }
+        return lhs == rhs;
+    }
+
+    // Память множества зависимых ячеек без самого объекта, который лежит в
+    // узле внешней таблицы. Пустые множества удаляются из индекса, поэтому
+    // считаются нулевыми.
+    std::size_t GetDependantsMemoryUsage(const std::unordered_set<Position, PositionHasher>& dependants) {
+        return dependants.empty() ? 0 : GetHashTableMemoryUsage(dependants);
+    }
+}  // namespace
+
 Sheet::~Sheet() {}
 
 void Sheet::SetCell(Position pos, std::string text) {
     IsPositionValid(pos);
+    TraceScope trace(tracer_, "SetCell", pos);
+
+    // повторная запись того же текста ничего не меняет
+    Cell* cell = GetConcreteCell(pos);
+    if (cell && cell->GetText() == text) {
+        return;
+    }
+
+    // числа в канонической записи хранятся по столбцам, без объекта ячейки
+    if (std::optional<double> number = NumberColumns::Parse(text)) {
+        SetNumber(pos, *number);
+        return;
+    }
+
+    Cell::Content content = ParseCell(pos, text);
+    CommitCell(pos, std::move(content), text);
+}
+
+Cell::Content Sheet::ParseCell(Position pos, std::string text) {
+    if (!Cell::IsFormulaText(text)) {
+        return Cell::Parse(std::move(text), string_pool_);
+    }
+    TraceScope trace(tracer_, "parse", pos);
+    StatsTimer timer(stats_, StatsCounters::ParseNs);
+    stats_.Add(StatsCounters::FormulasParsed, 1);
+    return Cell::Parse(std::move(text), string_pool_);
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells, unsigned threads) {
+    TraceScope trace(tracer_, "SetCells");
+    CommitCells(std::move(cells), threads, nullptr);
+}
+
+std::vector<std::exception_ptr> Sheet::TrySetCells(std::vector<std::pair<Position, std::string>> cells,
+    unsigned threads) {
+    TraceScope trace(tracer_, "SetCells");
+    std::vector<std::exception_ptr> failures(cells.size());
+    CommitCells(std::move(cells), threads, &failures);
+    return failures;
+}
 
-    auto cell = std::make_unique<Cell>(*this);
-    cell->Set(text);
+void Sheet::CommitCells(std::vector<std::pair<Position, std::string>> cells, unsigned threads,
+    std::vector<std::exception_ptr>* failures) {
+    Journal::Batch batch(journal_);
+    std::vector<std::optional<Cell::Content>> formulas(cells.size());
+    std::vector<std::exception_ptr> errors(cells.size());
+    ParseFormulas(cells, formulas, errors, threads);
+
+    auto commit = [&](std::size_t i) {
+        auto& [pos, text] = cells[i];
+        if (!formulas[i] && !errors[i]) {
+            SetCell(pos, std::move(text));
+            return;
+        }
+
+        IsPositionValid(pos);
+        const Cell* cell = GetConcreteCell(pos);
+        if (cell && cell->GetText() == text) {
+            return;
+        }
+        if (errors[i]) {
+            std::rethrow_exception(errors[i]);
+        }
+        CommitCell(pos, std::move(*formulas[i]), text);
+    };
+
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        if (!failures) {
+            commit(i);
+            continue;
+        }
+        try {
+            commit(i);
+        }
+        catch (...) {
+            (*failures)[i] = std::current_exception();
+        }
+    }
+}
+
+// Формулы раздаются потокам пула блоками по мере освобождения потоков, а
+// результат пишется по индексу ячейки, сохраняя порядок.
+void Sheet::ParseFormulas(const std::vector<std::pair<Position, std::string>>& cells,
+    std::vector<std::optional<Cell::Content>>& formulas, std::vector<std::exception_ptr>& errors, unsigned threads) {
+    std::vector<std::size_t> indexes;
+    for (std::size_t i = 0; i < cells.size(); ++i) {
+        if (Cell::IsFormulaText(cells[i].second)) {
+            indexes.push_back(i);
+        }
+    }
+
+    constexpr std::size_t BLOCK_SIZE = 64;
+    std::atomic<std::size_t> next_block{ 0 };
+    auto parse_blocks = [&] {
+        for (;;) {
+            std::size_t begin = next_block.fetch_add(BLOCK_SIZE, std::memory_order_relaxed);
+            if (begin >= indexes.size()) {
+                return;
+            }
+            std::size_t end = std::min(begin + BLOCK_SIZE, indexes.size());
+            for (std::size_t j = begin; j < end; ++j) {
+                std::size_t i = indexes[j];
+                try {
+                    formulas[i] = ParseCell(cells[i].first, cells[i].second);
+                }
+                catch (...) {
+                    errors[i] = std::current_exception();
+                }
+            }
+        }
+    };
 
+    threads = std::max(1u, std::min<unsigned>(threads, (indexes.size() + BLOCK_SIZE - 1) / BLOCK_SIZE));
+    workers_.Run(threads, parse_blocks);
+}
 
-    if (CellHasCurcularDependency(cell.get(), pos)) {
+void Sheet::CommitCell(Position pos, Cell::Content content, const std::string& text) {
+    if (CellHasCurcularDependency(content.GetReferencedCells(), content.GetReferencedRanges(), pos)) {
         throw CircularDependencyException("circular dependenses");
     }
+    std::optional<CellInterface::Value> previous_value;
+    if (const Cell* cell = GetConcreteCell(pos); cell && cell->HasCachedValue() && cell->GetFormula()) {
+        previous_value = cell->GetValue();
+    }
+
+    CellState state{ std::move(content), std::nullopt };
+    ExchangeCellState(pos, state, &text);
+    journal_.Record(pos, std::move(state));
+    const Cell* cell = GetConcreteCell(pos);
+
+    // Если значение формулы не изменилось, зависимые ячейки остаются верными.
+    // Сравнение имеет смысл, только когда старое значение было вычислено:
+    // иначе кэша нет и у зависимых ячеек. Новое значение вычисляется, только
+    // если для него не нужно считать цепочку выше: иначе правка заняла бы
+    // неограниченное время в обход RecalcFor(), и проще сбросить кэш.
+    if (!previous_value || !cell->GetFormula() || !HasCachedOperands(*cell)
+        || !IsSameValue(*previous_value, cell->GetValue())) {
+        InvalidateCacheStartingWith(pos);
+    }
+
+    // непустая ячейка может только расширить область печати, полный пересчёт
+    // нужен лишь когда ячейка становится пустой
+    TraceScope trace(tracer_, "print size", pos);
+    if (text.empty()) {
+        print_size_stale_ = true;
+    }
+    else {
+        print_size_.rows = std::max(print_size_.rows, pos.row + 1);
+        print_size_.cols = std::max(print_size_.cols, pos.col + 1);
+    }
+}
+
+bool Sheet::HasCachedOperands(const Cell& cell) const {
+    if (!cell.GetReferencedRanges().empty()) {
+        return false;
+    }
+    for (Position ref : cell.GetReferencedCellsView()) {
+        const Cell* operand = GetConcreteCell(ref);
+        if (operand && operand->GetFormula() && !operand->HasCachedValue()) {
+            return false;
+        }
+    }
+    return true;
+}
 
+Cell* Sheet::GetOrCreateCell(Position pos) {
+    if (Cell* cell = GetConcreteCell(pos)) {
+        return cell;
+    }
     cells_.resize(std::max(static_cast<size_t>(pos.row) + 1, cells_.size()));
-    cells_[pos.row].resize(std::max(static_cast<size_t>(pos.col) + 1, cells_.at(pos.row).size()));
+    auto& row = cells_[pos.row];
+    memory_.row_slots -= row.capacity();
+    row.resize(std::max(static_cast<size_t>(pos.col) + 1, row.size()));
+    memory_.row_slots += row.capacity();
+    row[pos.col] = std::make_unique<Cell>(*this, pos);
+    ++memory_.cells;
+    memory_.Add(row[pos.col]->GetContentMemory());
+    return row[pos.col].get();
+}
+
+void Sheet::FillRange(Position source, const FormulaProgram::Range& target) {
+    IsPositionValid(source);
+    TraceScope trace(tracer_, "FillRange", source);
+    if (!target.first.IsValid() || !target.last.IsValid()) {
+        throw InvalidPositionException("Position is not valid"s);
+    }
+    const Position first{ std::min(target.first.row, target.last.row), std::min(target.first.col, target.last.col) };
+    const Position last{ std::max(target.first.row, target.last.row), std::max(target.first.col, target.last.col) };
+    auto for_each_target = [&](auto function) {
+        for (int row = first.row; row <= last.row; ++row) {
+            for (int col = first.col; col <= last.col; ++col) {
+                if (!(Position{ row, col } == source)) {
+                    function(Position{ row, col });
+                }
+            }
+        }
+    };
+
+    Journal::Batch batch(journal_);
+
+    // числа и текст копируются как есть
+    const Cell* cell = GetConcreteCell(source);
+    if (!cell || !cell->GetFormula()) {
+        const double* number = numbers_.Find(source);
+        const std::optional<double> value = number ? std::optional<double>(*number) : std::nullopt;
+        const std::string text = cell ? cell->GetText() : std::string();
+        for_each_target([&](Position pos) {
+            if (value) {
+                SetNumber(pos, *value);
+            }
+            else if (cell) {
+                SetCell(pos, text);
+            }
+            else {
+                ClearCell(pos);
+            }
+        });
+        return;
+    }
 
-    cells_[pos.row][pos.col] = std::move(cell);
+    // Сначала устанавливаются все формулы, затем граф проверяется целиком:
+    // формулы области могут ссылаться друг на друга, поэтому по отдельности
+    // их проверить нельзя
+    std::vector<Journal::Change> filled;
+    std::vector<Position> positions;
+    for_each_target([&](Position pos) {
+        CellState state{ cell->CopyFormula(pos.row - source.row, pos.col - source.col), std::nullopt };
+        ExchangeCellState(pos, state);
+        filled.push_back({ pos, std::move(state) });
+        positions.push_back(pos);
+    });
 
-    DeleteDependances(pos);
-    CreateDependances(pos);
-    InvalidateCacheStartingWith(pos); 
+    if (HasCycleThrough(positions)) {
+        for (auto it = filled.rbegin(); it != filled.rend(); ++it) {
+            ExchangeCellState(it->pos, it->state);
+            // восстановленная ячейка потеряла кэш, значит его не должно быть
+            // и у зависимых от неё
+            InvalidateCacheStartingWith(it->pos);
+        }
+        throw CircularDependencyException("circular dependenses");
+    }
 
-    print_size_ = GetPrintableSize();
+    for (auto& [pos, state] : filled) {
+        InvalidateCacheStartingWith(pos);
+        journal_.Record(pos, std::move(state));
+    }
+    print_size_.rows = std::max(print_size_.rows, last.row + 1);
+    print_size_.cols = std::max(print_size_.cols, last.col + 1);
 }
 
+// Обход в глубину по зависимым ячейкам с тремя состояниями: цикл - это ребро
+// в ячейку, обход которой ещё не завершён. Прежний граф был без циклов,
+// поэтому любой новый цикл проходит через одну из starts.
+bool Sheet::HasCycleThrough(const std::vector<Position>& starts) const {
+    enum class State {
+        Active,
+        Done,
+    };
+    struct Frame {
+        Position pos;
+        std::vector<Position> dependants;
+        std::size_t next = 0;
+    };
 
-bool Sheet::CellHasCurcularDependency(Cell* cell, Position pos) {
-    std::vector<Position> incoming = cell->GetReferencedCells();
-    if (incoming.empty()) return false;
+    TraceScope trace(tracer_, "cycle check");
+    std::unordered_map<Position, State, PositionHasher> states;
+    std::vector<Frame> frames;
+    stats_.Add(StatsCounters::CycleChecks, 1);
+    auto enter = [&](Position pos) {
+        stats_.Add(StatsCounters::CycleCheckVisits, 1);
+        Frame frame{ pos, {}, 0 };
+        ForEachDependant(pos, false, [&frame](Position dependant) {
+            frame.dependants.push_back(dependant);
+        });
+        frames.push_back(std::move(frame));
+    };
 
-    auto changed_cell = GetCell(pos);
+    for (Position start : starts) {
+        if (!states.try_emplace(start, State::Active).second) {
+            continue;
+        }
+        enter(start);
+        while (!frames.empty()) {
+            Frame& frame = frames.back();
+            if (frame.next == frame.dependants.size()) {
+                states[frame.pos] = State::Done;
+                frames.pop_back();
+                continue;
+            }
+            Position dependant = frame.dependants[frame.next++];
+            auto [state, inserted] = states.try_emplace(dependant, State::Active);
+            if (inserted) {
+                enter(dependant);
+            }
+            else if (state->second == State::Active) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
 
-    std::stack<Position> graph_dependeces;
-    std::vector<Position> processed;
+void Sheet::SetNumber(Position pos, double value) {
+    const double* current = numbers_.Find(pos);
+    if (current && std::memcmp(current, &value, sizeof(double)) == 0) {
+        return;
+    }
+
+    CellState state{ std::nullopt, value };
+    ExchangeCellState(pos, state);
+    journal_.Record(pos, std::move(state));
+    InvalidateCacheStartingWith(pos);
+
+    print_size_.rows = std::max(print_size_.rows, pos.row + 1);
+    print_size_.cols = std::max(print_size_.cols, pos.col + 1);
+}
+
+// Все изменения ячеек проходят здесь, поэтому прежнее состояние всегда можно
+// отдать журналу, а не уничтожать
+void Sheet::ExchangeCellState(Position pos, CellState& state, const std::string* text) {
+    TraceScope trace(tracer_, "dependency rewire", pos);
+    CellState previous;
+    if (const double* number = numbers_.Find(pos)) {
+        previous.number = *number;
+    }
+    lookup_index_.Erase(pos);
+    EraseNumber(pos);
+
+    if (state.content) {
+        Cell* cell = GetOrCreateCell(pos);
+        Cell::Content content = cell->Set(std::move(*state.content));
+        memory_.Remove(content.GetMemory());
+        memory_.Add(cell->GetContentMemory());
+        UpdateDependances(pos, content.GetReferencedCells(), cell->GetReferencedCellsView());
+        UpdateRangeDependances(pos, content.GetReferencedRanges(), cell->GetReferencedRanges());
+        if (!content.IsEmpty()) {
+            previous.content = std::move(content);
+        }
+    }
+    else if (Cell* cell = GetConcreteCell(pos)) {
+        DeleteDependances(pos);
+        memory_.Remove(cell->GetContentMemory());
+        Cell::Content content = cell->Set(Cell::Parse({}, string_pool_));
+        if (!content.IsEmpty()) {
+            previous.content = std::move(content);
+        }
+        cells_[pos.row][pos.col].reset();
+        --memory_.cells;
+    }
+
+    if (state.number) {
+        numbers_.Set(pos, *state.number);
+    }
+    lookup_index_.Insert(pos);
+
+    if (write_ahead_log_) {
+        if (state.number) {
+            write_ahead_log_->AppendNumber(pos, *state.number);
+        }
+        else if (const Cell* cell = GetConcreteCell(pos)) {
+            write_ahead_log_->AppendText(pos, text ? *text : cell->GetText());
+        }
+        else {
+            write_ahead_log_->AppendClear(pos);
+        }
+    }
+    state = std::move(previous);
+}
 
-    for (auto posisition : incoming) {
-        graph_dependeces.push(posisition);
+bool Sheet::EraseNumber(Position pos) {
+    if (!numbers_.Erase(pos)) {
+        return false;
     }
+    number_cells_.erase(pos);
+    return true;
+}
+
+bool Sheet::CellHasCurcularDependency(PositionSpan incoming, const std::vector<FormulaProgram::Range>& ranges,
+    Position pos) {
+    if (incoming.empty() && ranges.empty()) return false;
+    TraceScope trace(tracer_, "cycle check", pos);
+
+    auto in_ranges = [&ranges](Position position) {
+        return std::any_of(ranges.begin(), ranges.end(), [position](const FormulaProgram::Range& range) {
+            return position.col == range.first.col && position.row >= range.first.row
+                && position.row <= range.last.row;
+        });
+    };
+
+    // Цикл появляется, если какая-то из ячеек формулы прямо или косвенно
+    // зависит от изменяемой ячейки. Поэтому граф обходится по зависимым
+    // ячейкам начиная с pos: у новой ячейки их обычно нет, и проверка
+    // заполнения столбца сверху вниз не становится квадратичной.
+    std::stack<Position> graph_dependeces;
+    std::unordered_set<Position, PositionHasher> processed;
+    stats_.Add(StatsCounters::CycleChecks, 1);
+
+    graph_dependeces.push(pos);
 
     while (!graph_dependeces.empty()) {
         Position current = graph_dependeces.top();
         graph_dependeces.pop();
-        processed.push_back(current);
 
-        auto* cell_pos = GetCell(current);
-        if (cell_pos == changed_cell) {
+        if (!processed.insert(current).second) {
+            continue;
+        }
+        stats_.Add(StatsCounters::CycleCheckVisits, 1);
+
+        if (std::binary_search(incoming.begin(), incoming.end(), current) || in_ranges(current)) {
             return true;
         }
 
-        if (cell_pos) {
-            for (const auto& posisition : cell_pos->GetReferencedCells()) {
-                if (std::count(incoming.begin(), incoming.end(), posisition) == 0) {
-                    graph_dependeces.push(posisition);
-                }
+        ForEachDependant(current, false, [&graph_dependeces](Position posisition) {
+            graph_dependeces.push(posisition);
+        });
+    }
+    return false;
+}
+
+template <typename Function>
+void Sheet::ForEachDependant(Position pos, bool evaluated_only, Function function) const {
+    if (auto it = cell_dependants_.find(pos); it != cell_dependants_.end()) {
+        for (Position dependant : it->second) {
+            // формулу с IF, не читавшую pos при последнем вычислении, его
+            // изменение не затрагивает
+            const Cell* cell = GetConcreteCell(dependant);
+            if (evaluated_only && cell && !cell->HasObserved(pos)) {
+                continue;
             }
+            function(dependant);
         }
     }
-    return false;
+
+    auto column = range_dependants_.find(pos.col);
+    if (column == range_dependants_.end()) {
+        return;
+    }
+    for (const auto& [rows, dependants] : column->second) {
+        if (rows.first > pos.row) {
+            break;
+        }
+        if (pos.row > rows.second || (evaluated_only && !dependants.evaluated)) {
+            continue;
+        }
+        if (evaluated_only) {
+            dependants.evaluated = false;
+        }
+        for (Position dependant : dependants.formulas) {
+            function(dependant);
+        }
+    }
+}
+
+void Sheet::MarkRangesEvaluated(const std::vector<FormulaProgram::Range>& ranges) const {
+    for (const auto& range : ranges) {
+        auto column = range_dependants_.find(range.first.col);
+        if (column == range_dependants_.end()) {
+            continue;
+        }
+        auto dependants = column->second.find({ range.first.row, range.last.row });
+        if (dependants != column->second.end()) {
+            dependants->second.evaluated = true;
+        }
+    }
+}
+
+void Sheet::ResizeFormulaMemory(std::size_t before, std::size_t after) {
+    memory_.formulas = memory_.formulas - before + after;
 }
 
 void Sheet::DeleteDependances(Position pos) {
-    std::vector<Position> outcoming =  dynamic_cast<Cell*>(GetCell(pos))->GetReferencedCells();
-    if (!outcoming.empty()) {
-        for (auto position : outcoming) {
-            auto it = cell_dependants_[position].find(pos);
-            if (it != cell_dependants_[position].end()) {
-                cell_dependants_[position].erase(it);
-            }  
-        }  
+    const Cell* cell = GetConcreteCell(pos);
+    if (!cell) {
+        return;
+    }
+
+    for (auto position : cell->GetReferencedCellsView()) {
+        auto it = cell_dependants_.find(position);
+        if (it != cell_dependants_.end()) {
+            memory_.dependant_sets -= GetDependantsMemoryUsage(it->second);
+            it->second.erase(pos);
+            memory_.dependant_sets += GetDependantsMemoryUsage(it->second);
+            if (it->second.empty()) {
+                cell_dependants_.erase(it);
+            }
+        }
     }
+    UpdateRangeDependances(pos, cell->GetReferencedRanges(), {});
 }
 
-void Sheet::CreateDependances(Position pos) {
-    std::vector<Position> outcoming = dynamic_cast<Cell*>(GetCell(pos))->GetReferencedCells();
-    if (!outcoming.empty()) {
-        for (auto position : outcoming) {
-            cell_dependants_[position].insert(pos);
+// Диапазонов у формулы мало, поэтому при любом изменении они перерегистрируются целиком
+void Sheet::UpdateRangeDependances(Position pos, const std::vector<FormulaProgram::Range>& old_ranges,
+    const std::vector<FormulaProgram::Range>& new_ranges) {
+    if (old_ranges == new_ranges) {
+        return;
+    }
+
+    for (const auto& range : old_ranges) {
+        auto column = range_dependants_.find(range.first.col);
+        if (column == range_dependants_.end()) {
+            continue;
         }
+        auto dependants = column->second.find({ range.first.row, range.last.row });
+        if (dependants != column->second.end()) {
+            auto& formulas = dependants->second.formulas;
+            memory_.dependant_sets -= GetDependantsMemoryUsage(formulas);
+            formulas.erase(pos);
+            memory_.dependant_sets += GetDependantsMemoryUsage(formulas);
+            if (formulas.empty()) {
+                column->second.erase(dependants);
+                --memory_.range_groups;
+            }
+        }
+        if (column->second.empty()) {
+            range_dependants_.erase(column);
+        }
+    }
+    for (const auto& range : new_ranges) {
+        auto [dependants, inserted] = range_dependants_[range.first.col].try_emplace({ range.first.row, range.last.row });
+        memory_.range_groups += inserted ? 1 : 0;
+        auto& formulas = dependants->second.formulas;
+        memory_.dependant_sets -= GetDependantsMemoryUsage(formulas);
+        formulas.insert(pos);
+        memory_.dependant_sets += GetDependantsMemoryUsage(formulas);
     }
 }
 
-void  Sheet::InvalidateCacheStartingWith(Position pos) {
-    dynamic_cast<Cell*>(GetCell(pos))->InvalidateCache();
+// Обе последовательности отсортированы, поэтому изменяются только рёбра из
+// симметрической разности старых и новых ссылок.
+void Sheet::UpdateDependances(Position pos, PositionSpan old_cells, PositionSpan new_cells) {
+    auto old_it = old_cells.begin();
+    auto new_it = new_cells.begin();
 
-    if (!cell_dependants_[pos].empty()) {
-        for (auto cell : cell_dependants_.at(pos)) {
-            InvalidateCacheStartingWith(cell);
+    while (old_it != old_cells.end() || new_it != new_cells.end()) {
+        if (new_it == new_cells.end() || (old_it != old_cells.end() && *old_it < *new_it)) {
+            auto it = cell_dependants_.find(*old_it);
+            if (it != cell_dependants_.end()) {
+                memory_.dependant_sets -= GetDependantsMemoryUsage(it->second);
+                it->second.erase(pos);
+                memory_.dependant_sets += GetDependantsMemoryUsage(it->second);
+                if (it->second.empty()) {
+                    cell_dependants_.erase(it);
+                }
+            }
+            ++old_it;
+        }
+        else if (old_it == old_cells.end() || *new_it < *old_it) {
+            auto& dependants = cell_dependants_[*new_it];
+            memory_.dependant_sets -= GetDependantsMemoryUsage(dependants);
+            dependants.insert(pos);
+            memory_.dependant_sets += GetDependantsMemoryUsage(dependants);
+            ++new_it;
+        }
+        else {
+            ++old_it;
+            ++new_it;
         }
     }
-   
 }
 
+void Sheet::InvalidateCacheStartingWith(Position pos) {
+    TraceScope trace(tracer_, "invalidation", pos);
+    stats_.Add(StatsCounters::Invalidations, 1);
+    if (recalc_.enabled) {
+        // сама ячейка сбрасывается сразу, зависящие от неё - в RecalcFor()
+        if (Cell* cell = GetConcreteCell(pos)) {
+            cell->InvalidateCache();
+            recalc_.dirty.push_back(pos);
+        }
+        recalc_.invalidated.push_back(pos);
+        return;
+    }
 
+    // Если у ячейки нет кэша, то его нет и у всех зависящих от неё ячеек,
+    // поэтому обход останавливается на уже сброшенных ячейках. Стек явный,
+    // чтобы длинные цепочки зависимостей не переполняли стек вызовов.
+    std::vector<Position> invalidated{ pos };
+    std::uint64_t count = 0;
+    while (!invalidated.empty()) {
+        const bool root = invalidated.back() == pos;
+        count += InvalidateNext(invalidated, nullptr) && !root ? 1 : 0;
+    }
+
+    stats_.Add(StatsCounters::InvalidatedCells, count);
+    stats_.Max(StatsCounters::MaxInvalidatedCells, count);
+}
+
+bool Sheet::InvalidateNext(std::vector<Position>& invalidated, std::vector<Position>* dirty) {
+    const Position current = invalidated.back();
+    invalidated.pop_back();
+
+    bool cached = false;
+    if (Cell* cell = GetConcreteCell(current); cell && cell->GetFormula()) {
+        // ячейка может попасть в стек дважды, но сбрасывается один раз
+        cached = cell->HasCachedValue();
+        cell->InvalidateCache();
+        if (cached && dirty) {
+            dirty->push_back(current);
+        }
+    }
+
+    ForEachDependant(current, true, [&](Position dependant) {
+        const Cell* cell = GetConcreteCell(dependant);
+        if (cell && cell->HasCachedValue()) {
+            invalidated.push_back(dependant);
+        }
+    });
+    return cached;
+}
+
+// Обход в глубину как в Cell::EvaluateWithDependencies(), но стек хранит
+// позиции и переживает правки между вызовами RecalcFor(). Ссылки ветвей IF и
+// диапазонов поиска тоже попадают в стек, так что шаг вычисляет не больше
+// одной формулы.
+bool Sheet::EvaluateNext() {
+    const Position current = recalc_.evaluating.back();
+    const Cell* cell = GetConcreteCell(current);
+    if (!cell || cell->HasCachedValue()) {
+        recalc_.evaluating.pop_back();
+        return false;
+    }
+
+    recalc_.unevaluated.clear();
+    if (cell->TryEvaluate(recalc_.unevaluated)) {
+        recalc_.evaluating.pop_back();
+        return true;
+    }
+    for (const Cell* dependency : recalc_.unevaluated) {
+        recalc_.evaluating.push_back(dependency->GetPosition());
+    }
+    return false;
+}
+
+void Sheet::SetIncrementalRecalc(bool enabled) {
+    if (!enabled) {
+        std::uint64_t count = 0;
+        while (!recalc_.invalidated.empty()) {
+            count += InvalidateNext(recalc_.invalidated, nullptr) ? 1 : 0;
+        }
+        stats_.Add(StatsCounters::InvalidatedCells, count);
+        recalc_.dirty.clear();
+        recalc_.evaluating.clear();
+    }
+    recalc_.enabled = enabled;
+}
+
+Sheet::RecalcProgress Sheet::RecalcFor(std::chrono::nanoseconds budget) {
+    using Clock = std::chrono::steady_clock;
+    // шаг сброса дешевле обращения к часам, поэтому время проверяется
+    // через несколько шагов
+    constexpr std::size_t CLOCK_INTERVAL = 8;
+
+    TraceScope trace(tracer_, "RecalcFor");
+    const Clock::time_point start = Clock::now();
+    const Clock::time_point deadline = budget < Clock::time_point::max() - start
+        ? start + std::chrono::duration_cast<Clock::duration>(budget)
+        : Clock::time_point::max();
+
+    RecalcProgress progress;
+    for (std::size_t step = 1;; ++step) {
+        if (!recalc_.invalidated.empty()) {
+            progress.invalidated += InvalidateNext(recalc_.invalidated, &recalc_.dirty) ? 1 : 0;
+        }
+        else if (!recalc_.evaluating.empty()) {
+            progress.evaluated += EvaluateNext() ? 1 : 0;
+        }
+        else if (!recalc_.dirty.empty()) {
+            recalc_.evaluating.push_back(recalc_.dirty.back());
+            recalc_.dirty.pop_back();
+        }
+        else {
+            break;
+        }
+        if (step % CLOCK_INTERVAL == 0 && Clock::now() >= deadline) {
+            break;
+        }
+    }
+
+    stats_.Add(StatsCounters::InvalidatedCells, progress.invalidated);
+    progress.pending_invalidations = recalc_.invalidated.size();
+    progress.pending_evaluations = recalc_.dirty.size() + recalc_.evaluating.size();
+    return progress;
+}
+
+void Sheet::SetNumberPaging(const std::string& spill_path, std::size_t memory_budget) {
+    numbers_.SetPaging(spill_path, memory_budget);
+}
 
 const CellInterface* Sheet::GetCell(Position pos) const {
     IsPositionValid(pos);
 
+    if (const double* number = numbers_.Find(pos)) {
+        return &number_cells_.try_emplace(pos, *number).first->second;
+    }
+
     if ((static_cast<size_t>(pos.row) >= cells_.size()) || (static_cast<size_t>(pos.col) >= cells_[pos.row].size())) {
         return nullptr;
     }
@@ -117,33 +743,359 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
-    IsPositionValid(pos);
+    return const_cast<CellInterface*>(static_cast<const Sheet&>(*this).GetCell(pos));
+}
 
-    if ((static_cast<size_t>(pos.row) >= cells_.size()) ||  (static_cast<size_t>(pos.col) >= cells_[pos.row].size())) {
+const Cell* Sheet::GetConcreteCell(Position pos) const {
+    if ((static_cast<size_t>(pos.row) >= cells_.size()) || (static_cast<size_t>(pos.col) >= cells_[pos.row].size())) {
         return nullptr;
     }
-    return cells_.at(pos.row).at(pos.col).get();
-    
+    return cells_[pos.row][pos.col].get();
+}
+
+Cell* Sheet::GetConcreteCell(Position pos) {
+    return const_cast<Cell*>(static_cast<const Sheet&>(*this).GetConcreteCell(pos));
 }
 
 void Sheet::ClearCell(Position pos) {
     IsPositionValid(pos);
+    TraceScope trace(tracer_, "ClearCell", pos);
 
-    if ((static_cast<size_t>(pos.row) >= cells_.size()) ||  (static_cast<size_t>(pos.col) >= cells_[pos.row].size())) {
-        return ;
+    if (!numbers_.Contains(pos)) {
+        const Cell* cell = GetConcreteCell(pos);
+        if (!cell || cell->GetText().empty()) {
+            return;
+        }
     }
-    
-    auto& cell = cells_.at(pos.row).at(pos.col);
-    if (!cell || cell->GetText().empty()) {
+
+    CellState state;
+    ExchangeCellState(pos, state);
+    journal_.Record(pos, std::move(state));
+    InvalidateCacheStartingWith(pos);
+
+    print_size_stale_ = true;
+}
+
+void Sheet::RestoreCell(Position pos, std::string text) {
+    IsPositionValid(pos);
+    TraceScope trace(tracer_, "RestoreCell", pos);
+
+    CellState state;
+    if (std::optional<double> number = NumberColumns::Parse(text)) {
+        state.number = *number;
+    }
+    else if (!text.empty()) {
+        state.content = ParseCell(pos, std::move(text));
+    }
+    const bool empty = !state.number && !state.content;
+    ExchangeCellState(pos, state);
+    InvalidateCacheStartingWith(pos);
+
+    if (empty) {
+        print_size_stale_ = true;
+    }
+    else {
+        print_size_.rows = std::max(print_size_.rows, pos.row + 1);
+        print_size_.cols = std::max(print_size_.cols, pos.col + 1);
+    }
+}
+
+bool Sheet::Undo() {
+    TraceScope trace(tracer_, "Undo");
+    std::optional<Journal::Entry> entry = journal_.TakeUndo();
+    if (!entry) {
+        return false;
+    }
+    ApplyJournalEntry(*entry, true);
+    journal_.PushRedo(std::move(*entry));
+    return true;
+}
+
+bool Sheet::Redo() {
+    TraceScope trace(tracer_, "Redo");
+    std::optional<Journal::Entry> entry = journal_.TakeRedo();
+    if (!entry) {
+        return false;
+    }
+    ApplyJournalEntry(*entry, false);
+    journal_.PushUndo(std::move(*entry));
+    return true;
+}
+
+// Прежние состояния образовывали граф без циклов, поэтому при отмене и повторе
+// проверка на циклы не нужна
+void Sheet::ApplyJournalEntry(Journal::Entry& entry, bool reverse) {
+    bool cleared = false;
+    auto apply = [&](Journal::Change& change) {
+        cleared = cleared || (!change.state.number && !change.state.content);
+        ExchangeCellState(change.pos, change.state);
+        InvalidateCacheStartingWith(change.pos);
+        print_size_.rows = std::max(print_size_.rows, change.pos.row + 1);
+        print_size_.cols = std::max(print_size_.cols, change.pos.col + 1);
+    };
+    if (reverse) {
+        std::for_each(entry.rbegin(), entry.rend(), apply);
+    }
+    else {
+        std::for_each(entry.begin(), entry.end(), apply);
+    }
+    if (cleared) {
+        print_size_stale_ = true;
+    }
+}
+
+void Sheet::InsertRows(int before, int count) {
+    if (count < 0) {
+        throw InvalidPositionException("Invalid row count"s);
+    }
+    ShiftCells({ PositionShift::Axis::Rows, before, count });
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    if (count < 0) {
+        throw InvalidPositionException("Invalid row count"s);
+    }
+    ShiftCells({ PositionShift::Axis::Rows, first, -count });
+}
+
+void Sheet::InsertCols(int before, int count) {
+    if (count < 0) {
+        throw InvalidPositionException("Invalid column count"s);
+    }
+    ShiftCells({ PositionShift::Axis::Cols, before, count });
+}
+
+void Sheet::DeleteCols(int first, int count) {
+    if (count < 0) {
+        throw InvalidPositionException("Invalid column count"s);
+    }
+    ShiftCells({ PositionShift::Axis::Cols, first, -count });
+}
+
+// Ссылки переписываются только у формул, которые ссылаются на сдвигаемые
+// ячейки, - их находят по индексу зависимостей. Кэш сбрасывается лишь у
+// формул, значение которых могло измениться: с #REF! или с диапазоном,
+// изменившим размер. Остальные формулы читают те же ячейки на новых местах.
+void Sheet::ShiftCells(const PositionShift& shift) {
+    TraceScope trace(tracer_, "ShiftCells");
+    const bool rows = shift.axis == PositionShift::Axis::Rows;
+    const int limit = shift.GetLimit();
+    const int size = rows ? GetPrintSize().rows : GetPrintSize().cols;
+    if (shift.first < 0 || shift.first > limit || shift.first - std::min(shift.count, 0) > limit) {
+        throw InvalidPositionException("Position is not valid"s);
+    }
+    if (shift.count > 0 && size > shift.first && size + shift.count > limit) {
+        throw InvalidPositionException("Table is too big"s);
+    }
+    if (shift.count == 0) {
         return;
     }
-    cell.reset();
+    journal_.Clear();
+    if (write_ahead_log_) {
+        write_ahead_log_->AppendShift(shift);
+    }
+    // очереди пошагового пересчёта переходят вместе с ячейками; зависящие от
+    // удалённых ячеек формулы сбрасываются ниже как изменённые
+    for (auto* queue : { &recalc_.invalidated, &recalc_.dirty, &recalc_.evaluating }) {
+        std::size_t kept = 0;
+        for (Position pos : *queue) {
+            if (Position moved = shift.Apply(pos); moved.IsValid()) {
+                (*queue)[kept++] = moved;
+            }
+        }
+        queue->resize(kept);
+    }
+
+    auto is_shifted = [&](Position pos) {
+        return (rows ? pos.row : pos.col) >= shift.first;
+    };
+    std::unordered_set<Position, PositionHasher> affected;
+    for (const auto& [cell, dependants] : cell_dependants_) {
+        if (is_shifted(cell)) {
+            affected.insert(dependants.begin(), dependants.end());
+        }
+    }
+    // диапазон VLOOKUP шире зарегистрированных столбцов, поэтому при сдвиге
+    // столбцов проверяются все формулы с диапазонами
+    for (const auto& [col, groups] : range_dependants_) {
+        for (const auto& [span, dependants] : groups) {
+            if (!rows || span.second >= shift.first) {
+                affected.insert(dependants.formulas.begin(), dependants.formulas.end());
+            }
+        }
+    }
+
+    std::vector<Position> changed;
+    for (Position pos : affected) {
+        Position moved = shift.Apply(pos);
+        Cell* cell = GetConcreteCell(pos);
+        if (moved.IsValid() && cell && cell->ShiftReferences(shift)) {
+            changed.push_back(moved);
+        }
+    }
+
+    ShiftStorage(shift);
+    ShiftDependances(shift);
+    lookup_index_.Clear();
+    // сдвиг и так обходит таблицу, а удалённые ячейки уничтожаются вместе
+    // со строками и столбцами
+    RecountMemory();
+
+    // область печати пересчитывается, только если удалён её край
+    int& print_size = rows ? print_size_.rows : print_size_.cols;
+    if (print_size > shift.first) {
+        if (shift.count > 0 || print_size > shift.first - shift.count) {
+            print_size += shift.count;
+        }
+        else {
+            print_size_stale_ = true;
+        }
+    }
+
+    for (Position pos : changed) {
+        InvalidateCacheStartingWith(pos);
+    }
+}
+
+void Sheet::ShiftStorage(const PositionShift& shift) {
+    const std::size_t first = shift.first;
+    const std::size_t limit = shift.GetLimit();
+    auto shift_items = [&](auto& items) {
+        if (first >= items.size()) {
+            return;
+        }
+        if (shift.count < 0) {
+            items.erase(items.begin() + first, items.begin() + std::min(items.size(), first - shift.count));
+            return;
+        }
+        items.resize(items.size() + shift.count);
+        std::rotate(items.begin() + first, items.end() - shift.count, items.end());
+        // за край уходят только пустые ячейки, это проверено заранее
+        if (items.size() > limit) {
+            items.resize(limit);
+        }
+    };
+
+    if (shift.axis == PositionShift::Axis::Rows) {
+        shift_items(cells_);
+    }
+    else {
+        for (auto& row : cells_) {
+            shift_items(row);
+        }
+    }
+    // ячейки за first сменили позиции
+    const bool rows = shift.axis == PositionShift::Axis::Rows;
+    for (std::size_t row = rows ? first : 0; row < cells_.size(); ++row) {
+        for (std::size_t col = rows ? 0 : first; col < cells_[row].size(); ++col) {
+            if (cells_[row][col]) {
+                cells_[row][col]->SetPosition({ static_cast<int>(row), static_cast<int>(col) });
+            }
+        }
+    }
 
-    print_size_ = GetPrintableSize();
+    numbers_.Shift(shift);
+    // узлы переносятся через extract(), так что выданные представления
+    // остаются на месте
+    std::vector<decltype(number_cells_)::node_type> moved_cells;
+    for (auto it = number_cells_.begin(); it != number_cells_.end();) {
+        const Position moved = shift.Apply(it->first);
+        if (moved == it->first) {
+            ++it;
+            continue;
+        }
+        auto node = number_cells_.extract(it++);
+        node.key() = moved;
+        if (moved.IsValid()) {
+            moved_cells.push_back(std::move(node));
+        }
+    }
+    for (auto& node : moved_cells) {
+        number_cells_.insert(std::move(node));
+    }
+}
+
+// Узлы хеш-таблиц с изменившимися позициями переносятся через extract(),
+// без новых выделений памяти. Изменяются только позиции за shift.first.
+void Sheet::ShiftDependances(const PositionShift& shift) {
+    auto is_shifted = [&shift](Position pos) {
+        return (shift.axis == PositionShift::Axis::Rows ? pos.row : pos.col) >= shift.first;
+    };
+
+    using Positions = std::unordered_set<Position, PositionHasher>;
+    std::vector<Positions::node_type> moved_positions;
+    auto shift_positions = [&](Positions& positions) {
+        for (auto it = positions.begin(); it != positions.end();) {
+            if (!is_shifted(*it)) {
+                ++it;
+                continue;
+            }
+            auto node = positions.extract(it++);
+            node.value() = shift.Apply(node.value());
+            if (node.value().IsValid()) {
+                moved_positions.push_back(std::move(node));
+            }
+        }
+        for (auto& node : moved_positions) {
+            positions.insert(std::move(node));
+        }
+        moved_positions.clear();
+    };
+
+    std::vector<decltype(cell_dependants_)::node_type> moved_cells;
+    for (auto it = cell_dependants_.begin(); it != cell_dependants_.end();) {
+        shift_positions(it->second);
+        if (it->second.empty()) {
+            it = cell_dependants_.erase(it);
+            continue;
+        }
+        if (!is_shifted(it->first)) {
+            ++it;
+            continue;
+        }
+        auto node = cell_dependants_.extract(it++);
+        node.key() = shift.Apply(node.key());
+        if (node.key().IsValid()) {
+            moved_cells.push_back(std::move(node));
+        }
+    }
+    // перенесённые ключи не пересекаются с оставшимися: все ключи от
+    // shift.first были извлечены
+    for (auto& node : moved_cells) {
+        cell_dependants_.insert(std::move(node));
+    }
+
+    // формулы с диапазонами регистрируются заново по уже перенесённым диапазонам
+    std::vector<Position> range_formulas;
+    for (const auto& [col, groups] : range_dependants_) {
+        for (const auto& [span, dependants] : groups) {
+            for (Position pos : dependants.formulas) {
+                Position moved = shift.Apply(pos);
+                if (moved.IsValid()) {
+                    range_formulas.push_back(moved);
+                }
+            }
+        }
+    }
+    std::sort(range_formulas.begin(), range_formulas.end());
+    range_formulas.erase(std::unique(range_formulas.begin(), range_formulas.end()), range_formulas.end());
+
+    range_dependants_.clear();
+    for (Position pos : range_formulas) {
+        for (const auto& range : GetConcreteCell(pos)->GetReferencedRanges()) {
+            auto& dependants = range_dependants_[range.first.col][{ range.first.row, range.last.row }];
+            dependants.formulas.insert(pos);
+            // кэш формулы мог сохраниться, его нужно сбрасывать при изменениях
+            dependants.evaluated = true;
+        }
+    }
 }
 
 Size Sheet::GetPrintableSize() const {
-    Size size;
+    TraceScope trace(tracer_, "GetPrintableSize");
+    StatsTimer timer(stats_, StatsCounters::PrintableSizeNs);
+    stats_.Add(StatsCounters::PrintableSizeCalls, 1);
+    Size size = numbers_.GetBounds();
     for (int row = 0; static_cast<size_t>(row) < cells_.size(); ++row) {
         for (int col = cells_[row].size() - 1; col >= 0; --col) {
             if (cells_[row][col] && !cells_[row][col]->GetText().empty()) {
@@ -156,15 +1108,27 @@ Size Sheet::GetPrintableSize() const {
     return size;
 }
 
+const Size& Sheet::GetPrintSize() const {
+    if (print_size_stale_) {
+        print_size_ = GetPrintableSize();
+        print_size_stale_ = false;
+    }
+    return print_size_;
+}
+
 void Sheet::PrintValues(std::ostream& output) const {
-    for (int row = 0; row < print_size_.rows; ++row) {
-        for (int col = 0; col < print_size_.cols; ++col) {
+    const Size size = GetPrintSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
             if (col > 0) {
                 output << '\t';
             }
-            if ((size_t)col < cells_[row].size()) {
+            if (const double* number = numbers_.Find({ row, col })) {
+                output << NumberColumns::Format(*number);
+            }
+            else if (static_cast<size_t>(row) < cells_.size() && static_cast<size_t>(col) < cells_[row].size()) {
                 if (const auto& cell = cells_.at(row).at(col)) {
-                    std::visit([&](const auto& value) { output << value; }, cell->GetValue());
+                    std::visit([&](const auto& value) { output << value; }, cell->GetValueView());
                 }
             }
         }
@@ -173,12 +1137,16 @@ void Sheet::PrintValues(std::ostream& output) const {
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    for (int row = 0; row < print_size_.rows; ++row) {
-        for (int col = 0; col < print_size_.cols; ++col) {
+    const Size size = GetPrintSize();
+    for (int row = 0; row < size.rows; ++row) {
+        for (int col = 0; col < size.cols; ++col) {
             if (col > 0) {
                 output << '\t';
             }
-            if (static_cast<size_t>(col) < cells_[row].size()) {
+            if (const double* number = numbers_.Find({ row, col })) {
+                output << NumberColumns::Format(*number);
+            }
+            else if (static_cast<size_t>(row) < cells_.size() && static_cast<size_t>(col) < cells_[row].size()) {
                 if (const auto& cell = cells_.at(row).at(col)) {
                     output << cell->GetText();
                 }
@@ -188,6 +1156,78 @@ void Sheet::PrintTexts(std::ostream& output) const {
     }
 }
 
+void Sheet::EvaluateBatched() {
+    size_t cols = 0;
+    for (const auto& row : cells_) {
+        cols = std::max(cols, row.size());
+    }
+
+    ColumnEvaluator evaluator(*this);
+    for (size_t col = 0; col < cols; ++col) {
+        evaluator.EvaluateColumn(static_cast<int>(col), static_cast<int>(cells_.size()));
+    }
+}
+
+SheetMemoryUsage Sheet::GetMemoryUsage() const {
+    using RangeGroup = decltype(range_dependants_)::mapped_type::value_type;
+    // узел красно-чёрного дерева: цвет и три указателя
+    constexpr std::size_t range_group_size = sizeof(RangeGroup) + 4 * sizeof(void*);
+
+    SheetMemoryUsage usage;
+    usage.cells = cells_.capacity() * sizeof(cells_[0]) + memory_.row_slots * sizeof(std::unique_ptr<Cell>)
+        + memory_.cells * (sizeof(Cell) - Cell::CACHED_VALUE_SIZE);
+    usage.contents = memory_.contents + string_pool_.GetMemoryUsage();
+    usage.cached_values = memory_.cells * Cell::CACHED_VALUE_SIZE;
+    usage.formulas = memory_.formulas;
+    usage.dependencies = GetHashTableMemoryUsage(cell_dependants_) + GetHashTableMemoryUsage(range_dependants_)
+        + memory_.dependant_sets + memory_.range_groups * range_group_size;
+    usage.numbers = numbers_.GetMemoryUsage() + GetHashTableMemoryUsage(number_cells_);
+    usage.journal = journal_.GetMemoryUsage();
+    return usage;
+}
+
+void Sheet::RecountMemory() {
+    memory_ = {};
+    for (const auto& row : cells_) {
+        memory_.row_slots += row.capacity();
+        for (const auto& cell : row) {
+            if (cell) {
+                ++memory_.cells;
+                memory_.Add(cell->GetContentMemory());
+            }
+        }
+    }
+    for (const auto& [cell, dependants] : cell_dependants_) {
+        memory_.dependant_sets += GetDependantsMemoryUsage(dependants);
+    }
+    for (const auto& [col, groups] : range_dependants_) {
+        memory_.range_groups += groups.size();
+        for (const auto& [span, dependants] : groups) {
+            memory_.dependant_sets += GetDependantsMemoryUsage(dependants.formulas);
+        }
+    }
+}
+
+SheetStats Sheet::GetStats() const {
+    SheetStats stats;
+    stats_.Read(stats);
+    for (const auto& row : cells_) {
+        for (const auto& cell : row) {
+            stats.formula_cells += cell && cell->GetFormula() ? 1 : 0;
+        }
+    }
+    stats.dependency_cells = cell_dependants_.size();
+    for (const auto& [cell, dependants] : cell_dependants_) {
+        stats.dependency_edges += dependants.size();
+    }
+    for (const auto& [col, groups] : range_dependants_) {
+        for (const auto& [span, dependants] : groups) {
+            stats.dependency_edges += dependants.formulas.size();
+        }
+    }
+    return stats;
+}
+
 std::unique_ptr<SheetInterface> CreateSheet() {
     return std::make_unique<Sheet>();
 }
@@ -2,37 +2,354 @@
 
 #include "cell.h"
 #include "common.h"
+#include "journal.h"
+#include "lookup_index.h"
+#include "memory_usage.h"
+#include "number_columns.h"
+#include "sheet_stats.h"
+#include "tracer.h"
+#include "worker_pool.h"
 
+#include <chrono>
+#include <exception>
 #include <functional>
+#include <map>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
-class Sheet : public SheetInterface {
+class WriteAheadLog;
+
+class Sheet : public SheetInterface, public FormulaSheetAccess {
 public:
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
 
+    // Задаёт содержимое набора ячеек так же, как последовательные вызовы
+    // SetCell(), но формулы предварительно разбираются в threads потоках.
+    // Зависимости связываются в вызывающем потоке в порядке следования ячеек.
+    void SetCells(std::vector<std::pair<Position, std::string>> cells,
+        unsigned threads = std::thread::hardware_concurrency());
+    // То же, но ячейка с ошибкой не прерывает набор: её исключение
+    // возвращается под её индексом, а остальные ячейки задаются
+    std::vector<std::exception_ptr> TrySetCells(std::vector<std::pair<Position, std::string>> cells,
+        unsigned threads = std::thread::hardware_concurrency());
+
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
+    const double* FindNumber(Position pos) const override {
+        return numbers_.Find(pos);
+    }
+
+    std::optional<int> MatchRow(double key, int col, int first_row, int last_row) const override {
+        return lookup_index_.Find(key, col, first_row, last_row);
+    }
+
+    // Доступ к ячейке без проверки позиции и приведения типа, для внутренних
+    // обходов графа зависимостей
+    const Cell* GetConcreteCell(Position pos) const;
+    Cell* GetConcreteCell(Position pos);
+
     void ClearCell(Position pos) override;
 
+    // Копирует содержимое ячейки source во все ячейки прямоугольника target,
+    // как протягивание: ссылки формулы сдвигаются на смещение ячейки от
+    // source. Формула не разбирается заново, а циклы ищутся одним обходом
+    // для всей области. Если появился цикл, таблица не меняется и бросается
+    // CircularDependencyException.
+    void FillRange(Position source, const FormulaProgram::Range& target);
+
+    // Отменяет последнюю правку или группу правок. Возвращает false, если
+    // отменять нечего. Вставка и удаление строк и столбцов очищают историю.
+    // Между BeginEdit() и EndEdit() бросает std::logic_error, таблица не
+    // меняется.
+    bool Undo();
+    // Повторяет последнюю отменённую правку. Как и Undo(), не вызывается между
+    // BeginEdit() и EndEdit().
+    bool Redo();
+    // Правки между BeginEdit() и EndEdit() отменяются как одна. SetCells() и
+    // FillRange() группируют свои правки сами.
+    void BeginEdit() {
+        journal_.Begin();
+    }
+    void EndEdit() {
+        journal_.End();
+    }
+    // Ограничивает память истории правок. История ведётся, только когда
+    // задан ненулевой бюджет.
+    void SetJournalBudget(std::size_t bytes) {
+        journal_.SetBudget(bytes);
+    }
+    const Journal& GetJournal() const {
+        return journal_;
+    }
+
+    // Вставляет count пустых строк перед строкой before. Ячейки ниже
+    // сдвигаются, ссылки формул на них переносятся без повторного разбора.
+    // Бросает InvalidPositionException, если непустые ячейки ушли бы за
+    // край таблицы.
+    void InsertRows(int before, int count = 1);
+    // Удаляет count строк начиная с first. Ссылки формул на удалённые ячейки
+    // становятся ошибкой #REF!.
+    void DeleteRows(int first, int count = 1);
+    // То же для столбцов
+    void InsertCols(int before, int count = 1);
+    void DeleteCols(int first, int count = 1);
+
     Size GetPrintableSize() const override;
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Вычисляет все формулы таблицы, протянутые по столбцу формулы - пакетно
+    // (см. ColumnEvaluator). Значения сохраняются в кэше ячеек.
+    void EvaluateBatched();
+
+    // Счётчики производительности, см. SheetStats. Накопительные счётчики
+    // суммируются по потокам, остальные поля считаются при вызове обходом
+    // таблицы и графа зависимостей.
+    SheetStats GetStats() const;
+    void ResetStats() {
+        stats_.Reset();
+    }
+    // Счётчики, в которые пишут ячейки и вычислители
+    StatsCounters& GetStatsCounters() const {
+        return stats_;
+    }
+
+    // Память таблицы по подсистемам, см. SheetMemoryUsage. Счётчики
+    // обновляются при каждой правке, поэтому вызов не обходит таблицу;
+    // вставка и удаление строк и столбцов пересчитывают их заново.
+    SheetMemoryUsage GetMemoryUsage() const;
+
+    // Итоги вызова RecalcFor()
+    struct RecalcProgress {
+        // формулы, сброшенные и вычисленные за вызов
+        std::size_t invalidated = 0;
+        std::size_t evaluated = 0;
+        // ячейки, от которых ещё не сброшены зависящие, и сброшенные
+        // формулы, ожидающие вычисления (с повторами)
+        std::size_t pending_invalidations = 0;
+        std::size_t pending_evaluations = 0;
+
+        // Сброшены ли все устаревшие значения. Тогда GetValue() любой ячейки
+        // возвращает актуальное значение, досчитывая недостающие сам.
+        bool IsConsistent() const {
+            return pending_invalidations == 0;
+        }
+        // Все сброшенные формулы вычислены заново
+        bool IsComplete() const {
+            return pending_invalidations == 0 && pending_evaluations == 0;
+        }
+    };
+
+    // Включает пошаговый пересчёт. Правка тогда сбрасывает кэш только самой
+    // ячейки, а зависящие от неё формулы сбрасываются и вычисляются заново
+    // порциями в RecalcFor(), так что одна правка не задерживает вызывающего
+    // на всё время пересчёта. Пока сброс не закончен, GetValue() зависящих
+    // ячеек может вернуть прежнее значение. Выключение сразу доводит сброс до
+    // конца, а невычисленные формулы оставляет на GetValue().
+    void SetIncrementalRecalc(bool enabled);
+    // Продвигает пересчёт, пока не истечёт budget, но хотя бы на один шаг.
+    // Сначала сбрасываются устаревшие значения, затем вычисляются сброшенные
+    // формулы; новые правки между вызовами встают в ту же очередь.
+    RecalcProgress RecalcFor(std::chrono::nanoseconds budget);
+
+    // Подкачка числовых ячеек, см. NumberColumns::SetPaging(). Ячейки с
+    // текстом и формулами всегда остаются в памяти. Представления числовых
+    // ячеек, выданные GetCell(), тоже не вытесняются: как и указатель на
+    // любую ячейку, они действительны до изменения самой ячейки.
+    void SetNumberPaging(const std::string& spill_path, std::size_t memory_budget);
+    NumberColumns::PagingStats GetNumberPagingStats() const {
+        return numbers_.GetPagingStats();
+    }
+
+    // Подключает журнал упреждающей записи, в который попадает каждое
+    // изменение ячеек; nullptr отключает его. Журнал должен жить, пока
+    // подключён.
+    void SetWriteAheadLog(WriteAheadLog* log) {
+        write_ahead_log_ = log;
+    }
+    // Применяет состояние ячейки из журнала упреждающей записи. В отличие от
+    // SetCell() не проверяет циклы: промежуточные состояния отмены могут их
+    // содержать. Правка не попадает в историю отмены.
+    void RestoreCell(Position pos, std::string text);
+    // Вызывает function(pos, text) для каждой непустой ячейки: сначала
+    // ячейки с объектом Cell по строкам, затем числа по столбцам
+    template <typename Function>
+    void ForEachText(Function function) const {
+        for (std::size_t row = 0; row < cells_.size(); ++row) {
+            for (std::size_t col = 0; col < cells_[row].size(); ++col) {
+                if (const Cell* cell = cells_[row][col].get()) {
+                    if (std::string text = cell->GetText(); !text.empty()) {
+                        function(Position{ static_cast<int>(row), static_cast<int>(col) }, std::string_view(text));
+                    }
+                }
+            }
+        }
+        numbers_.ForEach([&function](Position pos, double value) {
+            const std::string text = NumberColumns::Format(value);
+            function(pos, std::string_view(text));
+        });
+    }
+
+    // Трассировка этапов правок и вычислений формул, см. Tracer. Запускается
+    // через GetTracer().Start().
+    Tracer& GetTracer() {
+        return tracer_;
+    }
+    const Tracer& GetTracer() const {
+        return tracer_;
+    }
+
+    // Общий пул текстов ячеек таблицы
+    StringPool& GetStringPool() {
+        return string_pool_;
+    }
+    const StringPool& GetStringPool() const {
+        return string_pool_;
+    }
+
 
     void IsPositionValid(Position& pos) const;
 
-    bool CellHasCurcularDependency(Cell* cell, Position pos);
+    bool CellHasCurcularDependency(PositionSpan incoming, const std::vector<FormulaProgram::Range>& ranges,
+        Position pos);
     void DeleteDependances(Position pos);
-    void CreateDependances(Position pos);
+    void UpdateDependances(Position pos, PositionSpan old_cells, PositionSpan new_cells);
+    void UpdateRangeDependances(Position pos, const std::vector<FormulaProgram::Range>& old_ranges,
+        const std::vector<FormulaProgram::Range>& new_ranges);
     void InvalidateCacheStartingWith(Position pos);
+    // Сообщает, что формула с такими диапазонами вычислена и её кэш нужно
+    // сбрасывать при изменениях в диапазонах
+    void MarkRangesEvaluated(const std::vector<FormulaProgram::Range>& ranges) const;
+    // Учитывает изменение памяти формулы ячейки таблицы после вычисления
+    void ResizeFormulaMemory(std::size_t before, std::size_t after);
+    // Область печати; в отличие от GetPrintableSize() хранится между вызовами
+    const Size& GetPrintSize() const;
 
 private:
+    void ParseFormulas(const std::vector<std::pair<Position, std::string>>& cells,
+        std::vector<std::optional<Cell::Content>>& formulas, std::vector<std::exception_ptr>& errors,
+        unsigned threads);
+    // Общая часть SetCells() и TrySetCells(); без failures первая ошибка
+    // бросается
+    void CommitCells(std::vector<std::pair<Position, std::string>> cells, unsigned threads,
+        std::vector<std::exception_ptr>* failures);
+    // Cell::Parse() с учётом разобранных формул в счётчиках
+    Cell::Content ParseCell(Position pos, std::string text);
+    // Устанавливает разобранное из text содержимое, проверив его на циклы
+    void CommitCell(Position pos, Cell::Content content, const std::string& text);
+    // Значение формулы в cell вычисляется без обхода цепочки: все её
+    // ячейки-операнды пусты, не формулы или уже в кэше, диапазонов нет
+    bool HasCachedOperands(const Cell& cell) const;
+    Cell* GetOrCreateCell(Position pos);
+
+    // Меняет состояние ячейки на state и возвращает в state прежнее.
+    // Зависимости и индекс поиска обновляются, кэш не сбрасывается. Исходный
+    // text, если известен, избавляет журнал упреждающей записи от печати
+    // формулы.
+    void ExchangeCellState(Position pos, CellState& state, const std::string* text = nullptr);
+    // Применяет запись журнала; состояния в ней заменяются вытесненными
+    void ApplyJournalEntry(Journal::Entry& entry, bool reverse);
+    // Есть ли цикл, проходящий через одну из ячеек starts
+    bool HasCycleThrough(const std::vector<Position>& starts) const;
+    void SetNumber(Position pos, double value);
+    // Общая часть вставки и удаления строк и столбцов
+    void ShiftCells(const PositionShift& shift);
+    void ShiftStorage(const PositionShift& shift);
+    void ShiftDependances(const PositionShift& shift);
+    // Пересчитывает счётчики памяти обходом таблицы и графа зависимостей
+    void RecountMemory();
+    bool EraseNumber(Position pos);
+    // Шаг сброса кэша: снимает ячейку со стека invalidated, сбрасывает её кэш
+    // и кладёт в стек зависящие ячейки с кэшем. Сброшенную формулу добавляет
+    // в dirty, если он задан. Возвращает true, если у ячейки был кэш.
+    bool InvalidateNext(std::vector<Position>& invalidated, std::vector<Position>* dirty);
+    // Шаг вычисления с вершины recalc_.evaluating. Возвращает true, если
+    // формула вычислена.
+    bool EvaluateNext();
+    // Вызывает function для каждой формулы, которая зависит от ячейки pos
+    // напрямую или через диапазон функции поиска. При evaluated_only формулы
+    // диапазонов, ни одна из которых не вычислялась, пропускаются, а отметка о
+    // вычислении снимается.
+    template <typename Function>
+    void ForEachDependant(Position pos, bool evaluated_only, Function function) const;
+
+    // пул объявлен раньше ячеек, чтобы пережить их при разрушении таблицы
+    StringPool string_pool_;
+    // Числовые ячейки хранятся в numbers_, в cells_ на их месте nullptr
     std::vector<std::vector<std::unique_ptr<Cell>>> cells_;
-    Size print_size_;
+    NumberColumns numbers_;
+    // представления числовых ячеек, выданные через GetCell(); живут, пока
+    // ячейка не изменится
+    mutable std::unordered_map<Position, NumberCell, PositionHasher> number_cells_;
+    // Область печати после очистки ячеек пересчитывается лениво, при
+    // следующем обращении через GetPrintSize()
+    mutable Size print_size_;
+    mutable bool print_size_stale_ = false;
+    mutable LookupIndex lookup_index_{ *this };
+    // журнал хранит содержимое ячеек с текстом из пула, поэтому объявлен после пула
+    Journal journal_;
+    mutable StatsCounters stats_;
+    Tracer tracer_;
 
     std::unordered_map<Position, std::unordered_set<Position, PositionHasher>, PositionHasher> cell_dependants_;
+    struct RangeDependants {
+        std::unordered_set<Position, PositionHasher> formulas;
+        // Вычислялась ли какая-то из формул с момента последнего сброса. Пока
+        // нет, изменения в диапазоне не требуют обхода formulas.
+        mutable bool evaluated = false;
+    };
+    // столбец -> (первая строка, последняя строка) -> формулы, которые
+    // просматривают эти строки функциями поиска
+    std::unordered_map<int, std::map<std::pair<int, int>, RangeDependants>> range_dependants_;
+
+    // Память, которая учитывается по мере правок; остальное в
+    // GetMemoryUsage() берётся из размеров контейнеров
+    struct MemoryCounters {
+        std::size_t cells = 0;
+        // ёмкость строк cells_
+        std::size_t row_slots = 0;
+        std::size_t contents = 0;
+        std::size_t formulas = 0;
+        // множества в cell_dependants_ и formulas в range_dependants_
+        std::size_t dependant_sets = 0;
+        std::size_t range_groups = 0;
+
+        void Add(const Cell::ContentMemory& memory) {
+            contents += memory.content;
+            formulas += memory.formula;
+        }
+        void Remove(const Cell::ContentMemory& memory) {
+            contents -= memory.content;
+            formulas -= memory.formula;
+        }
+    };
+    MemoryCounters memory_;
+
+    WriteAheadLog* write_ahead_log_ = nullptr;
+
+    // Очереди пошагового пересчёта, см. SetIncrementalRecalc()
+    struct RecalcQueue {
+        bool enabled = false;
+        // ячейки, от которых ещё не сброшены зависящие
+        std::vector<Position> invalidated;
+        // сброшенные формулы, которые предстоит вычислить
+        std::vector<Position> dirty;
+        // стек обхода в глубину: формула и её ещё не вычисленные ссылки
+        std::vector<Position> evaluating;
+        // ссылки, найденные Cell::TryEvaluate() за шаг; память переиспользуется
+        std::vector<const Cell*> unevaluated;
+    };
+    RecalcQueue recalc_;
+
+    // потоки разбора формул в SetCells() и TrySetCells()
+    WorkerPool workers_;
 
-};
\ No newline at end of file
+};
\ No newline at end of file
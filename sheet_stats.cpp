@@ -0,0 +1,36 @@
+#include "sheet_stats.h"
+
+#include <algorithm>
+
+void StatsCounters::Read(SheetStats& stats) const {
+    std::array<std::uint64_t, COUNTER_COUNT> totals{};
+    blocks_.ForEach([&totals](const Block& block) {
+        for (int counter = 0; counter < COUNTER_COUNT; ++counter) {
+            const std::uint64_t value = block.values[counter].load(std::memory_order_relaxed);
+            totals[counter] = counter == MaxInvalidatedCells
+                ? std::max(totals[counter], value)
+                : totals[counter] + value;
+        }
+    });
+
+    stats.formulas_parsed = totals[FormulasParsed];
+    stats.parse_ns = totals[ParseNs];
+    stats.cache_hits = totals[CacheHits];
+    stats.cache_misses = totals[CacheMisses];
+    stats.evaluations = totals[Evaluations];
+    stats.invalidations = totals[Invalidations];
+    stats.invalidated_cells = totals[InvalidatedCells];
+    stats.max_invalidated_cells = totals[MaxInvalidatedCells];
+    stats.cycle_checks = totals[CycleChecks];
+    stats.cycle_check_visits = totals[CycleCheckVisits];
+    stats.printable_size_calls = totals[PrintableSizeCalls];
+    stats.printable_size_ns = totals[PrintableSizeNs];
+}
+
+void StatsCounters::Reset() {
+    blocks_.ForEach([](Block& block) {
+        for (auto& value : block.values) {
+            value.store(0, std::memory_order_relaxed);
+        }
+    });
+}
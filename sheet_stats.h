@@ -0,0 +1,125 @@
+#pragma once
+
+#include "per_thread.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Снимок счётчиков производительности таблицы, см. Sheet::GetStats().
+// Накопительные счётчики считаются с создания таблицы или с последнего
+// Sheet::ResetStats(), остальные поля описывают таблицу в момент чтения.
+// Если таблица собрана без SPREADSHEET_ENABLE_STATS, накопительные
+// счётчики всегда нулевые.
+struct SheetStats {
+    // разобранные формулы и время их разбора
+    std::uint64_t formulas_parsed = 0;
+    std::uint64_t parse_ns = 0;
+    // чтения значений формул с готовым кэшем и без него, включая чтения
+    // операндов другими формулами
+    std::uint64_t cache_hits = 0;
+    std::uint64_t cache_misses = 0;
+    // вычисления формул, включая пакетные; среднее на ячейку -
+    // evaluations / formula_cells
+    std::uint64_t evaluations = 0;
+    // сбросы кэша после правок и число сброшенных ими зависимых ячеек
+    std::uint64_t invalidations = 0;
+    std::uint64_t invalidated_cells = 0;
+    std::uint64_t max_invalidated_cells = 0;
+    // проверки на циклы и пройденные ими ячейки
+    std::uint64_t cycle_checks = 0;
+    std::uint64_t cycle_check_visits = 0;
+    // вызовы GetPrintableSize() и время в нём
+    std::uint64_t printable_size_calls = 0;
+    std::uint64_t printable_size_ns = 0;
+
+    std::size_t formula_cells = 0;
+    // ячейки, от которых кто-то зависит, и рёбра графа зависимостей, включая
+    // формулы с диапазонами функций поиска
+    std::size_t dependency_cells = 0;
+    std::size_t dependency_edges = 0;
+};
+
+// Накопительные счётчики. У каждого потока свой блок (см. PerThread), в
+// который пишет только он сам, поэтому запись - это чтение и запись без
+// атомарных read-modify-write и без общих кэш-линий. Чтение суммирует блоки всех
+// потоков. При сборке без SPREADSHEET_ENABLE_STATS методы ничего не делают.
+class StatsCounters {
+public:
+    enum Counter {
+        FormulasParsed,
+        ParseNs,
+        CacheHits,
+        CacheMisses,
+        Evaluations,
+        Invalidations,
+        InvalidatedCells,
+        MaxInvalidatedCells,
+        CycleChecks,
+        CycleCheckVisits,
+        PrintableSizeCalls,
+        PrintableSizeNs,
+        COUNTER_COUNT,
+    };
+
+    void Add(Counter counter, std::uint64_t value) {
+#ifdef SPREADSHEET_ENABLE_STATS
+        auto& slot = blocks_.Get().values[counter];
+        slot.store(slot.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+#endif
+    }
+
+    // Запоминает наибольшее значение; для MaxInvalidatedCells
+    void Max(Counter counter, std::uint64_t value) {
+#ifdef SPREADSHEET_ENABLE_STATS
+        auto& slot = blocks_.Get().values[counter];
+        if (value > slot.load(std::memory_order_relaxed)) {
+            slot.store(value, std::memory_order_relaxed);
+        }
+#endif
+    }
+
+    // Заполняет накопительные поля stats
+    void Read(SheetStats& stats) const;
+    // Обнуляет счётчики. Запись, идущая в этот момент в другом потоке, может
+    // пережить обнуление.
+    void Reset();
+
+private:
+    struct Block {
+        std::array<std::atomic<std::uint64_t>, COUNTER_COUNT> values{};
+    };
+
+    PerThread<Block> blocks_;
+};
+
+// Добавляет к счётчику время своей жизни в наносекундах
+class StatsTimer {
+public:
+    StatsTimer(StatsCounters& counters, StatsCounters::Counter counter)
+#ifdef SPREADSHEET_ENABLE_STATS
+        : counters_(counters)
+        , counter_(counter)
+        , start_(std::chrono::steady_clock::now())
+#endif
+    {
+    }
+
+    StatsTimer(const StatsTimer&) = delete;
+    StatsTimer& operator=(const StatsTimer&) = delete;
+
+    ~StatsTimer() {
+#ifdef SPREADSHEET_ENABLE_STATS
+        const auto duration = std::chrono::steady_clock::now() - start_;
+        counters_.Add(counter_, std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+#endif
+    }
+
+#ifdef SPREADSHEET_ENABLE_STATS
+private:
+    StatsCounters& counters_;
+    StatsCounters::Counter counter_;
+    std::chrono::steady_clock::time_point start_;
+#endif
+};
@@ -0,0 +1,45 @@
+#include "string_pool.h"
+
+namespace {
+    // Память текста вне объекта строки; короткие строки хранятся в нём самом
+    std::size_t GetTextMemoryUsage(const std::string& text) {
+        return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+    }
+}  // namespace
+
+StringPool::Handle StringPool::Intern(std::string_view text) {
+    auto it = index_.find(text);
+    if (it != index_.end()) {
+        ++entries_[it->second].references;
+        return it->second;
+    }
+
+    Handle handle;
+    if (!free_handles_.empty()) {
+        handle = free_handles_.back();
+        free_handles_.pop_back();
+    }
+    else {
+        handle = static_cast<Handle>(entries_.size());
+        entries_.emplace_back();
+    }
+
+    Entry& entry = entries_[handle];
+    entry.text.assign(text);
+    entry.references = 1;
+    text_bytes_ += GetTextMemoryUsage(entry.text);
+    index_.emplace(entry.text, handle);
+    return handle;
+}
+
+void StringPool::Release(Handle handle) {
+    Entry& entry = entries_[handle];
+    if (--entry.references > 0) {
+        return;
+    }
+
+    index_.erase(entry.text);
+    text_bytes_ -= GetTextMemoryUsage(entry.text);
+    std::string().swap(entry.text);
+    free_handles_.push_back(handle);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "memory_usage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Пул строк таблицы. Одинаковые тексты ячеек хранятся в одном экземпляре, а
+// ячейки держат только дескриптор, поэтому память растёт с числом различных
+// строк, а не с числом ячеек. Строка освобождается вместе с последней
+// ссылкой на неё.
+class StringPool {
+public:
+    using Handle = std::uint32_t;
+
+    StringPool() = default;
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    // Возвращает дескриптор строки и увеличивает число ссылок на неё
+    Handle Intern(std::string_view text);
+    void Release(Handle handle);
+
+    // Представление действительно, пока на строку есть ссылки
+    std::string_view Get(Handle handle) const {
+        return entries_[handle].text;
+    }
+
+    // Число различных строк в пуле
+    std::size_t Size() const {
+        return index_.size();
+    }
+
+    // Память пула вместе с текстами; учитывается по мере изменений
+    std::size_t GetMemoryUsage() const {
+        return sizeof(Entry) * entries_.size() + text_bytes_
+            + sizeof(Handle) * free_handles_.capacity() + GetHashTableMemoryUsage(index_);
+    }
+
+private:
+    struct Entry {
+        std::string text;
+        std::uint32_t references = 0;
+    };
+
+    // deque не перемещает элементы при добавлении, поэтому ключи индекса
+    // остаются действительными
+    std::deque<Entry> entries_;
+    std::vector<Handle> free_handles_;
+    std::unordered_map<std::string_view, Handle> index_;
+    // тексты, не поместившиеся в объект строки
+    std::size_t text_bytes_ = 0;
+};
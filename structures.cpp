@@ -3,6 +3,7 @@
 #include <cctype>
 #include <sstream>
 #include <algorithm>
+#include <tuple>
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
@@ -30,7 +31,9 @@ std::string_view FormulaError::ToString() const {
     case FormulaError::Category::Value: 
         return "#VALUE!"; break;
     case FormulaError::Category::Div0: 
-        return "#DIV0!"; break;
+        return "#DIV/0!"; break;
+    case FormulaError::Category::NA:
+        return "#N/A"; break;
     case FormulaError::Category::Unknown:
         return "#Unknown"; break;
     }
@@ -45,7 +48,7 @@ bool Position::operator==(const Position rhs) const {
 }
 
 bool Position::operator<(const Position rhs) const {
-	return  row < rhs.row || col < rhs.col;
+    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
 }
 
 bool Position::IsValid() const {
@@ -107,4 +110,4 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,129 @@
+// Генератор синтетических таблиц для нагрузочных замеров, см. WorkbookShape.
+// Выводит таблицу в stdout в виде журнала команд или TSV.
+//
+// Параметры:
+//   --seed N                      зерно генератора
+//   --rows N --cols N             прямоугольник случайных ячеек
+//   --density X                   доля непустых ячеек
+//   --formulas X                  доля формул среди непустых ячеек
+//   --text X                      доля текста среди остальных ячеек
+//   --errors X                    доля формул - источников ошибки
+//   --fan-in MIN:MAX[:SKEW]       число ссылок в формуле
+//   --fan-out-skew X              смещение ссылок к немногим ячейкам
+//   --chains N:DEPTH              цепочки
+//   --diamonds N:LAYERS:WIDTH     решётки ромбов
+//   --fill-down N                 протянутые столбцы
+//   --format log|tsv              формат вывода, по умолчанию log
+
+#include "workbook_generator.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+    [[noreturn]] void Fail(const std::string& message) {
+        std::cerr << message << std::endl;
+        std::exit(2);
+    }
+
+    // Разбирает "A:B:C" в count чисел; последние optional чисел можно опустить
+    std::vector<double> ParseTuple(const std::string& value, std::size_t count, std::size_t optional = 0) {
+        std::vector<double> numbers;
+        std::istringstream input(value);
+        std::string part;
+        while (std::getline(input, part, ':')) {
+            numbers.push_back(std::stod(part));
+        }
+        if (numbers.size() > count || numbers.size() + optional < count) {
+            Fail("Invalid value " + value);
+        }
+        return numbers;
+    }
+}  // namespace
+
+int main(int argc, char** argv) {
+    WorkbookShape shape;
+    std::string format = "log";
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            Fail("Missing value for " + arg);
+        }
+        const std::string value = argv[++i];
+        try {
+            if (arg == "--seed") {
+                shape.seed = std::stoull(value);
+            }
+            else if (arg == "--rows") {
+                shape.rows = std::stoi(value);
+            }
+            else if (arg == "--cols") {
+                shape.cols = std::stoi(value);
+            }
+            else if (arg == "--density") {
+                shape.density = std::stod(value);
+            }
+            else if (arg == "--formulas") {
+                shape.formula_ratio = std::stod(value);
+            }
+            else if (arg == "--text") {
+                shape.text_ratio = std::stod(value);
+            }
+            else if (arg == "--errors") {
+                shape.error_ratio = std::stod(value);
+            }
+            else if (arg == "--fan-in") {
+                const auto numbers = ParseTuple(value, 3, 1);
+                shape.fan_in = { static_cast<int>(numbers[0]), static_cast<int>(numbers[1]),
+                    numbers.size() > 2 ? numbers[2] : 1.0 };
+            }
+            else if (arg == "--fan-out-skew") {
+                shape.fan_out.skew = std::stod(value);
+            }
+            else if (arg == "--chains") {
+                const auto numbers = ParseTuple(value, 2);
+                shape.chains = static_cast<int>(numbers[0]);
+                shape.chain_depth = static_cast<int>(numbers[1]);
+            }
+            else if (arg == "--diamonds") {
+                const auto numbers = ParseTuple(value, 3);
+                shape.diamonds = static_cast<int>(numbers[0]);
+                shape.diamond_layers = static_cast<int>(numbers[1]);
+                shape.diamond_width = static_cast<int>(numbers[2]);
+            }
+            else if (arg == "--fill-down") {
+                shape.fill_down_columns = std::stoi(value);
+            }
+            else if (arg == "--format") {
+                format = value;
+            }
+            else {
+                Fail("Unknown option " + arg);
+            }
+        }
+        catch (const std::logic_error&) {
+            Fail("Invalid value " + value + " for " + arg);
+        }
+    }
+
+    try {
+        const WorkbookGenerator generator(shape);
+        if (format == "log") {
+            generator.WriteCommandLog(std::cout);
+        }
+        else if (format == "tsv") {
+            generator.WriteTsv(std::cout);
+        }
+        else {
+            Fail("Unknown format " + format);
+        }
+    }
+    catch (const InvalidPositionException& error) {
+        Fail(error.what());
+    }
+    return 0;
+}
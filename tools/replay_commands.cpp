@@ -0,0 +1,91 @@
+// Воспроизводит журнал команд (см. command_log.h) над таблицей CreateSheet()
+// и выводит в stdout JSON с задержками по типам команд и общей
+// пропускной способностью.
+//
+// Параметры:
+//   --input FILE              журнал, по умолчанию stdin
+//   --timing max|original     с наибольшей скоростью или со временем из
+//                             журнала, по умолчанию max
+
+#include "command_log.h"
+#include "common.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+    [[noreturn]] void Fail(const std::string& message) {
+        std::cerr << message << std::endl;
+        std::exit(2);
+    }
+
+    void PrintJson(std::ostream& output, const ReplayReport& report) {
+        output << "{\n  \"commands\": " << report.GetCommandCount() << ",\n  \"elapsed_ns\": "
+               << report.elapsed.count() << ",\n  \"commands_per_second\": " << report.GetThroughput()
+               << ",\n  \"operations\": [";
+        bool first = true;
+        for (std::size_t type = 0; type < Command::TYPE_COUNT; ++type) {
+            const auto& operation = report.operations[type];
+            const LatencyHistogram& latency = operation.latency;
+            if (latency.GetCount() == 0) {
+                continue;
+            }
+            output << (first ? "\n" : ",\n");
+            first = false;
+            output << "    { \"name\": \"" << Command::GetName(static_cast<Command::Type>(type))
+                   << "\", \"count\": " << latency.GetCount() << ", \"errors\": " << operation.errors
+                   << ", \"mean_ns\": " << latency.GetTotal() / latency.GetCount()
+                   << ", \"p50_ns\": " << latency.GetPercentile(0.5)
+                   << ", \"p99_ns\": " << latency.GetPercentile(0.99)
+                   << ", \"p999_ns\": " << latency.GetPercentile(0.999)
+                   << ", \"max_ns\": " << latency.GetMax() << " }";
+        }
+        output << "\n  ]\n}\n";
+    }
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::string input_path;
+    ReplayOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            Fail("Missing value for " + arg);
+        }
+        const std::string value = argv[++i];
+        if (arg == "--input") {
+            input_path = value;
+        }
+        else if (arg == "--timing") {
+            if (value != "max" && value != "original") {
+                Fail("Invalid value " + value + " for " + arg);
+            }
+            options.original_timing = value == "original";
+        }
+        else {
+            Fail("Unknown option " + arg);
+        }
+    }
+
+    std::ifstream file;
+    if (!input_path.empty()) {
+        file.open(input_path);
+        if (!file) {
+            Fail("Cannot open " + input_path);
+        }
+    }
+
+    try {
+        auto sheet = CreateSheet();
+        const ReplayReport report = ReplayCommands(*sheet, input_path.empty() ? std::cin : file, options);
+        PrintJson(std::cout, report);
+    }
+    catch (const std::invalid_argument& error) {
+        Fail(error.what());
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "tracer.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+void Tracer::Start(std::size_t spans_per_thread) {
+    enabled_.store(false, std::memory_order_relaxed);
+    capacity_.store(std::max<std::size_t>(spans_per_thread, 1), std::memory_order_relaxed);
+    session_.fetch_add(1, std::memory_order_relaxed);
+    origin_ = Clock::now();
+    enabled_.store(true, std::memory_order_release);
+}
+
+void Tracer::Stop() {
+    enabled_.store(false, std::memory_order_release);
+}
+
+// Первая запись потока после Start() начинает его буфер заново; память
+// прошлой записи сверх нового размера освобождается
+void Tracer::Record(const char* name, Position pos, Clock::time_point start, Clock::time_point end) const {
+    Ring& ring = rings_.Get();
+    const std::uint64_t session = session_.load(std::memory_order_relaxed);
+    if (ring.session.load(std::memory_order_relaxed) != session) {
+        ring.capacity = capacity_.load(std::memory_order_relaxed);
+        ring.spans.clear();
+        if (ring.spans.capacity() > ring.capacity) {
+            ring.spans.shrink_to_fit();
+        }
+        ring.written.store(0, std::memory_order_relaxed);
+        ring.session.store(session, std::memory_order_release);
+    }
+    const std::uint64_t index = ring.written.load(std::memory_order_relaxed);
+    const Span span{ name, pos, start, end, 0 };
+    if (ring.spans.size() < ring.capacity) {
+        ring.spans.push_back(span);
+    }
+    else {
+        ring.spans[index % ring.capacity] = span;
+    }
+    ring.written.store(index + 1, std::memory_order_release);
+}
+
+std::vector<Tracer::Span> Tracer::GetSpans() const {
+    std::vector<Span> spans;
+    int thread = 0;
+    const std::uint64_t session = session_.load(std::memory_order_relaxed);
+    rings_.ForEach([&](const Ring& ring) {
+        // поток не писал после последнего Start()
+        if (ring.session.load(std::memory_order_acquire) != session) {
+            ++thread;
+            return;
+        }
+        const std::uint64_t written = ring.written.load(std::memory_order_acquire);
+        const std::size_t size = ring.spans.size();
+        const std::uint64_t first = written > size ? written - size : 0;
+        for (std::uint64_t i = first; i < written; ++i) {
+            spans.push_back(ring.spans[i % size]);
+            spans.back().thread = thread;
+        }
+        ++thread;
+    });
+    std::stable_sort(spans.begin(), spans.end(), [](const Span& lhs, const Span& rhs) {
+        return lhs.start < rhs.start;
+    });
+    return spans;
+}
+
+void Tracer::WriteChromeTrace(std::ostream& output) const {
+    auto microseconds = [](Clock::duration duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    };
+
+    const auto flags = output.flags();
+    output << std::fixed << std::setprecision(3);
+    output << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    bool first = true;
+    for (const Span& span : GetSpans()) {
+        output << (first ? "\n" : ",\n");
+        first = false;
+        output << "{\"name\":\"" << span.name << "\",\"cat\":\"sheet\",\"ph\":\"X\",\"pid\":1,\"tid\":" << span.thread
+               << ",\"ts\":" << microseconds(span.start - origin_) << ",\"dur\":" << microseconds(span.end - span.start);
+        if (span.pos.IsValid()) {
+            output << ",\"args\":{\"cell\":\"" << span.pos.ToString() << "\"}";
+        }
+        output << "}";
+    }
+    output << "\n]}\n";
+    output.flags(flags);
+}
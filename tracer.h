@@ -0,0 +1,104 @@
+#pragma once
+
+#include "common.h"
+#include "per_thread.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+// Трассировка операций таблицы: интервалы с именем этапа и позицией ячейки.
+// Каждый поток пишет интервалы в собственный кольцевой буфер без блокировок,
+// при переполнении затираются самые старые. Результат выгружается в формате
+// Chrome trace event (открывается в chrome://tracing и Perfetto).
+// Пока трассировка не запущена, TraceScope стоит одну relaxed-загрузку
+// флага. При сборке без SPREADSHEET_ENABLE_TRACE TraceScope пуст.
+class Tracer {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Span {
+        // строковый литерал
+        const char* name = nullptr;
+        Position pos = Position::NONE;
+        Clock::time_point start;
+        Clock::time_point end;
+        // номер потока в порядке первой записи, заполняет GetSpans()
+        int thread = 0;
+    };
+
+    // Начинает запись заново, не больше spans_per_thread интервалов на поток.
+    // Буферы других потоков не трогает: поток сам начинает свой заново при
+    // первой записи после Start(), поэтому вызывать можно и во время работы
+    // таблицы.
+    void Start(std::size_t spans_per_thread = 1 << 16);
+    void Stop();
+    bool IsEnabled() const {
+        return enabled_.load(std::memory_order_relaxed);
+    }
+
+    // Пишет в буфер вызывающего потока
+    void Record(const char* name, Position pos, Clock::time_point start, Clock::time_point end) const;
+
+    // Записанные интервалы всех потоков. Вызывать, когда таблица не
+    // выполняет операций, например после Stop().
+    std::vector<Span> GetSpans() const;
+    // Интервалы в формате Chrome trace event: события "X" с позицией ячейки
+    // в args; время в микросекундах от Start()
+    void WriteChromeTrace(std::ostream& output) const;
+
+private:
+    // Буфер пишет только его поток; written растёт монотонно, интервал с
+    // номером i лежит в spans[i % capacity]. spans растёт по мере записи до
+    // capacity, так что редко пишущий поток не держит полный буфер.
+    struct Ring {
+        std::vector<Span> spans;
+        std::size_t capacity = 0;
+        std::atomic<std::uint64_t> written{ 0 };
+        // номер Start(), к которому относятся интервалы
+        std::atomic<std::uint64_t> session{ 0 };
+    };
+
+    std::atomic<bool> enabled_{ false };
+    std::atomic<std::size_t> capacity_{ 0 };
+    std::atomic<std::uint64_t> session_{ 0 };
+    Clock::time_point origin_;
+    mutable PerThread<Ring> rings_;
+};
+
+// Записывает интервал от создания до разрушения, если трассировка запущена
+class TraceScope {
+public:
+#ifdef SPREADSHEET_ENABLE_TRACE
+    TraceScope(const Tracer& tracer, const char* name, Position pos = Position::NONE)
+        : tracer_(tracer.IsEnabled() ? &tracer : nullptr)
+        , name_(name)
+        , pos_(pos) {
+        if (tracer_) {
+            start_ = Tracer::Clock::now();
+        }
+    }
+
+    ~TraceScope() {
+        if (tracer_) {
+            tracer_->Record(name_, pos_, start_, Tracer::Clock::now());
+        }
+    }
+#else
+    TraceScope(const Tracer&, const char*, Position = Position::NONE) {
+    }
+#endif
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+#ifdef SPREADSHEET_ENABLE_TRACE
+private:
+    const Tracer* tracer_;
+    const char* name_;
+    Position pos_;
+    Tracer::Clock::time_point start_;
+#endif
+};
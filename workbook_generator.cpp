@@ -0,0 +1,185 @@
+#include "workbook_generator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std::literals;
+
+namespace {
+    // Случайные числа не зависят от реализации стандартной библиотеки:
+    // распределения std:: на разных платформах дают разные значения, поэтому
+    // числа получаются из генератора напрямую
+    class Random {
+    public:
+        explicit Random(std::uint64_t seed)
+            : engine_(seed) {
+        }
+
+        // равномерно на [0, 1)
+        double Uniform() {
+            return static_cast<double>(engine_() >> 11) * 0x1.0p-53;
+        }
+
+        bool Chance(double probability) {
+            return Uniform() < probability;
+        }
+
+        // номер из [0, count), при skew > 1 смещённый к нулю
+        std::size_t Index(std::size_t count, double skew) {
+            const auto index = static_cast<std::size_t>(count * std::pow(Uniform(), skew));
+            return std::min(index, count - 1);
+        }
+
+        int Sample(const IntDistribution& distribution) {
+            return distribution.min + static_cast<int>(Index(distribution.max - distribution.min + 1, distribution.skew));
+        }
+
+        std::string Number() {
+            return std::to_string(engine_() % 1000);
+        }
+
+    private:
+        std::mt19937_64 engine_;
+    };
+
+    int DivideCeil(int value, int divisor) {
+        return (value + divisor - 1) / divisor;
+    }
+}  // namespace
+
+WorkbookGenerator::WorkbookGenerator(WorkbookShape shape)
+    : shape_(std::move(shape)) {
+    if (shape_.rows < 1 || shape_.rows > Position::MAX_ROWS || shape_.cols < 0) {
+        throw InvalidPositionException("Workbook rows or columns are out of range"s);
+    }
+    if (shape_.fan_in.min < 1 || shape_.fan_in.max < shape_.fan_in.min) {
+        throw InvalidPositionException("Workbook fan-in is out of range"s);
+    }
+    if (shape_.chains < 0 || shape_.chain_depth < 0 || shape_.diamonds < 0 || shape_.fill_down_columns < 0
+        || shape_.diamond_layers < 0 || shape_.diamond_layers > Position::MAX_ROWS
+        || (shape_.diamonds > 0 && shape_.diamond_width < 2)) {
+        throw InvalidPositionException("Workbook structure is out of range"s);
+    }
+    if (GetColumnCount() > Position::MAX_COLS) {
+        throw InvalidPositionException("Workbook does not fit the sheet"s);
+    }
+}
+
+int WorkbookGenerator::GetColumnCount() const {
+    const long long chain_cols = static_cast<long long>(shape_.chains) * DivideCeil(shape_.chain_depth, shape_.rows);
+    const long long cols = shape_.cols + chain_cols
+        + static_cast<long long>(shape_.diamonds) * shape_.diamond_width
+        + 2LL * shape_.fill_down_columns;
+    return static_cast<int>(std::min<long long>(cols, Position::MAX_COLS + 1LL));
+}
+
+void WorkbookGenerator::Generate(const Emit& emit) const {
+    Random random(shape_.seed);
+
+    // Случайные ячейки. Формулы ссылаются на числа и формулы, созданные
+    // раньше, текст в ссылки не попадает.
+    std::vector<Position> values;
+    for (int row = 0; row < shape_.rows; ++row) {
+        for (int col = 0; col < shape_.cols; ++col) {
+            if (!random.Chance(shape_.density)) {
+                continue;
+            }
+            const Position pos{ row, col };
+            auto reference = [&] {
+                return values[random.Index(values.size(), shape_.fan_out.skew)].ToString();
+            };
+
+            if (random.Chance(shape_.formula_ratio) && !values.empty()) {
+                if (random.Chance(shape_.error_ratio)) {
+                    emit(pos, "=" + reference() + "/0");
+                }
+                else {
+                    // среднее ссылок не растёт с глубиной графа
+                    const int fan_in = random.Sample(shape_.fan_in);
+                    std::string text = fan_in > 1 ? "=(" : "=";
+                    for (int i = 0; i < fan_in; ++i) {
+                        text += (i > 0 ? "+" : "") + reference();
+                    }
+                    text += fan_in > 1 ? ")/" + std::to_string(fan_in) : "+1";
+                    emit(pos, text);
+                }
+                values.push_back(pos);
+            }
+            else if (random.Chance(shape_.text_ratio)) {
+                emit(pos, "text " + random.Number());
+            }
+            else {
+                emit(pos, random.Number());
+                values.push_back(pos);
+            }
+        }
+    }
+
+    int col = shape_.cols;
+
+    // цепочки продолжаются в следующем столбце, когда кончаются строки
+    for (int chain = 0; chain < shape_.chains; ++chain) {
+        for (int i = 0; i < shape_.chain_depth; ++i) {
+            const Position pos{ i % shape_.rows, col + i / shape_.rows };
+            if (i == 0) {
+                emit(pos, random.Number());
+            }
+            else {
+                const Position previous{ (i - 1) % shape_.rows, col + (i - 1) / shape_.rows };
+                emit(pos, "=" + previous.ToString() + "+1");
+            }
+        }
+        col += DivideCeil(shape_.chain_depth, shape_.rows);
+    }
+
+    for (int diamond = 0; diamond < shape_.diamonds; ++diamond) {
+        const int width = shape_.diamond_width;
+        for (int layer = 0; layer < shape_.diamond_layers; ++layer) {
+            for (int i = 0; i < width; ++i) {
+                if (layer == 0) {
+                    emit({ layer, col + i }, random.Number());
+                    continue;
+                }
+                const Position lhs{ layer - 1, col + i };
+                const Position rhs{ layer - 1, col + (i + 1) % width };
+                emit({ layer, col + i }, "=(" + lhs.ToString() + "+" + rhs.ToString() + ")/2");
+            }
+        }
+        col += shape_.diamond_width;
+    }
+
+    // нарастающий итог по столбцу чисел: одна формула, протянутая вниз
+    for (int fill = 0; fill < shape_.fill_down_columns; ++fill) {
+        for (int row = 0; row < shape_.rows; ++row) {
+            const Position number{ row, col };
+            emit(number, random.Number());
+            std::string text = "=" + number.ToString() + "*2";
+            if (row > 0) {
+                text += "+" + Position{ row - 1, col + 1 }.ToString();
+            }
+            emit({ row, col + 1 }, text);
+        }
+        col += 2;
+    }
+}
+
+void WorkbookGenerator::Fill(SheetInterface& sheet) const {
+    Generate([&sheet](Position pos, const std::string& text) {
+        sheet.SetCell(pos, text);
+    });
+}
+
+void WorkbookGenerator::WriteCommandLog(std::ostream& output) const {
+    Generate([&output](Position pos, const std::string& text) {
+        output << "SET\t" << pos.ToString() << '\t' << text << '\n';
+    });
+}
+
+void WorkbookGenerator::WriteTsv(std::ostream& output) const {
+    auto sheet = CreateSheet();
+    Fill(*sheet);
+    sheet->PrintTexts(output);
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+
+// Распределение целых чисел на [min, max]. При skew = 1 оно равномерное, при
+// skew > 1 значения сгущаются у min и редко доходят до max - так получается
+// тяжёлый хвост.
+struct IntDistribution {
+    int min = 0;
+    int max = 0;
+    double skew = 1.0;
+};
+
+// Параметры синтетической таблицы. Случайные ячейки занимают прямоугольник
+// rows x cols в левом верхнем углу, а цепочки, ромбы и протянутые столбцы
+// располагаются в отдельных столбцах правее него.
+struct WorkbookShape {
+    std::uint64_t seed = 1;
+
+    int rows = 1000;
+    int cols = 26;
+    // доля непустых ячеек прямоугольника
+    double density = 0.5;
+    // доля формул среди непустых ячеек
+    double formula_ratio = 0.3;
+    // доля текста среди остальных ячеек, прочие - числа
+    double text_ratio = 0.1;
+    // доля формул - источников ошибки #DIV/0!; ошибка распространяется на
+    // зависимые формулы
+    double error_ratio = 0.0;
+    // число ссылок в формуле
+    IntDistribution fan_in{ 1, 4, 1.0 };
+    // Выбор ячейки, на которую ссылается формула: номер среди уже созданных
+    // ячеек, смещённый к первым ячейкам при skew > 1, - несколько ячеек
+    // получают большую часть ссылок. min и max не используются.
+    IntDistribution fan_out{ 0, 0, 1.0 };
+
+    // цепочки вида A2 = A1 + 1 глубиной chain_depth
+    int chains = 0;
+    int chain_depth = 0;
+    // решётки ромбов: diamond_layers слоёв по diamond_width ячеек, каждая
+    // ячейка слоя ссылается на две соседние ячейки предыдущего
+    int diamonds = 0;
+    int diamond_layers = 0;
+    int diamond_width = 2;
+    // столбцы формул, протянутые на rows строк, каждый со столбцом чисел
+    int fill_down_columns = 0;
+};
+
+// Строит таблицу по WorkbookShape детерминированно: одинаковые параметры
+// дают одинаковые ячейки на любой платформе. Формулы ссылаются только на
+// созданные раньше ячейки, поэтому таблица не содержит циклов и её можно
+// задавать в порядке генерации.
+class WorkbookGenerator {
+public:
+    using Emit = std::function<void(Position pos, const std::string& text)>;
+
+    // Бросает InvalidPositionException, если таблица не помещается в
+    // пределы Position
+    explicit WorkbookGenerator(WorkbookShape shape);
+
+    // Вызывает emit для каждой непустой ячейки в порядке генерации
+    void Generate(const Emit& emit) const;
+
+    // Задаёт ячейки через SetCell()
+    void Fill(SheetInterface& sheet) const;
+
+    // Журнал команд: по строке "SET\t<ячейка>\t<текст>" на ячейку. Тексты
+    // генератора не содержат табуляций и переводов строк.
+    void WriteCommandLog(std::ostream& output) const;
+
+    // Таблица в формате TSV, как её печатает SheetInterface::PrintTexts()
+    void WriteTsv(std::ostream& output) const;
+
+    // Сколько столбцов займёт таблица
+    int GetColumnCount() const;
+
+private:
+    WorkbookShape shape_;
+};
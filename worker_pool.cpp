@@ -0,0 +1,61 @@
+#include "worker_pool.h"
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    task_ready_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkerPool::Run(unsigned threads, const std::function<void()>& task) {
+    const unsigned helpers = threads > 1 ? threads - 1 : 0;
+    if (helpers > 0) {
+        {
+            std::lock_guard lock(mutex_);
+            while (threads_.size() < helpers) {
+                threads_.emplace_back([this] {
+                    WorkerLoop();
+                });
+            }
+            task_ = &task;
+            pending_ = helpers;
+        }
+        task_ready_.notify_all();
+    }
+
+    task();
+
+    if (helpers > 0) {
+        std::unique_lock lock(mutex_);
+        task_done_.wait(lock, [this] {
+            return pending_ == 0 && running_ == 0;
+        });
+        task_ = nullptr;
+    }
+}
+
+void WorkerPool::WorkerLoop() {
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        task_ready_.wait(lock, [this] {
+            return pending_ > 0 || stop_;
+        });
+        if (stop_) {
+            return;
+        }
+        --pending_;
+        ++running_;
+        const std::function<void()>& task = *task_;
+        lock.unlock();
+        task();
+        lock.lock();
+        --running_;
+        if (pending_ == 0 && running_ == 0) {
+            task_done_.notify_one();
+        }
+    }
+}
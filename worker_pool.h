@@ -0,0 +1,41 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Постоянные потоки для параллельных частей операций таблицы. Потоки
+// создаются при первой надобности и ждут следующей задачи, так что частые
+// небольшие пакеты (например, от CommandServer) не платят за создание
+// потоков на каждый вызов.
+class WorkerPool {
+public:
+    WorkerPool() = default;
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    ~WorkerPool();
+
+    // Выполняет task в вызывающем потоке и ещё в threads - 1 потоках пула и
+    // возвращает управление, когда все копии завершились. Поток пула может
+    // выполнить несколько копий подряд, поэтому task должна сама делить
+    // работу, например через общий счётчик. task не бросает исключений.
+    // Вызывается из одного потока за раз.
+    void Run(unsigned threads, const std::function<void()>& task);
+
+private:
+    void WorkerLoop();
+
+    std::mutex mutex_;
+    // будит потоки пула, когда появились копии задачи или пул закрывается
+    std::condition_variable task_ready_;
+    // будит Run(), когда копии задачи завершились
+    std::condition_variable task_done_;
+    const std::function<void()>* task_ = nullptr;
+    // копии задачи, ещё не взятые потоками пула, и выполняемые сейчас
+    unsigned pending_ = 0;
+    unsigned running_ = 0;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+};
@@ -0,0 +1,594 @@
+#include "write_ahead_log.h"
+
+#include "number_columns.h"
+#include "sheet.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Файл начинается с заголовка: сигнатура и поколение. Запись - длина
+// содержимого, его контрольная сумма и само содержимое: тип, позиция или
+// сдвиг и данные. Запись с неверной длиной или суммой считается
+// недописанной, на ней чтение останавливается.
+namespace {
+    constexpr char LOG_MAGIC[8] = { 'S', 'S', 'W', 'A', 'L', '0', '0', '1' };
+    constexpr char SNAPSHOT_MAGIC[8] = { 'S', 'S', 'S', 'N', 'P', '0', '0', '1' };
+    constexpr std::size_t HEADER_SIZE = sizeof(LOG_MAGIC) + sizeof(std::uint64_t);
+    constexpr std::size_t RECORD_HEADER_SIZE = 2 * sizeof(std::uint32_t);
+    // больше любой правдоподобной записи; длиннее - значит мусор
+    constexpr std::uint32_t MAX_RECORD_SIZE = 1 << 30;
+
+    enum class RecordType : std::uint8_t {
+        Text = 1,
+        Number,
+        Clear,
+        Shift,
+    };
+
+    // FNV-1a; продолжает сумму hash, так что содержимое можно считать по частям
+    std::uint32_t Checksum(std::string_view data, std::uint32_t hash = 2166136261u) {
+        for (char c : data) {
+            hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return hash;
+    }
+
+    template <typename T>
+    void Put(std::string& output, T value) {
+        char bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        output.append(bytes, sizeof(T));
+    }
+
+    template <typename T>
+    T Take(std::string_view& input) {
+        T value{};
+        std::memcpy(&value, input.data(), sizeof(T));
+        input.remove_prefix(sizeof(T));
+        return value;
+    }
+
+    // Начало содержимого записи: тип и позиция или сдвиг
+    class RecordHead {
+    public:
+        RecordHead(RecordType type, Position pos) {
+            Put(type);
+            Put(static_cast<std::uint16_t>(pos.row));
+            Put(static_cast<std::uint16_t>(pos.col));
+        }
+
+        explicit RecordHead(const PositionShift& shift) {
+            Put(RecordType::Shift);
+            Put(shift.axis);
+            Put(static_cast<std::int32_t>(shift.first));
+            Put(static_cast<std::int32_t>(shift.count));
+        }
+
+        std::string_view Get() const {
+            return { bytes_, size_ };
+        }
+
+    private:
+        template <typename T>
+        void Put(T value) {
+            std::memcpy(bytes_ + size_, &value, sizeof(T));
+            size_ += sizeof(T);
+        }
+
+        char bytes_[16];
+        std::size_t size_ = 0;
+    };
+
+    // Дописывает в output запись с содержимым head и text
+    void PutRecord(std::string& output, std::string_view head, std::string_view text) {
+        Put(output, static_cast<std::uint32_t>(head.size() + text.size()));
+        Put(output, Checksum(text, Checksum(head)));
+        output += head;
+        output += text;
+    }
+
+    Position TakePosition(std::string_view& input) {
+        const int row = Take<std::uint16_t>(input);
+        const int col = Take<std::uint16_t>(input);
+        return { row, col };
+    }
+
+    std::string MakeHeader(const char (&magic)[8], std::uint64_t generation) {
+        std::string header(magic, sizeof(magic));
+        Put(header, generation);
+        return header;
+    }
+
+    [[noreturn]] void ThrowError(int error, const std::string& what) {
+        throw std::system_error(error, std::generic_category(), what);
+    }
+
+#ifdef SPREADSHEET_POSIX_AVAILABLE
+    // Открывает файл для записи, создавая его при необходимости
+    int OpenFile(const std::string& path, bool truncate) {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+        if (fd < 0) {
+            ThrowError(errno, "open " + path);
+        }
+        return fd;
+    }
+
+    void CloseFile(int fd) {
+        ::close(fd);
+    }
+
+    // Обрезает файл до size байт; следующая запись пойдёт в его конец
+    void TruncateFile(int fd, std::uint64_t size, const std::string& path) {
+        if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+            ThrowError(errno, "ftruncate " + path);
+        }
+        if (::lseek(fd, 0, SEEK_END) < 0) {
+            ThrowError(errno, "lseek " + path);
+        }
+    }
+
+    void WriteAll(int fd, std::string_view data, const std::string& path) {
+        while (!data.empty()) {
+            const ssize_t written = ::write(fd, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ThrowError(errno, "write " + path);
+            }
+            data.remove_prefix(static_cast<std::size_t>(written));
+        }
+    }
+
+    // Дожидается записи данных файла на диск; с metadata - и его размера,
+    // и времён, как нужно перед переименованием нового файла
+    void SyncFile(int fd, bool metadata, const std::string& path) {
+        if ((metadata ? ::fsync(fd) : ::fdatasync(fd)) != 0) {
+            ThrowError(errno, (metadata ? "fsync " : "fdatasync ") + path);
+        }
+    }
+
+    // Дожидается записи на диск каталога с файлом path, то есть его имени
+    // после переименования
+    void SyncDirectory(const std::string& path) {
+        std::string directory = std::filesystem::path(path).parent_path().string();
+        if (directory.empty()) {
+            directory = ".";
+        }
+        const int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            ThrowError(errno, "open " + directory);
+        }
+        const int result = ::fsync(fd);
+        const int error = errno;
+        ::close(fd);
+        if (result != 0) {
+            ThrowError(error, "fsync " + directory);
+        }
+    }
+#else
+    [[noreturn]] void ThrowUnsupported(const std::string& what) {
+        throw std::system_error(std::make_error_code(std::errc::function_not_supported), what);
+    }
+
+    // Без POSIX журнал не открывается, и остальные функции недостижимы
+    int OpenFile(const std::string& path, bool) {
+        ThrowUnsupported("open " + path);
+    }
+
+    void CloseFile(int) {
+    }
+
+    void TruncateFile(int, std::uint64_t, const std::string& path) {
+        ThrowUnsupported("ftruncate " + path);
+    }
+
+    void WriteAll(int, std::string_view, const std::string& path) {
+        ThrowUnsupported("write " + path);
+    }
+
+    void SyncFile(int, bool, const std::string& path) {
+        ThrowUnsupported("fsync " + path);
+    }
+
+    void SyncDirectory(const std::string& path) {
+        ThrowUnsupported("fsync " + path);
+    }
+#endif
+
+    // Содержимое файла журнала или снимка: поколение из заголовка и записи
+    // до первой повреждённой
+    class RecordReader {
+    public:
+        RecordReader(const std::string& path, const char (&magic)[8])
+            : input_(path, std::ios::binary) {
+            char header[HEADER_SIZE];
+            if (input_.read(header, HEADER_SIZE) && std::memcmp(header, magic, sizeof(magic)) == 0) {
+                std::memcpy(&generation_, header + sizeof(magic), sizeof(generation_));
+                valid_ = true;
+                valid_end_ = HEADER_SIZE;
+            }
+        }
+
+        // Есть ли файл с таким заголовком
+        bool IsValid() const {
+            return valid_;
+        }
+        std::uint64_t GetGeneration() const {
+            return generation_;
+        }
+        // Конец последней целой записи
+        std::uint64_t GetValidEnd() const {
+            return valid_end_;
+        }
+
+        // Содержимое следующей записи или false в конце целых записей
+        bool Next(std::string& payload) {
+            if (!valid_) {
+                return false;
+            }
+            char header[RECORD_HEADER_SIZE];
+            if (!input_.read(header, RECORD_HEADER_SIZE)) {
+                return false;
+            }
+            std::uint32_t size;
+            std::uint32_t checksum;
+            std::memcpy(&size, header, sizeof(size));
+            std::memcpy(&checksum, header + sizeof(size), sizeof(checksum));
+            if (size == 0 || size > MAX_RECORD_SIZE) {
+                return false;
+            }
+            payload.resize(size);
+            if (!input_.read(payload.data(), size) || Checksum(payload) != checksum) {
+                return false;
+            }
+            valid_end_ += RECORD_HEADER_SIZE + size;
+            return true;
+        }
+
+    private:
+        std::ifstream input_;
+        bool valid_ = false;
+        std::uint64_t generation_ = 0;
+        std::uint64_t valid_end_ = 0;
+    };
+
+    // Перезаписывает файл журнала пустым журналом поколения generation
+    void ResetLog(int fd, std::uint64_t generation, const std::string& path) {
+        TruncateFile(fd, 0, path);
+        WriteAll(fd, MakeHeader(LOG_MAGIC, generation), path);
+        SyncFile(fd, false, path);
+    }
+
+    // Применяет содержимое записи журнала к таблице
+    void ApplyRecord(std::string_view payload, Sheet& sheet) {
+        const auto type = Take<RecordType>(payload);
+        if (type == RecordType::Shift) {
+            PositionShift shift;
+            shift.axis = Take<PositionShift::Axis>(payload);
+            shift.first = Take<std::int32_t>(payload);
+            shift.count = Take<std::int32_t>(payload);
+            const bool rows = shift.axis == PositionShift::Axis::Rows;
+            if (shift.count > 0) {
+                rows ? sheet.InsertRows(shift.first, shift.count) : sheet.InsertCols(shift.first, shift.count);
+            }
+            else {
+                rows ? sheet.DeleteRows(shift.first, -shift.count) : sheet.DeleteCols(shift.first, -shift.count);
+            }
+            return;
+        }
+
+        const Position pos = TakePosition(payload);
+        switch (type) {
+        case RecordType::Text:
+            sheet.RestoreCell(pos, std::string(payload));
+            break;
+        case RecordType::Number:
+            sheet.RestoreCell(pos, NumberColumns::Format(Take<double>(payload)));
+            break;
+        default:
+            sheet.RestoreCell(pos, {});
+            break;
+        }
+    }
+}  // namespace
+
+WriteAheadLog::WriteAheadLog(const std::string& path)
+    : WriteAheadLog(path, Options{}) {
+}
+
+WriteAheadLog::WriteAheadLog(const std::string& path, Options options)
+    : options_(options) {
+    std::uint64_t valid_end = 0;
+    {
+        RecordReader reader(path, LOG_MAGIC);
+        std::string payload;
+        while (reader.Next(payload)) {
+        }
+        generation_ = reader.GetGeneration();
+        valid_end = reader.IsValid() ? reader.GetValidEnd() : 0;
+    }
+
+    fd_ = OpenFile(path, false);
+    try {
+        if (valid_end == 0) {
+            ResetLog(fd_, generation_, path);
+        }
+        else {
+            // отрезается хвост, недописанный при сбое
+            TruncateFile(fd_, valid_end, path);
+        }
+    }
+    catch (...) {
+        CloseFile(fd_);
+        throw;
+    }
+
+    flusher_ = std::thread([this] {
+        FlushLoop();
+    });
+}
+
+WriteAheadLog::~WriteAheadLog() {
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    flush_requested_.notify_one();
+    flusher_.join();
+    CloseFile(fd_);
+}
+
+void WriteAheadLog::AppendText(Position pos, std::string_view text) {
+    Append(RecordHead(RecordType::Text, pos).Get(), text);
+}
+
+void WriteAheadLog::AppendNumber(Position pos, double value) {
+    char bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+    Append(RecordHead(RecordType::Number, pos).Get(), std::string_view(bytes, sizeof(bytes)));
+}
+
+void WriteAheadLog::AppendClear(Position pos) {
+    Append(RecordHead(RecordType::Clear, pos).Get(), {});
+}
+
+void WriteAheadLog::AppendShift(const PositionShift& shift) {
+    Append(RecordHead(shift).Get(), {});
+}
+
+// Запись собирается прямо в буфере группы, без промежуточной строки.
+// Вызывается, когда таблица уже изменена, поэтому об ошибке сообщают Sync()
+// и GetError(), а не исключение посреди правки.
+void WriteAheadLog::Append(std::string_view head, std::string_view text) {
+    std::unique_lock lock(mutex_);
+    // если диск не успевает, правки ждут, а не копят буфер без предела
+    flushed_.wait(lock, [this] {
+        return pending_.size() < 4 * options_.batch_bytes || error_ != 0;
+    });
+    if (error_ != 0) {
+        return;
+    }
+
+    const bool first = pending_.empty();
+    PutRecord(pending_, head, text);
+    ++appended_;
+    if (first || pending_.size() >= options_.batch_bytes) {
+        flush_requested_.notify_one();
+    }
+}
+
+void WriteAheadLog::Sync() {
+    std::unique_lock lock(mutex_);
+    const std::uint64_t target = appended_;
+    sync_requested_ = true;
+    flush_requested_.notify_one();
+    flushed_.wait(lock, [this, target] {
+        return durable_ >= target || error_ != 0;
+    });
+    ThrowIfFailed();
+}
+
+void WriteAheadLog::Restart() {
+    std::unique_lock lock(mutex_);
+    flushed_.wait(lock, [this] {
+        return !writing_;
+    });
+    ThrowIfFailed();
+    // несброшенные записи уже вошли в снимок
+    pending_.clear();
+    durable_ = appended_;
+    try {
+        ResetLog(fd_, generation_ + 1, "write-ahead log");
+    }
+    catch (const std::system_error& error) {
+        error_ = error.code().value();
+        flushed_.notify_all();
+        throw;
+    }
+    ++generation_;
+    flushed_.notify_all();
+}
+
+std::error_code WriteAheadLog::GetError() const {
+    std::lock_guard lock(mutex_);
+    return error_ != 0 ? std::error_code(error_, std::generic_category()) : std::error_code();
+}
+
+std::uint64_t WriteAheadLog::GetGeneration() const {
+    std::lock_guard lock(mutex_);
+    return generation_;
+}
+
+std::uint64_t WriteAheadLog::GetRecordCount() const {
+    std::lock_guard lock(mutex_);
+    return appended_;
+}
+
+std::uint64_t WriteAheadLog::GetBatchCount() const {
+    std::lock_guard lock(mutex_);
+    return batches_;
+}
+
+void WriteAheadLog::ThrowIfFailed() const {
+    if (error_ != 0) {
+        ThrowError(error_, "write-ahead log");
+    }
+}
+
+// Группа собирается, пока не истечёт окно от первой записи, не наберётся
+// batch_bytes или не попросят Sync(). Запись на диск идёт без блокировки,
+// так что правки продолжают копиться в pending_.
+void WriteAheadLog::FlushLoop() {
+    std::unique_lock lock(mutex_);
+    std::string batch;
+    for (;;) {
+        flush_requested_.wait(lock, [this] {
+            return !pending_.empty() || sync_requested_ || stop_;
+        });
+        flush_requested_.wait_for(lock, options_.window, [this] {
+            return pending_.size() >= options_.batch_bytes || sync_requested_ || stop_;
+        });
+        if (pending_.empty()) {
+            sync_requested_ = false;
+            flushed_.notify_all();
+            if (stop_) {
+                return;
+            }
+            continue;
+        }
+
+        batch.swap(pending_);
+        const std::uint64_t target = appended_;
+        sync_requested_ = false;
+        writing_ = true;
+        lock.unlock();
+        int error = 0;
+        try {
+            Write(batch);
+        }
+        catch (const std::system_error& e) {
+            error = e.code().value();
+        }
+        batch.clear();
+        lock.lock();
+        writing_ = false;
+        if (error != 0) {
+            error_ = error;
+        }
+        else {
+            durable_ = std::max(durable_, target);
+            ++batches_;
+        }
+        flushed_.notify_all();
+        if (error != 0) {
+            return;
+        }
+    }
+}
+
+void WriteAheadLog::Write(const std::string& data) {
+    WriteAll(fd_, data, "write-ahead log");
+    SyncFile(fd_, false, "write-ahead log");
+}
+
+std::size_t WriteAheadLog::Replay(const std::string& path, Sheet& sheet) {
+    RecordReader reader(path, LOG_MAGIC);
+    std::size_t count = 0;
+    std::string payload;
+    while (reader.Next(payload)) {
+        ApplyRecord(payload, sheet);
+        ++count;
+    }
+    return count;
+}
+
+// Снимок хранит ячейки записями Text и Number; поколение в заголовке -
+// первое поколение журнала, которое в снимок не вошло
+void WriteSnapshot(const Sheet& sheet, WriteAheadLog& log, const std::string& path) {
+    std::string data = MakeHeader(SNAPSHOT_MAGIC, log.GetGeneration() + 1);
+    sheet.ForEachText([&data](Position pos, std::string_view text) {
+        PutRecord(data, RecordHead(RecordType::Text, pos).Get(), text);
+    });
+
+    const std::string temporary = path + ".tmp";
+    const int fd = OpenFile(temporary, true);
+    try {
+        WriteAll(fd, data, temporary);
+        SyncFile(fd, true, temporary);
+    }
+    catch (...) {
+        CloseFile(fd);
+        throw;
+    }
+    CloseFile(fd);
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        ThrowError(errno, "rename " + temporary);
+    }
+    // Журнал сбрасывается только после того, как новое имя снимка на
+    // диске: иначе после сбоя остались бы прежний снимок и пустой журнал
+    SyncDirectory(path);
+    log.Restart();
+}
+
+std::size_t RecoverSheet(Sheet& sheet, const std::string& snapshot_path, const std::string& log_path) {
+    // снимок не содержит циклов, поэтому формулы разбираются пакетом
+    std::uint64_t first_generation = 0;
+    {
+        RecordReader reader(snapshot_path, SNAPSHOT_MAGIC);
+        std::vector<std::pair<Position, std::string>> cells;
+        std::string payload;
+        while (reader.Next(payload)) {
+            std::string_view data = payload;
+            Take<RecordType>(data);
+            const Position pos = TakePosition(data);
+            cells.emplace_back(pos, std::string(data));
+        }
+        sheet.SetCells(std::move(cells));
+        first_generation = reader.GetGeneration();
+    }
+
+    const RecordReader log_reader(log_path, LOG_MAGIC);
+    if (log_reader.IsValid() && log_reader.GetGeneration() > first_generation) {
+        // журнал начат после снимка, которого нет на диске: правки
+        // пропущенных поколений потеряны
+        throw std::runtime_error("write-ahead log " + log_path + " has generation "
+            + std::to_string(log_reader.GetGeneration()) + ", but the snapshot covers only generations before "
+            + std::to_string(first_generation));
+    }
+    if (log_reader.IsValid() && log_reader.GetGeneration() == first_generation) {
+        return WriteAheadLog::Replay(log_path, sheet);
+    }
+    if (!log_reader.IsValid() && first_generation == 0) {
+        return 0;
+    }
+
+    // Сбой между сохранением снимка и перезапуском журнала: журнал уже в
+    // снимке, и дописывать в него дальше нельзя. Если сбой пришёлся на
+    // середину Restart(), журнал остался без заголовка, и без перезаписи
+    // WriteAheadLog начал бы его с поколения 0, которое следующее
+    // восстановление сочло бы вошедшим в снимок.
+    const int fd = OpenFile(log_path, false);
+    try {
+        ResetLog(fd, first_generation, log_path);
+    }
+    catch (...) {
+        CloseFile(fd);
+        throw;
+    }
+    CloseFile(fd);
+    return 0;
+}
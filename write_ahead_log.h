@@ -0,0 +1,127 @@
+#pragma once
+
+#include "common.h"
+#include "platform.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+
+class Sheet;
+
+// Журнал упреждающей записи: каждое изменение ячейки дописывается в файл
+// компактной двоичной записью. Запись кладётся в буфер и возвращает
+// управление сразу. Фоновый поток сбрасывает накопленные записи одним
+// write() и одним fdatasync() на группу: по истечении окна после первой
+// несброшенной записи или когда буфер достиг размера группы. Так правка не
+// ждёт диска, а при сбое теряются только записи последнего окна; Sync()
+// дожидается сохранения всего записанного.
+//
+// Записи хранят новое состояние ячейки (текст, число или пустую ячейку) и
+// сдвиги строк и столбцов, поэтому в журнал попадают и правки, сделанные
+// через SetCells(), FillRange(), Undo() и Redo(). Формат привязан к порядку
+// байтов машины. После ошибки ввода-вывода журнал непригоден: Append*() не
+// бросают, чтобы не прерывать уже начатую правку таблицы, и молча
+// отбрасывают записи, а Sync() и Restart() бросают std::system_error.
+// Без POSIX (см. platform.h) журнал и снимок не открываются: конструктор и
+// WriteSnapshot() бросают std::system_error.
+//
+// Типичный порядок работы:
+//   Sheet sheet;
+//   RecoverSheet(sheet, "book.snapshot", "book.wal");
+//   WriteAheadLog log("book.wal");
+//   sheet.SetWriteAheadLog(&log);
+//   ...
+//   WriteSnapshot(sheet, log, "book.snapshot");  // журнал начинается заново
+class WriteAheadLog {
+public:
+    struct Options {
+        // сколько самая старая несброшенная запись ждёт группы
+        std::chrono::microseconds window{ 2000 };
+        // размер группы, после которого записи сбрасываются, не дожидаясь окна
+        std::size_t batch_bytes = 1 << 20;
+    };
+
+    // Открывает журнал для дописывания, создавая его при необходимости.
+    // Недописанный при сбое хвост отрезается.
+    explicit WriteAheadLog(const std::string& path);
+    WriteAheadLog(const std::string& path, Options options);
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    // Сбрасывает оставшиеся записи на диск
+    ~WriteAheadLog();
+
+    void AppendText(Position pos, std::string_view text);
+    void AppendNumber(Position pos, double value);
+    void AppendClear(Position pos);
+    void AppendShift(const PositionShift& shift);
+
+    // Ждёт, пока все добавленные до вызова записи окажутся на диске
+    void Sync();
+    // Ошибка, после которой журнал непригоден, или пустой код. Не ждёт диска.
+    std::error_code GetError() const;
+
+    // Начинает журнал заново со следующим поколением. Вызывается после того,
+    // как снимок таблицы со всеми записями журнала сохранён на диск.
+    void Restart();
+
+    // Поколение растёт при каждом Restart(); снимок помнит, с какого
+    // поколения журнал ещё не вошёл в него
+    std::uint64_t GetGeneration() const;
+    // Добавленные записи и группы, сброшенные на диск
+    std::uint64_t GetRecordCount() const;
+    std::uint64_t GetBatchCount() const;
+
+    // Применяет к sheet записи журнала из файла path через
+    // Sheet::RestoreCell() и сдвиги строк и столбцов, возвращает их число.
+    // Чтение останавливается на первой повреждённой или недописанной записи.
+    static std::size_t Replay(const std::string& path, Sheet& sheet);
+
+private:
+    // Дописывает запись с содержимым head и text
+    void Append(std::string_view head, std::string_view text);
+    void FlushLoop();
+    void Write(const std::string& data);
+    void ThrowIfFailed() const;
+
+    const Options options_;
+    int fd_ = -1;
+    std::uint64_t generation_ = 0;
+
+    mutable std::mutex mutex_;
+    // будит поток сброса
+    std::condition_variable flush_requested_;
+    // будит ожидающих в Sync() и в переполненном Append()
+    std::condition_variable flushed_;
+    std::string pending_;
+    // номера последней добавленной записи и последней сохранённой
+    std::uint64_t appended_ = 0;
+    std::uint64_t durable_ = 0;
+    std::uint64_t batches_ = 0;
+    bool sync_requested_ = false;
+    bool writing_ = false;
+    bool stop_ = false;
+    int error_ = 0;
+    std::thread flusher_;
+};
+
+// Сохраняет все непустые ячейки таблицы в файл path в формате журнала и
+// начинает журнал log заново. Снимок пишется во временный файл, который
+// переименовывается после fsync(), поэтому при сбое остаётся прежний снимок.
+// Журнал сбрасывается только после fsync() каталога с новым именем снимка.
+void WriteSnapshot(const Sheet& sheet, WriteAheadLog& log, const std::string& path);
+
+// Восстанавливает таблицу: применяет последний снимок, затем журнал, если он
+// не вошёл в снимок. Отсутствующие файлы пропускаются. Журнал, вошедший в
+// снимок, повреждённый или отсутствующий при наличии снимка, перезаписывается
+// пустым журналом следующего за снимком поколения; без POSIX вместо этого
+// бросается std::system_error. Журнал поколения новее снимка означает, что
+// снимок с частью правок потерян; тогда бросается std::runtime_error.
+// Возвращает число применённых записей журнала.
+std::size_t RecoverSheet(Sheet& sheet, const std::string& snapshot_path, const std::string& log_path);